@@ -0,0 +1,33 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include "CancellableFile.h"
+
+
+qint64 CancellableFile::readData( char * data, qint64 maxSize )
+{
+    if ( _token.isCancelled() )
+    {
+	setErrorString( "Cancelled" );
+	return -1;
+    }
+
+    return QFile::readData( data, maxSize );
+}
+
+
+qint64 CancellableBuffer::readData( char * data, qint64 maxSize )
+{
+    if ( _token.isCancelled() )
+    {
+	setErrorString( "Cancelled" );
+	return -1;
+    }
+
+    return QBuffer::readData( data, maxSize );
+}
@@ -0,0 +1,122 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef CancellableFile_h
+#define CancellableFile_h
+
+#include <QFile>
+#include <QBuffer>
+#include <QAtomicInt>
+#include <QSharedPointer>
+
+
+/**
+ * Token for cooperative cancellation of a job that runs in another thread.
+ * Copies of a token share the same state, so the thread that owns the job
+ * keeps one copy and checks it every now and then, and any other thread can
+ * cancel the job with another copy.
+ */
+class CancelToken
+{
+public:
+    /**
+     * Constructor: Create a new token that is not cancelled.
+     */
+    CancelToken()
+	: _cancelled( new QAtomicInt( 0 ) )
+	{}
+
+    /**
+     * Cancel the job this token belongs to. This is thread-safe.
+     */
+    void cancel() { _cancelled->storeRelease( 1 ); }
+
+    /**
+     * Return 'true' if the job this token belongs to was cancelled.
+     */
+    bool isCancelled() const { return _cancelled->loadAcquire() != 0; }
+
+    /**
+     * Return 'true' if this and 'other' are copies of the same token.
+     */
+    bool operator==( const CancelToken & other ) const
+	{ return _cancelled == other._cancelled; }
+
+private:
+
+    QSharedPointer<QAtomicInt> _cancelled;
+};
+
+
+/**
+ * File that can be cancelled while it is being read: Once its CancelToken
+ * is cancelled, every read fails, so a QImageReader working on it aborts at
+ * the next read, typically within a few scan lines.
+ *
+ * The file should be opened with QIODevice::Unbuffered; otherwise QIODevice
+ * may already have buffered more data than the decoder needs next.
+ */
+class CancellableFile: public QFile
+{
+public:
+    /**
+     * Constructor.
+     */
+    CancellableFile( const QString & fileName, const CancelToken & token )
+	: QFile( fileName )
+	, _token( token )
+	{}
+
+    /**
+     * Return the token this file checks before each read.
+     */
+    const CancelToken & token() const { return _token; }
+
+protected:
+
+    /**
+     * Reimplemented from QFile: Fail if the token was cancelled.
+     */
+    virtual qint64 readData( char * data, qint64 maxSize ) Q_DECL_OVERRIDE;
+
+private:
+
+    CancelToken _token;
+};
+
+
+/**
+ * Buffer that can be cancelled while it is being read, just like
+ * CancellableFile. This is for reading a file that is mapped into memory
+ * (see MappedFile) through a QIODevice.
+ */
+class CancellableBuffer: public QBuffer
+{
+public:
+    /**
+     * Constructor.
+     */
+    CancellableBuffer( const CancelToken & token )
+	: QBuffer()
+	, _token( token )
+	{}
+
+protected:
+
+    /**
+     * Reimplemented from QBuffer: Fail if the token was cancelled.
+     */
+    virtual qint64 readData( char * data, qint64 maxSize ) Q_DECL_OVERRIDE;
+
+private:
+
+    CancelToken _token;
+};
+
+
+#endif // CancellableFile_h
@@ -7,16 +7,20 @@
  */
 
 #include <QGraphicsSceneMouseEvent>
+#include <QStyleOptionGraphicsItem>
+#include <QPainter>
 #include <QMenu>
 
 #include "Canvas.h"
 #include "PhotoView.h"
 #include "Panner.h"
+#include "TileCache.h"
 #include "GraphicsItemPosAnimation.h"
 #include "Logger.h"
 
 
 static const int AnimationDuration =  850; // millisec
+static const int WheelStep	   =  120; // delta of one wheel notch (15 degrees)
 
 
 Canvas::Canvas( PhotoView * parent )
@@ -24,10 +28,15 @@ Canvas::Canvas( PhotoView * parent )
     , _photoView( parent )
     , _panning( false )
     , _animation( 0 )
+    , _tileCache( 0 )
+    , _wheelDelta( 0 )
 {
     Q_CHECK_PTR( _photoView );
 
     _photoView->scene()->addItem( this );
+
+    // Needed for a useful exposedRect in paint()
+    setFlag( QGraphicsItem::ItemUsesExtendedStyleOption );
     setCursor( Qt::OpenHandCursor );
     _cursor = cursor();
 }
@@ -42,19 +51,120 @@ Canvas::~Canvas()
 
 QSize Canvas::size() const
 {
+    if ( _tileCache )
+	return _tileCache->size();
+
     return pixmap().size();
 }
 
 
 void Canvas::clear()
 {
+    setTileCache( 0 );
     setPixmap( QPixmap() );
 }
 
 
+void Canvas::setTileCache( TileCache * tileCache, const QPixmap & placeholder )
+{
+    prepareGeometryChange();
+    _tileCache	 = tileCache;
+    _placeholder = tileCache ? placeholder : QPixmap();
+
+    if ( _tileCache )
+	setPixmap( QPixmap() );
+
+    update();
+}
+
+
+QRect Canvas::visibleRect() const
+{
+    QPolygonF viewport = _photoView->mapToScene( _photoView->viewport()->rect() );
+
+    return mapFromScene( viewport ).boundingRect().toAlignedRect();
+}
+
+
+QRectF Canvas::boundingRect() const
+{
+    if ( _tileCache )
+	return QRectF( QPointF( 0.0, 0.0 ), _tileCache->size() );
+
+    return QGraphicsPixmapItem::boundingRect();
+}
+
+
+QPainterPath Canvas::shape() const
+{
+    if ( _tileCache )
+    {
+	QPainterPath path;
+	path.addRect( boundingRect() );
+
+	return path;
+    }
+
+    return QGraphicsPixmapItem::shape();
+}
+
+
+void Canvas::paint( QPainter *			     painter,
+		    const QStyleOptionGraphicsItem * option,
+		    QWidget *			     widget )
+{
+    if ( ! _tileCache )
+    {
+	QGraphicsPixmapItem::paint( painter, option, widget );
+	return;
+    }
+
+    const int tileSize = TileCache::TileSize;
+    QRect bounds  = boundingRect().toRect();
+    QRect visible = visibleRect() & bounds;
+
+    // Request the visible tiles plus a margin of one tile for panning
+
+    _tileCache->request( visible.adjusted( -tileSize, -tileSize,
+					   tileSize,  tileSize ) );
+
+    QRect exposed = option->exposedRect.toAlignedRect() & visible;
+
+    if ( exposed.isEmpty() )
+	return;
+
+    for ( int y = exposed.top() / tileSize; y <= exposed.bottom() / tileSize; ++y )
+    {
+	for ( int x = exposed.left() / tileSize; x <= exposed.right() / tileSize; ++x )
+	{
+	    QPoint tilePos( x, y );
+	    QRect  rect = _tileCache->tileRect( tilePos );
+	    QImage tile = _tileCache->tile( tilePos );
+
+	    if ( ! tile.isNull() )
+	    {
+		painter->drawImage( rect.topLeft(), tile );
+	    }
+	    else if ( ! _placeholder.isNull() )
+	    {
+		// Not rendered yet: Scale up the same part of the placeholder
+
+		qreal scaleX = _placeholder.width()  / (qreal) bounds.width();
+		qreal scaleY = _placeholder.height() / (qreal) bounds.height();
+
+		QRectF source( rect.x()	    * scaleX, rect.y()	    * scaleY,
+			       rect.width() * scaleX, rect.height() * scaleY );
+
+		painter->drawPixmap( QRectF( rect ), _placeholder, source );
+	    }
+	}
+    }
+}
+
+
 void Canvas::center( const QSize & parentSize )
 {
-    QSize pixmapSize = pixmap().size();
+    QSize pixmapSize = size();
     qreal x = pos().x();
     qreal y = pos().y();
 
@@ -175,12 +285,23 @@ void Canvas::mouseDoubleClickEvent ( QGraphicsSceneMouseEvent * event )
 
 void Canvas::wheelEvent( QGraphicsSceneWheelEvent * event )
 {
-    if ( event->delta() > 0 ) // scroll up
+    // High resolution wheels and touchpads send many events with a fraction
+    // of a wheel step each: Collect them and navigate only once per step.
+
+    if ( ( event->delta() > 0 ) != ( _wheelDelta > 0 ) )
+	_wheelDelta = 0; // changed direction
+
+    _wheelDelta += event->delta();
+
+    while ( _wheelDelta >= WheelStep ) // scroll up
     {
+	_wheelDelta -= WheelStep;
 	_photoView->navigate( PhotoView::NavigatePrevious );
     }
-    else if ( event->delta() < 0 ) // scroll down
+
+    while ( _wheelDelta <= -WheelStep ) // scroll down
     {
+	_wheelDelta += WheelStep;
 	_photoView->navigate( PhotoView::NavigateNext );
     }
 }
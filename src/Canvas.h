@@ -13,12 +13,17 @@
 #include <QCursor>
 
 class PhotoView;
+class TileCache;
 class QGraphicsSceneMouseEvent;
 class GraphicsItemPosAnimation;
 
 
 /**
  * Canvas for PhotoView: A graphics item that shows the photo.
+ *
+ * Normally, this shows one pixmap of the complete photo. With high zoom
+ * factors, it shows only the tiles of a TileCache that are visible in the
+ * viewport instead (see setTileCache()).
  */
 class Canvas: public QGraphicsPixmapItem
 {
@@ -40,10 +45,39 @@ public:
     QSize size() const;
 
     /**
-     * Clear the current pixmap.
+     * Clear the current pixmap or tile cache.
      */
     void clear();
 
+    /**
+     * Show the tiles of 'tileCache' instead of a pixmap. Tiles that are not
+     * rendered yet are requested from the tile cache, and meanwhile the
+     * matching part of 'placeholder' is scaled up instead. 'placeholder'
+     * should be the complete photo in any smaller size.
+     *
+     * If 'tileCache' is 0, the canvas shows its pixmap again; set that with
+     * setPixmap().
+     */
+    void setTileCache( TileCache * tileCache, const QPixmap & placeholder = QPixmap() );
+
+    /**
+     * Return the tile cache or 0 if the canvas shows a pixmap.
+     */
+    TileCache * tileCache() const { return _tileCache; }
+
+    /**
+     * Notify the scene that the size of the canvas is about to change.
+     * Call this before changing the image of the tile cache that the canvas
+     * shows: Its size is the size of the canvas (see boundingRect()).
+     */
+    void prepareSizeChange() { prepareGeometryChange(); }
+
+    /**
+     * Return the part of the canvas (in item coordinates) that is visible
+     * in the viewport of the PhotoView parent.
+     */
+    QRect visibleRect() const;
+
     /**
      * Center inside the viewport of the PhotoView parent if this canvas is
      * smaller than the viewport.
@@ -81,6 +115,22 @@ public:
     void showCursor();
 
 
+    /**
+     * Reimplemented from QGraphicsPixmapItem: Use the size of the zoomed
+     * image of the tile cache if there is one.
+     */
+    virtual QRectF boundingRect() const Q_DECL_OVERRIDE;
+    virtual QPainterPath shape() const Q_DECL_OVERRIDE;
+
+    /**
+     * Reimplemented from QGraphicsPixmapItem: Paint the visible tiles of the
+     * tile cache if there is one.
+     */
+    virtual void paint( QPainter *			 painter,
+			const QStyleOptionGraphicsItem * option,
+			QWidget *			 widget ) Q_DECL_OVERRIDE;
+
+
 protected:
 
     //
@@ -108,7 +158,8 @@ protected:
     virtual void mouseDoubleClickEvent ( QGraphicsSceneMouseEvent * event ) Q_DECL_OVERRIDE;
 
     /**
-     * Mouse wheel: load the next or the previous image
+     * Mouse wheel: load the next or the previous image for each full wheel
+     * step
      */
     virtual void wheelEvent( QGraphicsSceneWheelEvent * event ) Q_DECL_OVERRIDE;
 
@@ -123,6 +174,9 @@ private:
     bool			_panning;
     GraphicsItemPosAnimation *	_animation;
     QCursor			_cursor;
+    TileCache *			_tileCache;
+    QPixmap			_placeholder;
+    int				_wheelDelta;
 };
 
 
@@ -0,0 +1,353 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QCryptographicHash>
+
+#include "DiskCache.h"
+#include "Logger.h"
+
+
+#define CACHE_FILE_SUFFIX	".qpvc"
+#define CACHE_FILE_MAGIC	"QPVCACHE"
+#define CACHE_FILE_VERSION	1
+
+
+/**
+ * Header of a cache file. The pixel data follow immediately. The header is
+ * 64 bytes so the pixel data in a mapped file are suitably aligned.
+ */
+struct DiskCacheHeader
+{
+    char	magic[8];
+    quint32	version;
+    quint32	format;		// QImage::Format
+    quint32	width;
+    quint32	height;
+    quint32	bytesPerLine;
+    quint32	origWidth;
+    quint32	origHeight;
+    quint32	reserved[7];
+};
+
+
+/**
+ * Cleanup info for a QImage that uses a memory-mapped cache file.
+ */
+struct MappedCacheFile
+{
+    void *	addr;
+    size_t	length;
+};
+
+
+static void unmapCacheFile( void * info )
+{
+    MappedCacheFile * mapped = (MappedCacheFile *) info;
+
+    munmap( mapped->addr, mapped->length );
+    delete mapped;
+}
+
+
+
+DiskCache::DiskCache( const QString & cacheDir, qint64 maxSize )
+    : _cacheDir( cacheDir )
+    , _maxSize( maxSize )
+    , _totalSize( -1 )
+    , _enabled( false )
+{
+    _enabled = QDir().mkpath( _cacheDir );
+
+    if ( _enabled )
+	logInfo() << "Using disk cache " << _cacheDir << endl;
+    else
+	logWarning() << "Can't create disk cache dir " << _cacheDir << endl;
+}
+
+
+DiskCache::~DiskCache()
+{
+
+}
+
+
+QString DiskCache::defaultCacheDir()
+{
+    QString cacheHome = QString::fromLocal8Bit( qgetenv( "XDG_CACHE_HOME" ) );
+
+    if ( cacheHome.isEmpty() )
+	cacheHome = QDir::homePath() + "/.cache";
+
+    return cacheHome + "/qphotoview";
+}
+
+
+QString DiskCache::cacheFileName( const QString & fullPath,
+				  const QSize &	  targetSize ) const
+{
+    struct stat fileInfo;
+
+    if ( stat( QFile::encodeName( fullPath ).constData(), &fileInfo ) != 0 )
+	return QString();
+
+    QByteArray key = QFile::encodeName( fullPath );
+
+    key += QString( "|%1|%2.%3|%4|%5x%6" )
+	.arg( (qlonglong)  fileInfo.st_size )
+	.arg( (qlonglong)  fileInfo.st_mtim.tv_sec )
+	.arg( (qlonglong)  fileInfo.st_mtim.tv_nsec )
+	.arg( (qulonglong) fileInfo.st_ino )
+	.arg( targetSize.width() )
+	.arg( targetSize.height() ).toLatin1();
+
+    QByteArray hash = QCryptographicHash::hash( key, QCryptographicHash::Sha1 ).toHex();
+
+    return _cacheDir + "/" + QString::fromLatin1( hash ) + CACHE_FILE_SUFFIX;
+}
+
+
+bool DiskCache::contains( const QString & fullPath, const QSize & targetSize )
+{
+    if ( ! _enabled )
+	return false;
+
+    QString fileName = cacheFileName( fullPath, targetSize );
+
+    return ! fileName.isEmpty() && QFile::exists( fileName );
+}
+
+
+QImage DiskCache::image( const QString & fullPath,
+			 const QSize &	 targetSize,
+			 QSize *	 origSize )
+{
+    if ( ! _enabled )
+	return QImage();
+
+    QString fileName = cacheFileName( fullPath, targetSize );
+
+    if ( fileName.isEmpty() )
+	return QImage();
+
+    QByteArray encodedName = QFile::encodeName( fileName );
+    int fd = open( encodedName.constData(), O_RDONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+	return QImage(); // Not in the cache
+
+    struct stat fileInfo;
+    void * addr = MAP_FAILED;
+    size_t length = 0;
+
+    if ( fstat( fd, &fileInfo ) == 0 &&
+	 fileInfo.st_size >= (off_t) sizeof( DiskCacheHeader ) )
+    {
+	length = fileInfo.st_size;
+	addr   = mmap( 0, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+
+    close( fd ); // The mapping remains valid
+
+    if ( addr == MAP_FAILED )
+	return QImage();
+
+    madvise( addr, length, MADV_WILLNEED );
+
+    const DiskCacheHeader * header = (const DiskCacheHeader *) addr;
+    const uchar * pixels = (const uchar *) addr + sizeof( DiskCacheHeader );
+
+    bool valid =
+	memcmp( header->magic, CACHE_FILE_MAGIC, sizeof( header->magic ) ) == 0 &&
+	header->version == CACHE_FILE_VERSION				   &&
+	(int) header->format > QImage::Format_Invalid			   &&
+	(int) header->format < QImage::NImageFormats			   &&
+	header->width > 0 && header->height > 0				   &&
+	(qint64) sizeof( DiskCacheHeader ) +
+	(qint64) header->bytesPerLine * header->height <= (qint64) length;
+
+    if ( ! valid )
+    {
+	logWarning() << "Corrupt disk cache file " << fileName << endl;
+	munmap( addr, length );
+	QFile::remove( fileName );
+
+	return QImage();
+    }
+
+    MappedCacheFile * mapped = new MappedCacheFile;
+    mapped->addr   = addr;
+    mapped->length = length;
+
+    QImage image( pixels,
+		  header->width,
+		  header->height,
+		  header->bytesPerLine,
+		  (QImage::Format) header->format,
+		  unmapCacheFile,
+		  mapped );
+
+    if ( image.isNull() )
+    {
+	unmapCacheFile( mapped );
+	return QImage();
+    }
+
+    if ( origSize )
+	*origSize = QSize( header->origWidth, header->origHeight );
+
+    // Update the modification time for LRU trimming
+
+    utimes( encodedName.constData(), 0 );
+
+    return image;
+}
+
+
+bool DiskCache::store( const QString & fullPath,
+		       const QSize &   targetSize,
+		       const QImage &  origImage,
+		       const QSize &   origSize )
+{
+    if ( ! _enabled || origImage.isNull() )
+	return false;
+
+    QString fileName = cacheFileName( fullPath, targetSize );
+
+    if ( fileName.isEmpty() )
+	return false;
+
+    if ( QFile::exists( fileName ) )
+	return true;
+
+    QImage image = origImage;
+
+    if ( image.depth() < 8 || image.colorCount() > 0 )
+    {
+	// Store only formats without a color table
+
+	image = image.convertToFormat( image.hasAlphaChannel() ?
+				       QImage::Format_ARGB32 :
+				       QImage::Format_RGB32 );
+    }
+
+    DiskCacheHeader header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, CACHE_FILE_MAGIC, sizeof( header.magic ) );
+    header.version	= CACHE_FILE_VERSION;
+    header.format	= image.format();
+    header.width	= image.width();
+    header.height	= image.height();
+    header.bytesPerLine = image.bytesPerLine();
+    header.origWidth	= origSize.width();
+    header.origHeight	= origSize.height();
+
+    QSaveFile file( fileName );
+
+    if ( ! file.open( QIODevice::WriteOnly ) )
+    {
+	logWarning() << "Can't write disk cache file " << fileName << endl;
+	return false;
+    }
+
+    file.write( (const char *) &header, sizeof( header ) );
+    file.write( (const char *) image.constBits(), image.byteCount() );
+
+    if ( ! file.commit() )
+    {
+	logWarning() << "Can't write disk cache file " << fileName << endl;
+	return false;
+    }
+
+    QMutexLocker locker( &_mutex );
+
+    if ( _totalSize >= 0 )
+	_totalSize += sizeof( header ) + image.byteCount();
+
+    if ( _totalSize < 0 || _totalSize > _maxSize )
+    {
+	locker.unlock();
+	trim();
+    }
+
+    return true;
+}
+
+
+void DiskCache::setMaxSize( qint64 maxSize )
+{
+    {
+	QMutexLocker locker( &_mutex );
+	_maxSize = maxSize;
+    }
+
+    trim();
+}
+
+
+void DiskCache::scan()
+{
+    QDir dir( _cacheDir );
+    QFileInfoList entries = dir.entryInfoList( QStringList( "*" CACHE_FILE_SUFFIX ),
+					       QDir::Files );
+    _totalSize = 0;
+
+    foreach ( const QFileInfo & entry, entries )
+	_totalSize += entry.size();
+}
+
+
+void DiskCache::trim()
+{
+    if ( ! _enabled )
+	return;
+
+    QMutexLocker locker( &_mutex );
+
+    if ( _totalSize < 0 )
+	scan();
+
+    if ( _totalSize <= _maxSize )
+	return;
+
+    // Trim to somewhat below the limit so this doesn't happen again for each
+    // new cache file.
+
+    qint64 wanted = _maxSize * 0.9;
+    qint64 released = 0;
+
+    QDir dir( _cacheDir );
+    QFileInfoList entries = dir.entryInfoList( QStringList( "*" CACHE_FILE_SUFFIX ),
+					       QDir::Files,
+					       QDir::Time | QDir::Reversed ); // oldest first
+
+    foreach ( const QFileInfo & entry, entries )
+    {
+	if ( _totalSize <= wanted )
+	    break;
+
+	if ( QFile::remove( entry.absoluteFilePath() ) )
+	{
+	    _totalSize -= entry.size();
+	    released   += entry.size();
+	}
+    }
+
+    logDebug() << "Trimmed disk cache by " << released / ( 1024 * 1024 ) << " MB" << endl;
+}
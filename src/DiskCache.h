@@ -0,0 +1,149 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef DiskCache_h
+#define DiskCache_h
+
+#include <QString>
+#include <QImage>
+#include <QSize>
+#include <QMutex>
+
+
+/**
+ * Persistent on-disk cache for images that were scaled down to screen size,
+ * so revisiting a directory in a later session does not need to decode and
+ * scale all the images again.
+ *
+ * Each image is stored as raw pixels in its own file with a small header.
+ * Reading it back is only a mmap(); the QImage uses the mapped memory
+ * directly without copying, and the mapping is released when the last copy
+ * of that QImage is destroyed.
+ *
+ * Cache entries are keyed by the full path, file size, modification time
+ * and inode of the original image and by the target (screen) size, so a
+ * changed or replaced image is never taken from the cache.
+ *
+ * The total size of the cache is limited (see maxSize()). When that limit is
+ * exceeded, the least recently used entries are deleted.
+ *
+ * All methods are thread-safe.
+ */
+class DiskCache
+{
+public:
+
+    /**
+     * Constructor: Use 'cacheDir' for the cache files and limit the cache
+     * to 'maxSize' bytes. The directory is created if it does not exist
+     * yet. If that is not possible, the cache is disabled.
+     */
+    DiskCache( const QString & cacheDir = defaultCacheDir(),
+	       qint64	       maxSize	= DefaultMaxSize );
+
+    /**
+     * Destructor.
+     */
+    virtual ~DiskCache();
+
+    /**
+     * Return 'true' if the cache is usable.
+     */
+    bool isEnabled() const { return _enabled; }
+
+    /**
+     * Return the cached image for the original image 'fullPath' that was
+     * scaled down to 'targetSize' or a null image if there is none.
+     * If 'origSize' is non-null, the original size of the image is returned
+     * there.
+     *
+     * The returned image uses memory-mapped data from the cache file; it is
+     * read-only (any write access makes a deep copy).
+     */
+    QImage image( const QString & fullPath,
+		  const QSize &	  targetSize,
+		  QSize *	  origSize = 0 );
+
+    /**
+     * Store 'image' (the original image 'fullPath' with size 'origSize'
+     * scaled down to 'targetSize') in the cache. This does nothing if it is
+     * already there. Return 'true' on success, 'false' on error.
+     */
+    bool store( const QString & fullPath,
+		const QSize &	targetSize,
+		const QImage &	image,
+		const QSize &	origSize );
+
+    /**
+     * Return 'true' if the cache contains an entry for 'fullPath' scaled
+     * down to 'targetSize'.
+     */
+    bool contains( const QString & fullPath, const QSize & targetSize );
+
+    /**
+     * Return the maximum total size of the cache in bytes.
+     */
+    qint64 maxSize() const { return _maxSize; }
+
+    /**
+     * Set the maximum total size of the cache in bytes and delete the least
+     * recently used entries until the cache fits into that limit.
+     */
+    void setMaxSize( qint64 maxSize );
+
+    /**
+     * Delete the least recently used cache files until the total size of
+     * the cache is not more than maxSize().
+     */
+    void trim();
+
+    /**
+     * Return the cache directory.
+     */
+    QString cacheDir() const { return _cacheDir; }
+
+    /**
+     * Return the default cache directory: $XDG_CACHE_HOME/qphotoview or
+     * ~/.cache/qphotoview if $XDG_CACHE_HOME is not set.
+     */
+    static QString defaultCacheDir();
+
+    /**
+     * Default maximum total size of the cache in bytes.
+     */
+    static const qint64 DefaultMaxSize = 4096LL * 1024 * 1024;
+
+
+protected:
+
+    /**
+     * Return the name of the cache file (with full path) for the original
+     * image 'fullPath' scaled down to 'targetSize' or an empty string if
+     * that image does not exist.
+     */
+    QString cacheFileName( const QString & fullPath, const QSize & targetSize ) const;
+
+    /**
+     * Scan the cache directory for the total size of all cache files.
+     *
+     * The caller has to hold _mutex.
+     */
+    void scan();
+
+
+private:
+
+    QString	_cacheDir;
+    qint64	_maxSize;
+    qint64	_totalSize;	// -1 if not scanned yet
+    bool	_enabled;
+    QMutex	_mutex;		// protects _totalSize and trimming
+};
+
+
+#endif // DiskCache_h
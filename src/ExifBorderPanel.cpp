@@ -43,6 +43,27 @@ void ExifBorderPanel::setMetaData()
 }
 
 
+void ExifBorderPanel::metaDataReady( const QString & fileName )
+{
+    if ( ! _lastPhoto || ! photoView()->photoDir() )
+	return;
+
+    if ( _lastPhoto == photoView()->photoDir()->current() &&
+	 _lastPhoto->fileName() == fileName )
+    {
+	_lastPhoto = 0; // enforce an update
+	setMetaData();
+    }
+}
+
+
+void ExifBorderPanel::photoRemoved( Photo * photo )
+{
+    if ( photo == _lastPhoto )
+	_lastPhoto = 0;
+}
+
+
 QString ExifBorderPanel::formatMetaData( Photo * photo )
 {
     if ( ! photo )
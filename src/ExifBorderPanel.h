@@ -39,6 +39,18 @@ public slots:
      */
     void setMetaData();
 
+    /**
+     * Notification that the meta data for 'fileName' were read in the
+     * background: Show them if that is the current photo.
+     */
+    void metaDataReady( const QString & fileName );
+
+    /**
+     * Notification that 'photo' is about to be deleted: Forget it if it is
+     * the one whose meta data are shown.
+     */
+    void photoRemoved( Photo * photo );
+
 private:
 
     Photo * _lastPhoto;
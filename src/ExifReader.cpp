@@ -0,0 +1,474 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <string.h>
+#include <climits>
+
+#include "ExifReader.h"
+
+
+// JPEG markers
+
+#define MARKER_SOI	0xD8	// start of image
+#define MARKER_EOI	0xD9	// end of image
+#define MARKER_SOS	0xDA	// start of scan: compressed data follow
+#define MARKER_APP1	0xE1	// Exif or XMP
+#define MARKER_TEM	0x01	// no length
+
+// TIFF field types
+
+#define TYPE_BYTE	1
+#define TYPE_ASCII	2
+#define TYPE_SHORT	3
+#define TYPE_LONG	4
+#define TYPE_RATIONAL	5
+#define TYPE_SSHORT	8
+#define TYPE_SLONG	9
+#define TYPE_SRATIONAL	10
+#define TYPE_IFD	13
+
+// TIFF tags
+
+#define TAG_EXIF_IFD		0x8769
+#define TAG_EXPOSURE_TIME	0x829A
+#define TAG_F_NUMBER		0x829D
+#define TAG_ISO			0x8827
+#define TAG_DATE_TIME_ORIGINAL	0x9003
+#define TAG_FOCAL_LENGTH	0x920A
+#define TAG_PIXEL_X_DIMENSION	0xA002
+#define TAG_PIXEL_Y_DIMENSION	0xA003
+#define TAG_FOCAL_LENGTH_35MM	0xA405
+
+#define IFD_ENTRY_SIZE	12
+
+
+static const char ExifHeader[] = "Exif\0\0";
+static const int  ExifHeaderSize = 6;
+
+
+/**
+ * Return the size in bytes of one value of TIFF field type 'type'
+ * or 0 if the type is unknown.
+ */
+static int typeSize( quint16 type )
+{
+    switch ( type )
+    {
+	case 1:  return 1; // BYTE
+	case 2:  return 1; // ASCII
+	case 3:  return 2; // SHORT
+	case 4:  return 4; // LONG
+	case 5:  return 8; // RATIONAL
+	case 6:  return 1; // SBYTE
+	case 7:  return 1; // UNDEFINED
+	case 8:  return 2; // SSHORT
+	case 9:  return 4; // SLONG
+	case 10: return 8; // SRATIONAL
+	case 11: return 4; // FLOAT
+	case 12: return 8; // DOUBLE
+	case 13: return 4; // IFD
+	default: return 0;
+    }
+}
+
+
+/**
+ * Return the greatest common divisor of 'a' and 'b' (always positive) or 0
+ * if both are 0.
+ */
+static qint64 greatestCommonDivisor( qint64 a, qint64 b )
+{
+    a = qAbs( a );
+    b = qAbs( b );
+
+    while ( b != 0 )
+    {
+	qint64 rest = a % b;
+	a = b;
+	b = rest;
+    }
+
+    return a;
+}
+
+
+/**
+ * Return 'value' as int. Set 'ok' to 'false' if it does not fit.
+ */
+static int toInt( qint64 value, bool * ok )
+{
+    if ( value < INT_MIN || value > INT_MAX )
+    {
+	*ok = false;
+	return 0;
+    }
+
+    return (int) value;
+}
+
+
+ExifReader::ExifReader()
+    : _tiff( 0 )
+    , _tiffSize( 0 )
+    , _bigEndian( false )
+    , _hasExifData( false )
+    , _iso( 0 )
+    , _focalLength35mmEquiv( 0 )
+    , _pixelDimensions( 0, 0 )
+{
+
+}
+
+
+bool ExifReader::isJpeg( const uchar * data, qint64 size )
+{
+    return data && size >= 4 && data[0] == 0xFF && data[1] == MARKER_SOI;
+}
+
+
+bool ExifReader::read( const uchar * data, qint64 size )
+{
+    if ( ! isJpeg( data, size ) )
+	return false;
+
+    qint64 pos = 2;
+
+    while ( pos + 4 <= size )
+    {
+	if ( data[ pos ] != 0xFF )
+	    return false;
+
+	// Any number of 0xFF fill bytes may precede a marker
+
+	while ( pos < size && data[ pos ] == 0xFF )
+	    ++pos;
+
+	if ( pos >= size )
+	    return false;
+
+	uchar marker = data[ pos++ ];
+
+	if ( marker == MARKER_SOS || marker == MARKER_EOI )
+	    return true; // no Exif segment
+
+	if ( marker == MARKER_TEM || ( marker >= 0xD0 && marker <= 0xD7 ) )
+	    continue; // RSTn and TEM have no length
+
+	if ( pos + 2 > size )
+	    return false;
+
+	int length = ( data[ pos ] << 8 ) | data[ pos + 1 ]; // including itself
+
+	if ( length < 2 || pos + length > size )
+	    return false;
+
+	const uchar * segment     = data + pos + 2;
+	int	      segmentSize = length - 2;
+
+	if ( marker == MARKER_APP1			&&
+	     segmentSize >= ExifHeaderSize		&&
+	     memcmp( segment, ExifHeader, ExifHeaderSize ) == 0 )
+	{
+	    return readTiff( segment	 + ExifHeaderSize,
+			     segmentSize - ExifHeaderSize );
+	}
+
+	pos += length;
+    }
+
+    return false; // truncated before the compressed data
+}
+
+
+bool ExifReader::readTiff( const uchar * tiff, quint32 size )
+{
+    _tiff     = tiff;
+    _tiffSize = size;
+
+    if ( size < 8 )
+	return false;
+
+    if ( tiff[0] == 'I' && tiff[1] == 'I' )
+	_bigEndian = false;
+    else if ( tiff[0] == 'M' && tiff[1] == 'M' )
+	_bigEndian = true;
+    else
+	return false;
+
+    if ( get16( tiff + 2 ) != 42 )
+	return false;
+
+    return readIfd( get32( tiff + 4 ), false );
+}
+
+
+bool ExifReader::readIfd( quint32 offset, bool exifIfd )
+{
+    if ( (qint64) offset + 2 > _tiffSize )
+	return false;
+
+    int count = get16( _tiff + offset );
+
+    if ( (qint64) offset + 2 + (qint64) count * IFD_ENTRY_SIZE > _tiffSize )
+	return false;
+
+    if ( count > 0 )
+	_hasExifData = true;
+
+    quint32 exifIfdOffset = 0;
+    bool    ok		  = true;
+
+    for ( int i=0; i < count && ok; ++i )
+    {
+	const uchar * entry = _tiff + offset + 2 + i * IFD_ENTRY_SIZE;
+	quint16	      tag   = get16( entry );
+
+	if ( ! exifIfd )
+	{
+	    if ( tag == TAG_EXIF_IFD )
+	    {
+		quint16 type = get16( entry + 2 );
+
+		if ( type != TYPE_LONG && type != TYPE_IFD )
+		    return false;
+
+		exifIfdOffset = get32( entry + 8 );
+	    }
+
+	    continue;
+	}
+
+	switch ( tag )
+	{
+	    case TAG_EXPOSURE_TIME:
+		_exposureTime = fractionValue( entry, &ok );
+		break;
+
+	    case TAG_F_NUMBER:
+		_aperture = fractionValue( entry, &ok );
+		break;
+
+	    case TAG_ISO:
+		_iso = intValue( entry, &ok );
+		break;
+
+	    case TAG_DATE_TIME_ORIGINAL:
+		_dateTimeOriginal = stringValue( entry, &ok );
+		break;
+
+	    case TAG_FOCAL_LENGTH:
+		_focalLength = fractionValue( entry, &ok );
+		break;
+
+	    case TAG_PIXEL_X_DIMENSION:
+		_pixelDimensions.setWidth( intValue( entry, &ok ) );
+		break;
+
+	    case TAG_PIXEL_Y_DIMENSION:
+		_pixelDimensions.setHeight( intValue( entry, &ok ) );
+		break;
+
+	    case TAG_FOCAL_LENGTH_35MM:
+		_focalLength35mmEquiv = intValue( entry, &ok );
+		break;
+
+	    default:
+		break;
+	}
+    }
+
+    if ( ! ok )
+	return false;
+
+    if ( exifIfdOffset > 0 )
+	return readIfd( exifIfdOffset, true );
+
+    return true;
+}
+
+
+const uchar * ExifReader::value( const uchar * entry, quint16 type, quint32 count ) const
+{
+    qint64 size = (qint64) count * typeSize( type );
+
+    if ( count == 0 || size == 0 )
+	return 0;
+
+    if ( size <= 4 )
+	return entry + 8; // the value itself instead of the offset
+
+    quint32 offset = get32( entry + 8 );
+
+    if ( (qint64) offset + size > _tiffSize )
+	return 0;
+
+    return _tiff + offset;
+}
+
+
+Fraction ExifReader::fractionValue( const uchar * entry, bool * ok ) const
+{
+    quint16	  type	= get16( entry + 2 );
+    const uchar * data	= value( entry, type, get32( entry + 4 ) );
+
+    if ( data )
+    {
+	switch ( type )
+	{
+	    case TYPE_RATIONAL:
+	    case TYPE_SRATIONAL:
+		{
+		    // Simplify here with 64 bit values: Any 32 bit value may be
+		    // in the file, and Fraction::simplify() can't handle all of
+		    // them.
+
+		    qint64 numerator;
+		    qint64 denominator;
+		    rationalValue( data, type, &numerator, &denominator );
+
+		    if ( denominator < 0 )
+		    {
+			numerator   = -numerator;
+			denominator = -denominator;
+		    }
+
+		    qint64 gcd = greatestCommonDivisor( numerator, denominator );
+
+		    if ( gcd > 1 && denominator != 0 )
+		    {
+			numerator   /= gcd;
+			denominator /= gcd;
+		    }
+
+		    bool valid = true;
+		    Fraction fraction( toInt( numerator,   &valid ),
+				       toInt( denominator, &valid ) );
+		    if ( valid )
+			return fraction;
+
+		    break;
+		}
+
+	    case TYPE_SHORT:
+	    case TYPE_LONG:
+	    case TYPE_SSHORT:
+	    case TYPE_SLONG:
+		return Fraction( intValue( entry, ok ), 1 );
+
+	    default:
+		break;
+	}
+    }
+
+    *ok = false;
+
+    return Fraction();
+}
+
+
+int ExifReader::intValue( const uchar * entry, bool * ok ) const
+{
+    quint16	  type	= get16( entry + 2 );
+    const uchar * data	= value( entry, type, get32( entry + 4 ) );
+
+    if ( data )
+    {
+	switch ( type )
+	{
+	    case TYPE_SHORT:	return get16( data );
+	    case TYPE_SSHORT:	return (qint16) get16( data );
+	    case TYPE_LONG:	return (int) get32( data );
+	    case TYPE_SLONG:	return (int) get32( data );
+
+	    case TYPE_RATIONAL:
+	    case TYPE_SRATIONAL:
+		{
+		    qint64 numerator;
+		    qint64 denominator;
+		    rationalValue( data, type, &numerator, &denominator );
+
+		    if ( denominator == 0 )
+			return 0;
+
+		    // INT_MIN / -1 does not fit into an int
+
+		    return toInt( numerator / denominator, ok );
+		}
+
+	    default:
+		break;
+	}
+    }
+
+    *ok = false;
+
+    return 0;
+}
+
+
+QString ExifReader::stringValue( const uchar * entry, bool * ok ) const
+{
+    quint16	  type	= get16( entry + 2 );
+    quint32	  count = get32( entry + 4 );
+    const uchar * data	= value( entry, type, count );
+
+    if ( ( type != TYPE_ASCII && type != TYPE_BYTE ) || ( count > 0 && ! data ) )
+    {
+	*ok = false;
+	return QString();
+    }
+
+    int length = 0;
+
+    while ( length < (int) count && data[ length ] != 0 )
+	++length;
+
+    return QString::fromLatin1( (const char *) data, length );
+}
+
+
+void ExifReader::rationalValue( const uchar * data,
+				quint16	      type,
+				qint64 *      numerator,
+				qint64 *      denominator ) const
+{
+    if ( type == TYPE_SRATIONAL )
+    {
+	*numerator   = (qint32) get32( data );
+	*denominator = (qint32) get32( data + 4 );
+    }
+    else
+    {
+	*numerator   = get32( data );
+	*denominator = get32( data + 4 );
+    }
+}
+
+
+quint16 ExifReader::get16( const uchar * data ) const
+{
+    if ( _bigEndian )
+	return ( data[0] << 8 ) | data[1];
+    else
+	return ( data[1] << 8 ) | data[0];
+}
+
+
+quint32 ExifReader::get32( const uchar * data ) const
+{
+    if ( _bigEndian )
+    {
+	return ( (quint32) data[0] << 24 ) | ( data[1] << 16 ) |
+	    ( data[2] << 8 ) | data[3];
+    }
+    else
+    {
+	return ( (quint32) data[3] << 24 ) | ( data[2] << 16 ) |
+	    ( data[1] << 8 ) | data[0];
+    }
+}
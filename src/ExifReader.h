@@ -0,0 +1,183 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef ExifReader_h
+#define ExifReader_h
+
+#include <QString>
+#include <QSize>
+#include <QtGlobal>
+
+#include "Fraction.h"
+
+
+/**
+ * Lightweight EXIF reader for JPEG files: This only scans the JPEG markers up
+ * to the first Exif APP1 segment and walks IFD0 and the Exif IFD of the TIFF
+ * structure in it for the few tags PhotoMetaData shows. There is no format
+ * probing, no makernote, IPTC or XMP decoding and no container for all
+ * the other tags as with Exiv2, so this is much faster.
+ *
+ * read() returns 'false' for anything that is not a JPEG file or that looks
+ * malformed in any way; the caller has to use Exiv2 for those.
+ *
+ * This only works on memory the caller provides, so it can be used in any
+ * thread.
+ */
+class ExifReader
+{
+public:
+    /**
+     * Constructor.
+     */
+    ExifReader();
+
+    /**
+     * Read the EXIF data from the content of a JPEG file ('size' bytes at
+     * 'data'). This does not need the complete file, only enough of it to
+     * include the Exif APP1 segment (see MaxHeaderSize).
+     *
+     * Return 'true' if the data could be handled completely (even if there
+     * is no EXIF data at all, see hasExifData()), 'false' if this is not a
+     * JPEG file or the data are malformed or truncated.
+     */
+    bool read( const uchar * data, qint64 size );
+
+    /**
+     * Return 'true' if the last read() found any EXIF data.
+     */
+    bool hasExifData() const { return _hasExifData; }
+
+    /**
+     * Return the exposure time (Exif.Photo.ExposureTime).
+     */
+    Fraction exposureTime() const { return _exposureTime; }
+
+    /**
+     * Return the F-number (Exif.Photo.FNumber).
+     */
+    Fraction aperture() const { return _aperture; }
+
+    /**
+     * Return the ISO speed (Exif.Photo.ISOSpeedRatings) or 0 if unknown.
+     */
+    int iso() const { return _iso; }
+
+    /**
+     * Return the focal length (Exif.Photo.FocalLength).
+     */
+    Fraction focalLength() const { return _focalLength; }
+
+    /**
+     * Return the 35 mm equivalent focal length
+     * (Exif.Photo.FocalLengthIn35mmFilm) or 0 if unknown.
+     */
+    int focalLength35mmEquiv() const { return _focalLength35mmEquiv; }
+
+    /**
+     * Return the pixel dimensions (Exif.Photo.PixelXDimension and
+     * Exif.Photo.PixelYDimension); 0 for each one that is unknown, just
+     * like with Exiv2.
+     */
+    QSize pixelDimensions() const { return _pixelDimensions; }
+
+    /**
+     * Return the date and time the photo was taken
+     * (Exif.Photo.DateTimeOriginal) as it is in the file.
+     */
+    QString dateTimeOriginal() const { return _dateTimeOriginal; }
+
+    /**
+     * Return 'true' if 'data' starts like a JPEG file.
+     */
+    static bool isJpeg( const uchar * data, qint64 size );
+
+    /**
+     * The Exif APP1 segment is the first or one of the first segments of a
+     * JPEG file, and no segment is larger than 64k: Reading this many bytes
+     * from the start of the file is enough for read().
+     */
+    static const int MaxHeaderSize = 128 * 1024;
+
+protected:
+
+    /**
+     * Read the TIFF structure in an Exif APP1 segment.
+     * Return 'false' if it is malformed.
+     */
+    bool readTiff( const uchar * tiff, quint32 size );
+
+    /**
+     * Read the IFD at 'offset' in the TIFF structure. If 'exifIfd' is
+     * 'false', this is IFD0 and only the offset of the Exif IFD is taken
+     * from it.
+     * Return 'false' if it is malformed.
+     */
+    bool readIfd( quint32 offset, bool exifIfd );
+
+    /**
+     * Return the address of the value of the IFD entry at 'entry' or 0 if
+     * it is outside of the TIFF structure. 'count' and 'type' are from the
+     * entry.
+     */
+    const uchar * value( const uchar * entry, quint16 type, quint32 count ) const;
+
+    /**
+     * Return the first value of a numeric IFD entry as fraction.
+     * Set 'ok' to 'false' if it is not numeric or does not fit into a
+     * Fraction.
+     */
+    Fraction fractionValue( const uchar * entry, bool * ok ) const;
+
+    /**
+     * Return the first value of a numeric IFD entry as integer.
+     * Set 'ok' to 'false' if it is not numeric or does not fit into an
+     * int.
+     */
+    int intValue( const uchar * entry, bool * ok ) const;
+
+    /**
+     * Get the numerator and the denominator of the RATIONAL or SRATIONAL
+     * value at 'data', unsigned or signed according to 'type'.
+     */
+    void rationalValue( const uchar * data,
+			quint16	      type,
+			qint64 *      numerator,
+			qint64 *      denominator ) const;
+
+    /**
+     * Return the value of an ASCII IFD entry up to the first null byte.
+     * Set 'ok' to 'false' if it is not ASCII.
+     */
+    QString stringValue( const uchar * entry, bool * ok ) const;
+
+    /**
+     * Return the 16 or 32 bit value at 'data' in the byte order of the TIFF
+     * structure.
+     */
+    quint16 get16( const uchar * data ) const;
+    quint32 get32( const uchar * data ) const;
+
+private:
+
+    const uchar * _tiff;
+    quint32	  _tiffSize;
+    bool	  _bigEndian;
+
+    bool	  _hasExifData;
+    Fraction	  _exposureTime;
+    Fraction	  _aperture;
+    int		  _iso;
+    Fraction	  _focalLength;
+    int		  _focalLength35mmEquiv;
+    QSize	  _pixelDimensions;
+    QString	  _dateTimeOriginal;
+};
+
+
+#endif // ExifReader_h
@@ -0,0 +1,302 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QImageReader>
+#include <QElapsedTimer>
+
+#include "ImagePyramid.h"
+#include "ImageScaler.h"
+#include "MappedFile.h"
+#include "PrefetchCache.h"
+#include "Logger.h"
+
+
+static const int MinLevelSize = 16; // pixels
+
+
+ImagePyramid::ImagePyramid( const QString &	   fullPath,
+			    const QSize &	   minSize,
+			    qint64		   maxSize,
+			    const QByteArray & bytes )
+    : _fullPath( fullPath )
+    , _bytes( bytes )
+    , _minSize( minSize )
+    , _maxSize( maxSize )
+    , _byteCount( 0 )
+    , _finished( false )
+{
+
+}
+
+
+QSharedPointer<ImagePyramid> ImagePyramid::create( const QString &    fullPath,
+						   const QSize &      minSize,
+						   qint64	      maxSize,
+						   const QByteArray & bytes )
+{
+    QSharedPointer<ImagePyramid> pyramid( new ImagePyramid( fullPath, minSize, maxSize, bytes ) );
+
+    ImagePyramidBuilderThread * builder = new ImagePyramidBuilderThread( pyramid );
+
+    QObject::connect( builder, SIGNAL( finished()    ),
+		      builder, SLOT  ( deleteLater() ) );
+
+    builder->start( QThread::LowPriority );
+
+    return pyramid;
+}
+
+
+ImagePyramid::~ImagePyramid()
+{
+    logDebug() << "Dropping image pyramid for " << _fullPath
+	       << " (" << _byteCount / ( 1024 * 1024 ) << " MB)" << endl;
+}
+
+
+QImage ImagePyramid::image( const QSize & boundingSize )
+{
+    QMutexLocker locker( &_mutex );
+
+    forever
+    {
+	if ( _finished )
+	    break;
+
+	if ( _origSize.isValid() )
+	{
+	    QSize size = _origSize.scaled( boundingSize, Qt::KeepAspectRatio );
+
+	    if ( _levels.size() > neededLevel( size ) )
+		break;
+	}
+
+	_levelCondition.wait( &_mutex );
+    }
+
+    if ( _levels.isEmpty() )
+	return QImage();
+
+    QSize  size = _origSize.scaled( boundingSize, Qt::KeepAspectRatio );
+    QImage source;
+
+    // Use the nearest larger level that was not dropped. Only the largest
+    // levels are ever dropped, so if there is none, use the largest
+    // remaining level.
+
+    for ( int level = qMin( neededLevel( size ), _levels.size() - 1 );
+	  level >= 0 && source.isNull();
+	  --level )
+    {
+	source = _levels.at( level );
+    }
+
+    for ( int level = 0; level < _levels.size() && source.isNull(); ++level )
+	source = _levels.at( level );
+
+    locker.unlock();
+
+    if ( source.isNull() || source.size() == size )
+	return source;
+
+    return ImageScaler::parallelScaled( source, size );
+}
+
+
+QImage ImagePyramid::fullSizeImage( bool wait )
+{
+    QMutexLocker locker( &_mutex );
+
+    while ( wait && ! _finished && _levels.isEmpty() )
+	_levelCondition.wait( &_mutex );
+
+    return _levels.isEmpty() ? QImage() : _levels.first();
+}
+
+
+QSize ImagePyramid::origSize() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _origSize;
+}
+
+
+bool ImagePyramid::isFinished() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _finished;
+}
+
+
+qint64 ImagePyramid::byteCount() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _byteCount;
+}
+
+
+QSize ImagePyramid::levelSize( const QSize & origSize, int level )
+{
+    return QSize( origSize.width() >> level, origSize.height() >> level );
+}
+
+
+int ImagePyramid::levelCount() const
+{
+    int count = 1;
+
+    forever
+    {
+	QSize size = levelSize( _origSize, count );
+
+	if ( size.width() < MinLevelSize || size.height() < MinLevelSize )
+	    break;
+
+	if ( size.width() < _minSize.width() && size.height() < _minSize.height() )
+	    break;
+
+	++count;
+    }
+
+    return count;
+}
+
+
+int ImagePyramid::neededLevel( const QSize & size ) const
+{
+    int level = 0;
+    int count = levelCount();
+
+    while ( level + 1 < count )
+    {
+	QSize next = levelSize( _origSize, level + 1 );
+
+	if ( next.width() < size.width() || next.height() < size.height() )
+	    break;
+
+	++level;
+    }
+
+    return level;
+}
+
+
+void ImagePyramid::addLevel( const QImage & image )
+{
+    _levels << image;
+    _byteCount += image.byteCount();
+
+    // Drop the largest levels until the rest fits, but always keep the
+    // newest one: It is the only one that is left then.
+
+    for ( int level = 0; level < _levels.size() - 1 && _byteCount > _maxSize; ++level )
+    {
+	if ( ! _levels.at( level ).isNull() )
+	{
+	    logDebug() << "Dropping level " << level << " of " << _fullPath
+		       << " to stay below " << _maxSize / ( 1024 * 1024 ) << " MB"
+		       << endl;
+
+	    _byteCount -= _levels.at( level ).byteCount();
+	    _levels[ level ] = QImage();
+	}
+    }
+
+    _levelCondition.wakeAll();
+}
+
+
+void ImagePyramid::build()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    MappedFile file( _fullPath, _token );
+    QImage image;
+
+    if ( _bytes.isNull() ? file.open() : file.open( _bytes ) )
+    {
+	QImageReader reader( file.device() );
+	QSize size = reader.size(); // only reads the header
+
+	if ( size.isValid() )
+	{
+	    QMutexLocker locker( &_mutex );
+	    _origSize = size;
+	}
+
+	image = reader.read();
+
+	if ( file.isDamaged() )
+	    image = QImage(); // truncated while it was read
+    }
+
+    _bytes = QByteArray(); // only needed for decoding
+
+    if ( image.isNull() || _token.isCancelled() )
+    {
+	if ( ! _token.isCancelled() )
+	    logWarning() << "Could not load " << _fullPath << endl;
+
+	QMutexLocker locker( &_mutex );
+	_finished = true;
+	_levelCondition.wakeAll();
+
+	return;
+    }
+
+    int count;
+
+    {
+	QMutexLocker locker( &_mutex );
+	_origSize = image.size();
+	count	  = levelCount();
+	addLevel( image );
+    }
+
+    // Build each level from the previous one: Halving is the cheapest
+    // possible smooth scaling, and the source gets smaller with every level.
+
+    for ( int level = 1; level < count && ! _token.isCancelled(); ++level )
+    {
+	image = ImageScaler::halved( image );
+
+	QMutexLocker locker( &_mutex );
+	addLevel( image );
+    }
+
+    QMutexLocker locker( &_mutex );
+    _finished = true;
+    _levelCondition.wakeAll();
+
+    logDebug() << "Built " << _levels.size() << " levels for " << _fullPath
+	       << " in " << PrefetchCache::formatTime( timer.elapsed() )
+	       << " (" << _byteCount / ( 1024 * 1024 ) << " MB)" << endl;
+}
+
+
+
+ImagePyramidBuilderThread::ImagePyramidBuilderThread( QSharedPointer<ImagePyramid> pyramid )
+    : _pyramid( pyramid )
+{
+
+}
+
+
+void ImagePyramidBuilderThread::run()
+{
+    _pyramid->build();
+
+    // If nobody else uses the pyramid any more, it is deleted right here in
+    // this thread
+
+    _pyramid.clear();
+}
@@ -0,0 +1,210 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef ImagePyramid_h
+#define ImagePyramid_h
+
+#include <QString>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QSharedPointer>
+
+#include "CancellableFile.h"
+
+class ImagePyramid;
+
+
+/**
+ * Helper class: Thread that loads the full size image of an ImagePyramid
+ * and then builds the smaller levels one after another.
+ *
+ * The thread keeps the pyramid alive until it is done, and it deletes
+ * itself when it is finished, so nobody ever has to wait for it.
+ */
+class ImagePyramidBuilderThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    ImagePyramidBuilderThread( QSharedPointer<ImagePyramid> pyramid );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    QSharedPointer<ImagePyramid> _pyramid;
+};
+
+
+/**
+ * Multi-resolution image pyramid for zooming one photo: The full size image
+ * (level 0), 1/2 of that (level 1), 1/4 (level 2) and so on down to about
+ * the size of the screen. Any zoomed size is scaled only from the nearest
+ * larger level, so a zoom step does not have to decode the image file again
+ * and scales far fewer pixels.
+ *
+ * The levels are built in a background thread that is started in create().
+ * image() only waits until the level it needs is available.
+ *
+ * The memory for all levels is limited to maxSize(); if they don't fit,
+ * the largest levels are dropped, and sizes larger than the largest
+ * remaining level are scaled up from that level.
+ */
+class ImagePyramid
+{
+public:
+    /**
+     * Create a pyramid for the image file 'fullPath' and start building it
+     * in the background. Levels smaller than 'minSize' in both dimensions
+     * are not built; the caller should have a better source for them
+     * anyway.
+     *
+     * If 'bytes' is not null, it is the content of the file that is in
+     * memory already (e.g. in the ReadAheadCache); the image is decoded
+     * from there instead of opening the file again.
+     *
+     * The builder thread holds a reference until it is done, so releasing
+     * the last other one never waits for it; use cancel() to make it stop
+     * early.
+     */
+    static QSharedPointer<ImagePyramid> create( const QString &	   fullPath,
+						const QSize &	   minSize = QSize(),
+						qint64		   maxSize = DefaultMaxSize,
+						const QByteArray & bytes   = QByteArray() );
+
+    /**
+     * Destructor.
+     */
+    virtual ~ImagePyramid();
+
+    /**
+     * Make the builder thread stop as soon as possible. The levels that are
+     * built already remain available.
+     */
+    void cancel() { _token.cancel(); }
+
+    /**
+     * Return the image scaled to fit into 'boundingSize' while maintaining
+     * its aspect ratio. This waits until the level it needs is built.
+     *
+     * Since the caller is waiting for this, the scaling from that level is
+     * done in parallel on all cores (ImageScaler::parallelScaled()).
+     *
+     * This returns a null image if the image file could not be loaded.
+     */
+    QImage image( const QSize & boundingSize );
+
+    /**
+     * Return the full size image or a null image if it could not be loaded
+     * or if it was dropped to stay below maxSize(). If 'wait' is false, this
+     * also returns a null image if the full size image is not loaded yet.
+     */
+    QImage fullSizeImage( bool wait = true );
+
+    /**
+     * Return the original size of the image or an invalid size if it is not
+     * known yet. This does not wait.
+     */
+    QSize origSize() const;
+
+    /**
+     * Return 'true' if all levels are built.
+     */
+    bool isFinished() const;
+
+    /**
+     * Return the number of bytes used by all levels.
+     */
+    qint64 byteCount() const;
+
+    /**
+     * Return the full path of the image file.
+     */
+    QString fullPath() const { return _fullPath; }
+
+    /**
+     * Return the maximum number of bytes for all levels.
+     */
+    qint64 maxSize() const { return _maxSize; }
+
+    /**
+     * Default for maxSize(): 256 MB
+     */
+    static const qint64 DefaultMaxSize = 256LL * 1024 * 1024;
+
+protected:
+    /**
+     * Constructor. Use create() instead.
+     */
+    ImagePyramid( const QString &    fullPath,
+		  const QSize &	     minSize,
+		  qint64	     maxSize,
+		  const QByteArray & bytes );
+
+    /**
+     * Return the size of level 'level' for the original size 'origSize'.
+     */
+    static QSize levelSize( const QSize & origSize, int level );
+
+    /**
+     * Return the number of levels for _origSize, limited by _minSize. The
+     * caller has to lock _mutex.
+     */
+    int levelCount() const;
+
+    /**
+     * Return the level that is needed for 'size', i.e. the smallest one
+     * that is still at least as large as 'size'. The caller has to lock
+     * _mutex.
+     */
+    int neededLevel( const QSize & size ) const;
+
+    /**
+     * Add the next level. Then drop the largest levels until all levels fit
+     * into maxSize(). The caller has to lock _mutex.
+     */
+    void addLevel( const QImage & image );
+
+    /**
+     * Load the image and build all levels. Called from the builder thread.
+     */
+    void build();
+
+    friend class ImagePyramidBuilderThread;
+
+private:
+    Q_DISABLE_COPY( ImagePyramid );
+
+    QString	   _fullPath;
+    QByteArray	   _bytes;		// shared, may be null
+    QSize	   _minSize;
+    qint64	   _maxSize;
+    CancelToken	   _token;
+
+    mutable QMutex _mutex;		// protects everything below
+    QWaitCondition _levelCondition;	// a level was added or finished
+    QSize	   _origSize;
+    QList<QImage>  _levels;		// dropped levels are null
+    qint64	   _byteCount;
+    bool	   _finished;
+};
+
+
+#endif // ImagePyramid_h
@@ -0,0 +1,405 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThread>
+
+#include "ImageScaler.h"
+#include "PrefetchCache.h"
+#include "Logger.h"
+
+
+static ImageScaler::Method initialMethod()
+{
+    QString env = QString::fromLocal8Bit( qgetenv( "QPHOTOVIEW_SCALER" ) ).toLower();
+
+    return env == "qt" ? ImageScaler::QtScaler : ImageScaler::SimdScaler;
+}
+
+
+// Set from the main thread, read from all worker threads
+
+static QAtomicInt scalerMethod( initialMethod() );
+
+static const ScaleKernels::InstructionSet bestInstructionSet =
+    ScaleKernels::detectInstructionSet();
+
+
+static QThreadPool * createThreadPool()
+{
+    // The calling thread does one stripe itself, so one thread less than
+    // there are cores
+
+    QThreadPool * pool = new QThreadPool();
+    pool->setMaxThreadCount( qMax( 1, QThread::idealThreadCount() - 1 ) );
+
+    return pool;
+}
+
+
+/**
+ * One horizontal stripe of ImageScaler::scaleStripes(): Rows 'firstRow' to
+ * 'firstRow' + 'rowCount' - 1 of the destination image.
+ */
+class ImageScalerStripe: public QRunnable
+{
+public:
+    ImageScalerStripe( const QImage &		    src,
+		       uchar *			    dst,
+		       int			    dstWidth,
+		       int			    dstBpl,
+		       const ScaleKernels::Filter * hFilter,
+		       const ScaleKernels::Filter * vFilter,
+		       int			    firstRow,
+		       int			    rowCount,
+		       QSemaphore *		    done )
+	: _src( src )
+	, _dst( dst )
+	, _dstWidth( dstWidth )
+	, _dstBpl( dstBpl )
+	, _hFilter( hFilter )
+	, _vFilter( vFilter )
+	, _firstRow( firstRow )
+	, _rowCount( rowCount )
+	, _done( done )
+	{}
+
+    virtual void run() Q_DECL_OVERRIDE
+    {
+	if ( _hFilter && _vFilter )
+	{
+	    ScaleKernels::resampleRows( ImageScaler::instructionSet(),
+					_src.constBits(), _src.bytesPerLine(),
+					_dst, _dstWidth, _dstBpl,
+					*_hFilter, *_vFilter,
+					_firstRow, _rowCount );
+	}
+	else
+	{
+	    ScaleKernels::halve( ImageScaler::instructionSet(),
+				 _src.constBits() + (size_t) 2 * _firstRow * _src.bytesPerLine(),
+				 _src.bytesPerLine(),
+				 _dst + (size_t) _firstRow * _dstBpl,
+				 _dstBpl,
+				 _dstWidth,
+				 _rowCount );
+	}
+
+	_done->release();
+    }
+
+private:
+    const QImage &		 _src;
+    uchar *			 _dst;
+    int				 _dstWidth;
+    int				 _dstBpl;
+    const ScaleKernels::Filter * _hFilter;
+    const ScaleKernels::Filter * _vFilter;
+    int				 _firstRow;
+    int				 _rowCount;
+    QSemaphore *		 _done;
+};
+
+
+ImageScaler::Method ImageScaler::method()
+{
+    return static_cast<Method>( scalerMethod.load() );
+}
+
+
+void ImageScaler::setMethod( Method method )
+{
+    scalerMethod.store( method );
+}
+
+
+QString ImageScaler::methodName( Method method )
+{
+    if ( method == QtScaler )
+	return "Qt";
+
+    return QString( "SIMD (%1)" ).arg( ScaleKernels::name( instructionSet() ) );
+}
+
+
+ScaleKernels::InstructionSet ImageScaler::instructionSet()
+{
+    return bestInstructionSet;
+}
+
+
+QImage ImageScaler::scaled( const QImage & image, const QSize & size )
+{
+    return scaled( image, size, method() );
+}
+
+
+QImage ImageScaler::scaled( const QImage & image, const QSize & size, Method method )
+{
+    if ( image.isNull() || size.isEmpty() )
+	return QImage();
+
+    if ( method == QtScaler )
+    {
+	// Same formats as the SIMD scaler: Callers rely on them
+
+	return toNativeFormat( image.scaled( size, Qt::IgnoreAspectRatio,
+					     Qt::SmoothTransformation ) );
+    }
+
+    QImage result = toNativeFormat( image );
+
+    if ( result.size() == size )
+	return result;
+
+    // Halving is much cheaper than the general filter, and it averages all
+    // source pixels, so it does not lose any information the final filter
+    // would have used.
+
+    while ( result.width()  / 2 >= size.width() &&
+	    result.height() / 2 >= size.height() )
+    {
+	result = simdHalved( result );
+    }
+
+    if ( result.size() != size )
+	result = simdScaled( result, size );
+
+    return result;
+}
+
+
+QImage ImageScaler::parallelScaled( const QImage & image, const QSize & size )
+{
+    return parallelScaled( image, size, method() );
+}
+
+
+QImage ImageScaler::parallelScaled( const QImage & image, const QSize & size, Method method )
+{
+    if ( image.isNull() || size.isEmpty() )
+	return QImage();
+
+    if ( method == QtScaler )
+	return scaled( image, size, QtScaler );
+
+    QImage result = toNativeFormat( image );
+
+    if ( result.size() == size )
+	return result;
+
+    while ( result.width()  / 2 >= size.width() &&
+	    result.height() / 2 >= size.height() )
+    {
+	QImage half( result.width() / 2, result.height() / 2, result.format() );
+
+	if ( half.isNull() ) // out of memory
+	    return half;
+
+	scaleStripes( result, half );
+	result = half;
+    }
+
+    if ( result.size() != size )
+	result = simdScaled( result, size, true );
+
+    return result;
+}
+
+
+QImage ImageScaler::halved( const QImage & image )
+{
+    QSize size( image.width() / 2, image.height() / 2 );
+
+    if ( image.isNull() || size.isEmpty() )
+	return QImage();
+
+    if ( method() == QtScaler )
+    {
+	return toNativeFormat( image.scaled( size, Qt::IgnoreAspectRatio,
+					     Qt::SmoothTransformation ) );
+    }
+
+    return simdHalved( toNativeFormat( image ) );
+}
+
+
+void ImageScaler::benchmark( const QImage & image, const QSize & size, int iterations )
+{
+    if ( image.isNull() || size.isEmpty() || iterations < 1 )
+	return;
+
+    // Convert only once: The images the scaler normally gets come directly
+    // from the decoder, which already uses one of these formats for photos.
+
+    QImage source = toNativeFormat( image );
+    double megaPixels = iterations * source.width() * (double) source.height() / 1e6;
+
+    logInfo() << "Scaling " << source.size() << " to " << size
+	      << " " << iterations << " times" << endl;
+
+    for ( int i = 0; i < 3; ++i )
+    {
+	Method method	= i == 0 ? QtScaler : SimdScaler;
+	bool   parallel = i == 2;
+	QElapsedTimer timer;
+	timer.start();
+
+	if ( parallel )
+	{
+	    for ( int iteration = 0; iteration < iterations; ++iteration )
+		parallelScaled( source, size, method );
+	}
+	else
+	{
+	    for ( int iteration = 0; iteration < iterations; ++iteration )
+		scaled( source, size, method );
+	}
+
+	qint64 elapsed = qMax( timer.elapsed(), 1LL );
+
+	logInfo() << methodName( method )
+		  << ( parallel ? QString( ", parallel on %1 threads" ).arg( threadPool()->maxThreadCount() + 1 ) : QString() )
+		  << ": "
+		  << PrefetchCache::formatTime( elapsed / iterations ) << " per image, "
+		  << QString::number( megaPixels * 1000.0 / elapsed, 'f', 1 ) << " MP/s"
+		  << endl;
+    }
+}
+
+
+QImage ImageScaler::toNativeFormat( const QImage & image )
+{
+    if ( image.format() == QImage::Format_RGB32 ||
+	 image.format() == QImage::Format_ARGB32_Premultiplied )
+    {
+	return image;
+    }
+
+    return image.convertToFormat( image.hasAlphaChannel() ?
+				  QImage::Format_ARGB32_Premultiplied :
+				  QImage::Format_RGB32 );
+}
+
+
+QImage ImageScaler::simdHalved( const QImage & image )
+{
+    QImage result( image.width() / 2, image.height() / 2, image.format() );
+
+    if ( result.isNull() ) // out of memory
+	return result;
+
+    ScaleKernels::halve( instructionSet(),
+			 image.constBits(), image.bytesPerLine(),
+			 result.bits(),	    result.bytesPerLine(),
+			 result.width(),    result.height() );
+
+    return result;
+}
+
+
+QImage ImageScaler::simdScaled( const QImage & image, const QSize & size, bool parallel )
+{
+    QImage result( size, image.format() );
+
+    if ( result.isNull() ) // out of memory
+	return result;
+
+    if ( parallel )
+    {
+	ScaleKernels::Filter hFilter = ScaleKernels::filter( image.width(),  size.width()  );
+	ScaleKernels::Filter vFilter = ScaleKernels::filter( image.height(), size.height() );
+
+	scaleStripes( image, result, &hFilter, &vFilter );
+
+	return result;
+    }
+
+    ScaleKernels::resample( instructionSet(),
+			    image.constBits(),
+			    image.width(), image.height(), image.bytesPerLine(),
+			    result.bits(),
+			    result.width(), result.height(), result.bytesPerLine() );
+
+    return result;
+}
+
+
+void ImageScaler::scaleStripes( const QImage &		     image,
+				QImage &		     result,
+				const ScaleKernels::Filter * hFilter,
+				const ScaleKernels::Filter * vFilter )
+{
+    // Get the pixels pointer only once here: QImage::bits() might detach,
+    // which must not happen in the stripe threads.
+
+    uchar * dst	    = result.bits();
+    int	    rows    = result.height();
+    int	    stripes = qBound( 1, rows / MinStripeRows, threadPool()->maxThreadCount() + 1 );
+    int	    first   = 0;
+
+    QSemaphore done;
+
+    for ( int i = 0; i < stripes; ++i )
+    {
+	int count = rows * ( i + 1 ) / stripes - first;
+
+	if ( i < stripes - 1 )
+	{
+	    threadPool()->start( new ImageScalerStripe( image, dst,
+							result.width(), result.bytesPerLine(),
+							hFilter, vFilter,
+							first, count, &done ) );
+	}
+	else // the calling thread does the last stripe itself
+	{
+	    ImageScalerStripe stripe( image, dst,
+				      result.width(), result.bytesPerLine(),
+				      hFilter, vFilter,
+				      first, count, &done );
+	    stripe.run();
+	}
+
+	first += count;
+    }
+
+    done.acquire( stripes );
+}
+
+
+QThreadPool * ImageScaler::threadPool()
+{
+    static QThreadPool * pool = createThreadPool();
+
+    return pool;
+}
+
+
+
+
+ImageScalerBenchmarkThread::ImageScalerBenchmarkThread( const QString & fullPath,
+							const QSize &	boundingSize ):
+    QThread(),
+    _fullPath( fullPath ),
+    _boundingSize( boundingSize )
+{
+
+}
+
+
+void ImageScalerBenchmarkThread::run()
+{
+    QImage image( _fullPath );
+    QSize  size = image.size().scaled( _boundingSize, Qt::KeepAspectRatio );
+
+    ImageScaler::benchmark( image, size );
+}
@@ -0,0 +1,183 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef ImageScaler_h
+#define ImageScaler_h
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QThread>
+
+#include "ScaleKernels.h"
+
+class QThreadPool;
+
+
+/**
+ * Helper class: Thread that loads an image file in full size and runs
+ * ImageScaler::benchmark() with it, so neither blocks the UI thread.
+ */
+class ImageScalerBenchmarkThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor. The image is scaled to fit into 'boundingSize'.
+     */
+    ImageScalerBenchmarkThread( const QString & fullPath,
+				const QSize &	boundingSize );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    QString _fullPath;
+    QSize   _boundingSize;
+};
+
+
+/**
+ * Smooth image scaling with either Qt (QImage::scaled() with
+ * Qt::SmoothTransformation) or the SIMD kernels of ScaleKernels:
+ *
+ * The SIMD scaler first halves the image with a 2x2 box filter as long as
+ * the result is still at least as large as the target size, then scales the
+ * rest of the way with a separable triangle filter. Both steps use the best
+ * instruction set the CPU supports (AVX2, SSE2 or plain C++).
+ *
+ * The method can be selected at runtime with setMethod() or with the
+ * environment variable QPHOTOVIEW_SCALER ("qt" or "simd"); the default is
+ * the SIMD scaler.
+ */
+class ImageScaler
+{
+public:
+
+    enum Method
+    {
+	QtScaler,
+	SimdScaler
+    };
+
+    /**
+     * Return the current scaling method.
+     */
+    static Method method();
+
+    /**
+     * Set the scaling method for all subsequent calls.
+     */
+    static void setMethod( Method method );
+
+    /**
+     * Return the name of a scaling method.
+     */
+    static QString methodName( Method method );
+
+    /**
+     * Return the instruction set the SIMD scaler uses on this CPU.
+     */
+    static ScaleKernels::InstructionSet instructionSet();
+
+    /**
+     * Return 'image' smoothly scaled to exactly 'size' with method(). The
+     * result has format QImage::Format_ARGB32_Premultiplied if 'image' has
+     * an alpha channel and QImage::Format_RGB32 otherwise.
+     */
+    static QImage scaled( const QImage & image, const QSize & size );
+
+    /**
+     * Return 'image' smoothly scaled to exactly 'size' with 'method'.
+     */
+    static QImage scaled( const QImage & image, const QSize & size, Method method );
+
+    /**
+     * Like scaled(), but split the result into horizontal stripes that are
+     * scaled in parallel on all CPU cores. Use this when the user is waiting
+     * for the result; background threads should use scaled() and leave the
+     * other cores to the user interface and to the other workers.
+     *
+     * With QtScaler, this is the same as scaled(): QImage::scaled() can't
+     * scale only a part of an image with the filter weights of the complete
+     * image, so the stripes would not fit together seamlessly.
+     */
+    static QImage parallelScaled( const QImage & image, const QSize & size );
+
+    /**
+     * Like parallelScaled(), but with 'method' instead of method().
+     */
+    static QImage parallelScaled( const QImage & image, const QSize & size, Method method );
+
+    /**
+     * Return 'image' scaled to half its size (rounded down) with method().
+     */
+    static QImage halved( const QImage & image );
+
+    /**
+     * Scale 'image' to 'size' 'iterations' times with each method (and with
+     * parallelScaled()) and log the time and the throughput in megapixels
+     * (of 'image') per second. This does not change method().
+     */
+    static void benchmark( const QImage & image, const QSize & size, int iterations = 10 );
+
+    /**
+     * Return 'image' converted to QImage::Format_ARGB32_Premultiplied if it
+     * has an alpha channel or to QImage::Format_RGB32 otherwise, or 'image'
+     * itself if it already has one of them. These are the formats the SIMD
+     * kernels work with, and the ones the raster paint engine (and thus
+     * QPixmap::fromImage()) can use without any conversion.
+     */
+    static QImage toNativeFormat( const QImage & image );
+
+protected:
+
+    /**
+     * Halve 'image' (which has to be in a native format) with the SIMD
+     * kernels.
+     */
+    static QImage simdHalved( const QImage & image );
+
+    /**
+     * Scale 'image' to 'size' with the SIMD kernels. If 'parallel' is true,
+     * do that in parallel stripes in threadPool().
+     */
+    static QImage simdScaled( const QImage & image, const QSize & size, bool parallel = false );
+
+    /**
+     * Halve 'image' or, if 'hFilter' and 'vFilter' are non-null, resample it
+     * with them into 'result' in horizontal stripes of at least
+     * MinStripeRows rows of 'result': All but the last stripe in
+     * threadPool(), the last one in the calling thread. This returns when
+     * all stripes are done.
+     */
+    static void scaleStripes( const QImage &		   image,
+			      QImage &			   result,
+			      const ScaleKernels::Filter * hFilter = 0,
+			      const ScaleKernels::Filter * vFilter = 0 );
+
+    /**
+     * Return the thread pool for parallelScaled().
+     */
+    static QThreadPool * threadPool();
+
+    /**
+     * Minimum number of destination rows per stripe: Each stripe also needs
+     * the source rows its filters overlap with its neighbours, so very thin
+     * stripes would do much of the work twice.
+     */
+    static const int MinStripeRows = 32;
+};
+
+
+#endif // ImageScaler_h
@@ -0,0 +1,301 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#  include <sys/vfs.h>
+#endif
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QAtomicInteger>
+
+#include "MappedFile.h"
+#include "Logger.h"
+
+
+// All mappings are registered in this table, so the SIGBUS handler can tell
+// if a fault is in one of them. The handler can't take any locks, so this
+// is a fixed-size table of atomic values.
+
+struct MappingSlot
+{
+    QAtomicInt		     used;
+    QAtomicInteger<quintptr> start;	// 0 while not valid
+    QAtomicInteger<quintptr> end;
+    QAtomicInt		     damaged;
+};
+
+static MappingSlot	mappingSlots[ MappedFile::MaxMappings ];
+static long		pageSize = 4096;
+static struct sigaction previousSigbusAction;
+
+
+/**
+ * Handler for SIGBUS: If the fault is in a mapped file (i.e. that file
+ * was truncated after it was mapped), replace the page with a page of
+ * zeroes and mark the mapping as damaged, so the read that caused the
+ * fault just continues. Any other fault gets the previous handler.
+ */
+static void sigbusHandler( int, siginfo_t * info, void * )
+{
+    quintptr address = (quintptr) info->si_addr;
+
+    for ( int i=0; i < MappedFile::MaxMappings; ++i )
+    {
+	MappingSlot & slot = mappingSlots[ i ];
+	quintptr start = slot.start.loadAcquire();
+
+	if ( start == 0 || address < start || address >= slot.end.loadAcquire() )
+	    continue;
+
+	void * page = (void *) ( address & ~( (quintptr) pageSize - 1 ) );
+
+	if ( mmap( page, pageSize, PROT_READ,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) != MAP_FAILED )
+	{
+	    slot.damaged.storeRelease( 1 );
+	    return;
+	}
+
+	break;
+    }
+
+    // Not ours: The faulting instruction is repeated when this returns, and
+    // then the previous handler (or the default: a crash) takes over.
+
+    sigaction( SIGBUS, &previousSigbusAction, 0 );
+}
+
+
+/**
+ * Install sigbusHandler(). Return 'true' on success.
+ */
+static bool installSigbusHandler()
+{
+    pageSize = sysconf( _SC_PAGESIZE );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    sigemptyset( &action.sa_mask );
+    action.sa_sigaction = sigbusHandler;
+    action.sa_flags	= SA_SIGINFO;
+
+    if ( sigaction( SIGBUS, &action, &previousSigbusAction ) != 0 )
+    {
+	logWarning() << "Can't install SIGBUS handler; not mapping files" << endl;
+	return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Register the mapping of 'size' bytes at 'data' in mappingSlots and return
+ * the slot or -1 if there is no free one.
+ */
+static int registerMapping( const uchar * data, qint64 size )
+{
+    static bool handlerInstalled = installSigbusHandler();
+
+    if ( ! handlerInstalled )
+	return -1;
+
+    for ( int i=0; i < MappedFile::MaxMappings; ++i )
+    {
+	MappingSlot & slot = mappingSlots[ i ];
+
+	if ( slot.used.testAndSetAcquire( 0, 1 ) )
+	{
+	    slot.damaged.storeRelease( 0 );
+	    slot.end.storeRelease( (quintptr) data + size );
+	    slot.start.storeRelease( (quintptr) data );
+
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+
+/**
+ * Release a slot of registerMapping().
+ */
+static void unregisterMapping( int slotIndex )
+{
+    MappingSlot & slot = mappingSlots[ slotIndex ];
+
+    slot.start.storeRelease( 0 );
+    slot.end.storeRelease( 0 );
+    slot.used.storeRelease( 0 );
+}
+
+
+/**
+ * Return 'true' if the file with the file descriptor 'fd' is on a local
+ * file system: Network file systems can't be trusted to keep a mapped file
+ * in place as well as local ones.
+ */
+static bool isLocalFileSystem( int fd )
+{
+#ifdef __linux__
+    struct statfs info;
+
+    if ( fstatfs( fd, &info ) != 0 )
+	return false;
+
+    switch ( (unsigned long) info.f_type )
+    {
+	case 0x6969:	 // NFS
+	case 0x517B:	 // SMB
+	case 0xFF534D42: // CIFS
+	case 0xFE534D42: // SMB2
+	case 0x65735546: // FUSE (sshfs etc.)
+	case 0x01021997: // 9P
+	case 0x00C36400: // Ceph
+	case 0x6B414653: // AFS
+	    return false;
+
+	default:
+	    return true;
+    }
+#else
+    Q_UNUSED( fd );
+
+    return true;
+#endif
+}
+
+
+MappedFile::MappedFile( const QString &	    fileName,
+			const CancelToken & token )
+    : _file( fileName, token )
+    , _buffer( token )
+    , _data( 0 )
+    , _size( 0 )
+    , _device( 0 )
+    , _slot( -1 )
+{
+
+}
+
+
+MappedFile::~MappedFile()
+{
+    _buffer.close();
+
+    if ( _data )
+    {
+	_file.unmap( _data );
+	unregisterMapping( _slot );
+    }
+
+    _file.close();
+}
+
+
+bool MappedFile::open()
+{
+    if ( _device )
+	return true;
+
+    if ( ! _file.open( QIODevice::ReadOnly | QIODevice::Unbuffered ) )
+	return false;
+
+    _size = _file.size();
+
+    // A modification time in the future doesn't count as settled either
+
+    qint64 age = QFileInfo( _file ).lastModified().msecsTo( QDateTime::currentDateTime() );
+    bool settled = age >= MinMapAge;
+    bool local	 = isLocalFileSystem( _file.handle() );
+
+    if ( _size > 0 && settled && local )
+    {
+	_data = _file.map( 0, _size );
+
+	if ( _data )
+	{
+	    _slot = registerMapping( _data, _size );
+
+	    if ( _slot < 0 )
+	    {
+		_file.unmap( _data );
+		_data = 0;
+	    }
+	}
+    }
+
+    if ( _data )
+    {
+	_bytes = QByteArray::fromRawData( (const char *) _data, _size );
+	_buffer.setBuffer( &_bytes );
+	_buffer.open( QIODevice::ReadOnly );
+	_device = &_buffer;
+    }
+    else if ( ! settled || ! local )
+    {
+	logDebug() << "Not mapping " << _file.fileName()
+		   << ( settled ? ": network file system" : ": modified just now" )
+		   << endl;
+
+	_bytes = _file.readAll();
+	_size  = _bytes.size();
+	_buffer.setBuffer( &_bytes );
+	_buffer.open( QIODevice::ReadOnly );
+	_device = &_buffer;
+    }
+    else
+    {
+	logDebug() << "Can't map " << _file.fileName()
+		   << "; reading it instead" << endl;
+
+	_device = &_file;
+    }
+
+    return true;
+}
+
+
+bool MappedFile::isDamaged() const
+{
+    return _slot >= 0 && mappingSlots[ _slot ].damaged.loadAcquire();
+}
+
+
+bool MappedFile::open( const QByteArray & bytes )
+{
+    if ( _device )
+	return true;
+
+    if ( bytes.isNull() )
+	return false;
+
+    _bytes = bytes;
+    _size  = bytes.size();
+    _buffer.setBuffer( &_bytes );
+    _buffer.open( QIODevice::ReadOnly );
+    _device = &_buffer;
+
+    return true;
+}
+
+
+Exiv2::Image::AutoPtr MappedFile::exiv2Image() const
+{
+    if ( isInMemory() )
+	return Exiv2::ImageFactory::open( data(), (long) _size );
+    else
+	return Exiv2::ImageFactory::open( _file.fileName().toStdString() );
+}
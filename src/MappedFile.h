@@ -0,0 +1,148 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <QString>
+#include <QByteArray>
+
+#include <exiv2/image.hpp>
+
+#include "CancellableFile.h"
+
+
+/**
+ * Image file for reading with QImageReader and Exiv2 that is mapped into
+ * memory if possible: The image data are then read directly from the page
+ * cache, without the buffered read() calls and copies of QFile and
+ * Exiv2::FileIo.
+ *
+ * device() is a QBuffer over the mapped memory; exiv2Image() opens the
+ * same memory with Exiv2 (Exiv2::MemIo, which never copies it for
+ * reading). If the file can't be mapped (e.g. on some network file systems
+ * or for special files), both fall back to reading the file the normal way.
+ *
+ * Files that were modified less than MinMapAge milliseconds ago and files
+ * on network file systems are not mapped, but read into memory: They might
+ * still be written, e.g. during tethered shooting.
+ *
+ * If a mapped file is truncated anyway, reading the missing part of the
+ * mapping raises SIGBUS. A signal handler then puts zeroes in place of it,
+ * so the process is not killed; isDamaged() tells that what was read is
+ * not valid.
+ *
+ * If the content of the file is in memory already (e.g. in the
+ * ReadAheadCache), open( bytes ) uses that instead of the file, so the
+ * image and its meta data can be read without opening the file again.
+ *
+ * The mapping is released when this object is destroyed, so it has to
+ * outlive the QImageReader and the Exiv2 image using it.
+ */
+class MappedFile
+{
+public:
+    /**
+     * Constructor. This does not open the file yet. Reading from device()
+     * fails once 'token' is cancelled.
+     */
+    MappedFile( const QString & fileName,
+		const CancelToken & token = CancelToken() );
+
+    /**
+     * Destructor. This releases the mapping.
+     */
+    virtual ~MappedFile();
+
+    /**
+     * Open the file and map it into memory. If it can't be mapped, open it
+     * for normal reading. Return 'false' if it can't be opened at all.
+     */
+    bool open();
+
+    /**
+     * Use 'bytes' as the content of the file instead of opening it. The
+     * bytes are shared, not copied. Return 'false' if 'bytes' is null.
+     */
+    bool open( const QByteArray & bytes );
+
+    /**
+     * Return 'true' if the file is mapped into memory.
+     */
+    bool isMapped() const { return _data != 0; }
+
+    /**
+     * Return 'true' if the file was truncated while it was mapped, so what
+     * was read from it is not valid. Callers should check this after
+     * reading and treat the file as changed.
+     */
+    bool isDamaged() const;
+
+    /**
+     * Return 'true' if the file content is in memory, i.e. if it is mapped
+     * or if it was opened with open( bytes ).
+     */
+    bool isInMemory() const { return _device == &_buffer; }
+
+    /**
+     * Return the file content if it is in memory or 0 if not.
+     */
+    const uchar * data() const
+	{ return isInMemory() ? (const uchar *) _bytes.constData() : 0; }
+
+    /**
+     * Return the size of the file in bytes.
+     */
+    qint64 size() const { return _size; }
+
+    /**
+     * Return the open QIODevice for reading the file (e.g. with
+     * QImageReader) or 0 if the file is not open: A buffer over the mapped
+     * memory or, as the fallback, the file itself.
+     */
+    QIODevice * device() const { return _device; }
+
+    /**
+     * Return the file for Exiv2: Over the memory if the content is in
+     * memory, otherwise read from the file itself. Like
+     * Exiv2::ImageFactory::open(), this throws an Exiv2::Error if Exiv2
+     * can't handle the file.
+     */
+    Exiv2::Image::AutoPtr exiv2Image() const;
+
+    /**
+     * Return the file name.
+     */
+    QString fileName() const { return _file.fileName(); }
+
+    /**
+     * Files modified less than this many milliseconds ago are read instead
+     * of mapped (the same as PhotoDir::SettleTime).
+     */
+    static const int MinMapAge = 2000;
+
+    /**
+     * Maximum number of files that are mapped at the same time; more are
+     * read instead.
+     */
+    static const int MaxMappings = 256;
+
+private:
+    Q_DISABLE_COPY( MappedFile );
+
+    CancellableFile   _file;
+    CancellableBuffer _buffer;	// over _bytes
+    QByteArray	      _bytes;	// over _data, shared or read
+    uchar *	      _data;
+    qint64	      _size;
+    QIODevice *	      _device;
+    int		      _slot;	// see isDamaged()
+};
+
+
+#endif // MappedFile_h
@@ -0,0 +1,285 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QStringList>
+
+#include "MemoryMonitor.h"
+#include "Logger.h"
+
+
+MemoryMonitor::MemoryMonitor( QObject * parent )
+    : QObject( parent )
+    , _headroom( -1 )
+    , _stall( -1.0 )
+{
+    _cgroupDir = cgroupDir();
+    _limitDir  = limitDir( _cgroupDir );
+
+    if ( ! _cgroupDir.isEmpty() )
+	logDebug() << "Using cgroup " << _cgroupDir << endl;
+
+    if ( ! _limitDir.isEmpty() )
+	logDebug() << "Using memory limit of cgroup " << _limitDir << endl;
+
+    connect( &_timer, SIGNAL( timeout() ),
+	     this,    SLOT  ( poll()	) );
+}
+
+
+MemoryMonitor::~MemoryMonitor()
+{
+
+}
+
+
+void MemoryMonitor::start( int interval )
+{
+    _timer.start( interval );
+}
+
+
+void MemoryMonitor::stop()
+{
+    _timer.stop();
+}
+
+
+void MemoryMonitor::poll()
+{
+    qint64 available = memAvailable();
+    qint64 current   = -1;
+    qint64 limit     = -1;
+    double stall     = -1.0;
+
+    if ( ! _cgroupDir.isEmpty() )
+	stall = readStall( _cgroupDir + "/memory.pressure" );
+
+    if ( ! _limitDir.isEmpty() )
+    {
+	current = readBytes( _limitDir + "/memory.current" );
+	limit	= readBytes( _limitDir + "/memory.max"	   );
+
+	// memory.current includes the page cache, which the read-ahead
+	// fills quickly; the inactive part of it is reclaimed long before
+	// the limit is a problem.
+
+	qint64 inactiveFile = readStat( _limitDir + "/memory.stat", "inactive_file" );
+
+	if ( current >= 0 && inactiveFile > 0 )
+	    current = qMax( 0LL, current - inactiveFile );
+    }
+
+    if ( stall < 0.0 )
+	stall = readStall( "/proc/pressure/memory" );
+
+    _headroom = available;
+
+    if ( current >= 0 && limit > 0 )
+    {
+	qint64 cgroupHeadroom = qMax( 0LL, limit - current );
+
+	if ( _headroom < 0 || cgroupHeadroom < _headroom )
+	    _headroom = cgroupHeadroom;
+    }
+
+    _stall = stall;
+
+    bool lowHeadroom = _headroom >= 0 && _headroom < LowHeadroom;
+    bool highStall   = _stall >= LowStallPercent;
+
+    if ( lowHeadroom || highStall )
+    {
+	qint64 wanted = MinRelease;
+
+	if ( lowHeadroom )
+	    wanted = qMax( wanted, LowHeadroom - _headroom );
+
+	logDebug() << "Memory is low: headroom "
+		   << ( _headroom < 0 ? QString( "unknown" ) :
+			QString( "%1 MB" ).arg( _headroom / ( 1024 * 1024 ) ) )
+		   << ", stalled " << _stall << "%" << endl;
+
+	emit memoryLow( wanted );
+    }
+    else if ( ( _headroom < 0 || _headroom > OkHeadroom ) &&
+	      _stall < LowStallPercent / 2.0 )
+    {
+	emit memoryOk();
+    }
+}
+
+
+qint64 MemoryMonitor::memAvailable()
+{
+    QFile file( "/proc/meminfo" );
+
+    if ( ! file.open( QIODevice::ReadOnly ) )
+	return -1;
+
+    // /proc files report a size of 0, so QTextStream::atEnd() would be
+    // true right away: Read line by line until there are no more.
+
+    QTextStream stream( &file );
+    QString line = stream.readLine();
+
+    while ( ! line.isNull() )
+    {
+	if ( line.startsWith( "MemAvailable:" ) )
+	{
+	    // "MemAvailable:   12345678 kB"
+
+	    QStringList fields = line.simplified().split( ' ' );
+
+	    if ( fields.size() >= 2 )
+		return fields.at( 1 ).toLongLong() * 1024;
+	}
+
+	line = stream.readLine();
+    }
+
+    return -1;
+}
+
+
+QString MemoryMonitor::cgroupDir()
+{
+    QFile file( "/proc/self/cgroup" );
+
+    if ( ! file.open( QIODevice::ReadOnly ) )
+	return QString();
+
+    QTextStream stream( &file );
+    QString line = stream.readLine();
+
+    while ( ! line.isNull() )
+    {
+	// cgroup v2: "0::/user.slice/user-1000.slice/session-2.scope"
+
+	if ( line.startsWith( "0::" ) )
+	{
+	    QString path = line.mid( 3 );
+
+	    // Pure cgroup v2 or the hybrid hierarchy with v1 controllers
+
+	    QStringList mountPoints;
+	    mountPoints << "/sys/fs/cgroup" << "/sys/fs/cgroup/unified";
+
+	    foreach ( const QString & mountPoint, mountPoints )
+	    {
+		QString dir = mountPoint + path;
+
+		if ( QFileInfo( dir + "/memory.current" ).exists() )
+		    return dir;
+	    }
+	}
+
+	line = stream.readLine();
+    }
+
+    return QString();
+}
+
+
+QString MemoryMonitor::limitDir( const QString & cgroupDir )
+{
+    QString dir = cgroupDir;
+
+    // The root cgroup has no memory.max
+
+    while ( ! dir.isEmpty() && QFileInfo( dir + "/memory.max" ).exists() )
+    {
+	if ( readBytes( dir + "/memory.max" ) > 0 )
+	    return dir;
+
+	QString parent = QFileInfo( dir ).path();
+
+	if ( parent == dir )
+	    break;
+
+	dir = parent;
+    }
+
+    return QString();
+}
+
+
+qint64 MemoryMonitor::readBytes( const QString & fileName )
+{
+    QFile file( fileName );
+
+    if ( ! file.open( QIODevice::ReadOnly ) )
+	return -1;
+
+    bool ok = false;
+    qint64 bytes = QString::fromLatin1( file.readLine().trimmed() ).toLongLong( &ok );
+
+    return ok ? bytes : -1; // "max" means no limit
+}
+
+
+qint64 MemoryMonitor::readStat( const QString & fileName, const QString & key )
+{
+    QFile file( fileName );
+
+    if ( ! file.open( QIODevice::ReadOnly ) )
+	return -1;
+
+    // "inactive_file 12345678"; see memAvailable() why not atEnd()
+
+    QTextStream stream( &file );
+    QString line = stream.readLine();
+
+    while ( ! line.isNull() )
+    {
+	QStringList fields = line.split( ' ' );
+
+	if ( fields.size() == 2 && fields.at( 0 ) == key )
+	{
+	    bool ok = false;
+	    qint64 value = fields.at( 1 ).toLongLong( &ok );
+
+	    return ok ? value : -1;
+	}
+
+	line = stream.readLine();
+    }
+
+    return -1;
+}
+
+
+double MemoryMonitor::readStall( const QString & fileName )
+{
+    QFile file( fileName );
+
+    if ( ! file.open( QIODevice::ReadOnly ) )
+	return -1.0;
+
+    // "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+
+    QString line = QString::fromLatin1( file.readLine().trimmed() );
+
+    if ( ! line.startsWith( "some " ) )
+	return -1.0;
+
+    foreach ( const QString & field, line.split( ' ' ) )
+    {
+	if ( field.startsWith( "avg10=" ) )
+	{
+	    bool ok = false;
+	    double value = field.mid( 6 ).toDouble( &ok );
+
+	    return ok ? value : -1.0;
+	}
+    }
+
+    return -1.0;
+}
@@ -0,0 +1,172 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef MemoryMonitor_h
+#define MemoryMonitor_h
+
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+
+/**
+ * Monitor for the memory of the system and of the cgroup this process runs
+ * in: It polls
+ *
+ *   - MemAvailable from /proc/meminfo,
+ *   - memory.current, memory.max and inactive_file from memory.stat of the
+ *     nearest cgroup (v2) up from the process's one that has a limit,
+ *   - the memory pressure stall information (PSI) of that cgroup or, if
+ *     it has none, of the system (/proc/pressure/memory)
+ *
+ * and emits memoryLow() when memory gets tight, so caches can be shrunk
+ * before the OOM killer picks this process, and memoryOk() when there is
+ * plenty again.
+ *
+ * Anything that can't be read (no cgroup v2, a kernel without PSI, not
+ * Linux at all) is simply ignored.
+ */
+class MemoryMonitor: public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor. This does not start monitoring yet; see start().
+     */
+    MemoryMonitor( QObject * parent = 0 );
+
+    /**
+     * Destructor.
+     */
+    virtual ~MemoryMonitor();
+
+    /**
+     * Start polling every 'interval' milliseconds.
+     */
+    void start( int interval = DefaultInterval );
+
+    /**
+     * Stop polling.
+     */
+    void stop();
+
+    /**
+     * Return the number of bytes that can still be allocated before memory
+     * gets tight: The lower of the available system memory and what is
+     * left until the cgroup limit. Inactive page cache counts as free in
+     * the cgroup, too, just like in MemAvailable: The kernel reclaims it
+     * before it gets tight. -1 means unknown. This is the value of the
+     * last poll().
+     */
+    qint64 headroom() const { return _headroom; }
+
+    /**
+     * Return the percentage of time in the last 10 seconds in which some
+     * tasks were stalled waiting for memory, or -1.0 if unknown. This is
+     * the value of the last poll().
+     */
+    double stall() const { return _stall; }
+
+    /**
+     * Default for the polling interval in milliseconds
+     */
+    static const int DefaultInterval = 2000;
+
+    /**
+     * Memory is low if there is less headroom than this
+     */
+    static const qint64 LowHeadroom = 512LL * 1024 * 1024;
+
+    /**
+     * Memory is ok again if there is more headroom than this
+     */
+    static const qint64 OkHeadroom = 1024LL * 1024 * 1024;
+
+    /**
+     * Memory is low if tasks were stalled waiting for memory this many
+     * percent of the time; it is ok again below half of that.
+     */
+    static const int LowStallPercent = 10;
+
+    /**
+     * What to ask for in memoryLow() at least
+     */
+    static const qint64 MinRelease = 64LL * 1024 * 1024;
+
+signals:
+
+    /**
+     * Emitted when memory is low. 'wanted' is the number of bytes that
+     * should be released. This is emitted after each poll as long as the
+     * memory stays low, so caches shrink progressively.
+     */
+    void memoryLow( qint64 wanted );
+
+    /**
+     * Emitted after each poll when there is plenty of memory, so caches
+     * that were shrunk can grow back.
+     */
+    void memoryOk();
+
+public slots:
+
+    /**
+     * Read the current values and emit memoryLow() or memoryOk().
+     */
+    void poll();
+
+protected:
+
+    /**
+     * Return MemAvailable from /proc/meminfo in bytes or -1.
+     */
+    static qint64 memAvailable();
+
+    /**
+     * Return the directory of the cgroup (v2) of this process in the
+     * cgroup file system or an empty string if there is none.
+     */
+    static QString cgroupDir();
+
+    /**
+     * Return the directory of the nearest cgroup from 'cgroupDir' up that
+     * has a memory limit (memory.max) or an empty string if there is none.
+     * Containers often set the limit on a parent of the process's cgroup.
+     */
+    static QString limitDir( const QString & cgroupDir );
+
+    /**
+     * Read a cgroup file that contains just one number of bytes. Return -1
+     * if it can't be read or if it contains "max" (no limit).
+     */
+    static qint64 readBytes( const QString & fileName );
+
+    /**
+     * Read the value of 'key' from a cgroup file with "key value" lines
+     * like memory.stat. Return -1 if it can't be read.
+     */
+    static qint64 readStat( const QString & fileName, const QString & key );
+
+    /**
+     * Read the "some avg10" value from a PSI file like /proc/pressure/memory.
+     * Return -1.0 if it can't be read.
+     */
+    static double readStall( const QString & fileName );
+
+private:
+
+    QTimer  _timer;
+    QString _cgroupDir;
+    QString _limitDir;
+    qint64  _headroom;
+    double  _stall;
+};
+
+
+#endif // MemoryMonitor_h
@@ -13,6 +13,8 @@
 #include "Photo.h"
 #include "PhotoDir.h"
 #include "PrefetchCache.h"
+#include "ImagePyramid.h"
+#include "Logger.h"
 
 long  Photo::_pixmapAccessCount	     = 0;
 long  Photo::_thumbnailAccessCount   = 0;
@@ -21,6 +23,8 @@ QSize Photo::_thumbnailSize	     = QSize( 120, 80 );
 
 Photo::Photo( const QString & fileName, PhotoDir *parentDir )
     : _photoDir( parentDir )
+    , _pixmapIsPreview( false )
+    , _metaDataValid( false )
     , _lastPixmapAccess( 0 )
     , _lastThumbnailAccess( 0 )
 {
@@ -45,16 +49,32 @@ Photo::Photo( const QString & fileName, PhotoDir *parentDir )
 
 Photo::~Photo()
 {
-
+    dropPyramid();
 }
 
 
 QPixmap Photo::fullSizePixmap()
 {
-    QPixmap pixmap( fullPath() );
-    _size = pixmap.size();
+    QImage image = pyramid()->fullSizeImage();
 
-    return pixmap;
+    if ( image.isNull() )
+    {
+	// Not loadable or too large to keep in the pyramid
+
+	QPixmap	   pixmap;
+	QByteArray bytes = fileContent();
+
+	if ( bytes.isNull() || ! pixmap.loadFromData( bytes ) )
+	    pixmap.load( fullPath() );
+
+	_size = pixmap.size();
+
+	return pixmap;
+    }
+
+    _size = image.size();
+
+    return QPixmap::fromImage( image );
 }
 
 
@@ -65,31 +85,116 @@ QPixmap Photo::pixmap( const QSizeF & size )
 }
 
 
-QPixmap Photo::pixmap( const QSize & size )
+bool Photo::loadPixmap( bool wait )
 {
-    QPixmap scaledPixmap;
+    dropStalePreview();
 
     if ( _pixmap.isNull() )
     {
 	if ( _photoDir && _photoDir->prefetchCache() )
 	{
-	    _size   = _photoDir->prefetchCache()->pixelSize( _fileName );
 	    _pixmap = _photoDir->prefetchCache()->pixmap( _fileName,
-							  true ); // take
+							  true, // take
+							  wait );
+	    _pixmapIsPreview = false;
+	    _size   = _photoDir->prefetchCache()->pixelSize( _fileName );
 	}
     }
+    else if ( _pixmapIsPreview && _photoDir && _photoDir->prefetchCache() )
+    {
+	// The imageReady() for the real image may have come while this was
+	// not the current photo, and the real image may be gone from the
+	// prefetch cache meanwhile: Make sure it is loaded (again).
+
+	_photoDir->prefetchCache()->requestImage( _fileName );
+    }
+
+    return ! _pixmap.isNull();
+}
+
+
+void Photo::dropStalePreview()
+{
+    if ( _pixmapIsPreview &&
+	 _photoDir && _photoDir->prefetchCache() &&
+	 _photoDir->prefetchCache()->contains( _fileName ) )
+    {
+	_pixmap = QPixmap();
+	_pixmapIsPreview = false;
+    }
+}
+
+
+bool Photo::preparePixmap()
+{
+    dropStalePreview();
+
+    if ( ! _pixmap.isNull() && ! _pixmapIsPreview )
+	return true;
+
+    if ( ! _photoDir || ! _photoDir->prefetchCache() ||
+	 ! _photoDir->prefetchCache()->contains( _fileName ) )
+    {
+	return false;
+    }
+
+    logDebug() << "Preparing pixmap for " << _fileName << endl;
+
+    return loadPixmap( false ); // don't wait
+}
+
+
+void Photo::setPreviewPixmap( const QPixmap & pixmap )
+{
+    if ( _pixmap.isNull() || _pixmapIsPreview )
+    {
+	_pixmap = pixmap;
+	_pixmapIsPreview = true;
+    }
+}
+
+
+bool Photo::pixmapAvailable()
+{
+    // A preview (e.g. a first frame left over from the last time this was
+    // the current photo) doesn't count: The real image has to be loaded.
+
+    if ( ! _pixmap.isNull() && ! _pixmapIsPreview )
+	return true;
+
+    return _photoDir && _photoDir->prefetchCache() &&
+	_photoDir->prefetchCache()->contains( _fileName );
+}
+
+
+QPixmap Photo::pixmap( const QSize & size )
+{
+    QPixmap scaledPixmap;
+    loadPixmap();
 
     qreal scaleFac = scaleFactor( _pixmap.size(), size );
+    QSize sizeDiff = scale( _pixmap.size(), size ) - _pixmap.size();
+
+    if ( qAbs( sizeDiff.width() ) <= 1 && qAbs( sizeDiff.height() ) <= 1 )
+    {
+	// Just rounding differences between the cached pixmap and the
+	// requested size: Scaling would only cost time, not improve anything.
 
-    if ( scaleFac <= 1.0 ) // not larger than cached pixmap
+	scaledPixmap = _pixmap;
+    }
+    else if ( scaleFac <= 1.0 || _pixmapIsPreview )
     {
+	// Not larger than the cached pixmap, or just a preview until the real
+	// pixmap is ready: Don't load the full size pixmap for this.
+
 	scaledPixmap = scale( _pixmap, scaleFac );
     }
     else // larger than cached pixmap
     {
-	scaledPixmap = fullSizePixmap();
-	scaleFac     = scaleFactor( scaledPixmap.size(), size );
-	scaledPixmap = scale( scaledPixmap, scaleFac );
+	// Scale from the nearest larger level of the image pyramid: This does
+	// not load the image file again for every zoom step.
+
+	scaledPixmap = QPixmap::fromImage( pyramid()->image( size ) );
     }
 
     _lastPixmapAccess = ++_pixmapAccessCount;
@@ -100,9 +205,58 @@ QPixmap Photo::pixmap( const QSize & size )
 }
 
 
+qint64 Photo::pixmapByteCount() const
+{
+    if ( _pixmap.isNull() )
+	return 0;
+
+    return (qint64) _pixmap.width() * _pixmap.height() * _pixmap.depth() / 8;
+}
+
+
 void Photo::dropCache()
 {
     _pixmap = QPixmap();
+    _pixmapIsPreview = false;
+    dropPyramid();
+}
+
+
+void Photo::invalidate()
+{
+    dropCache();
+    clearCachedThumbnail();
+    _size = QSize();
+    _metaData = PhotoMetaData();
+    _metaDataValid = false;
+}
+
+
+QSharedPointer<ImagePyramid> Photo::pyramid()
+{
+    if ( ! _pyramid )
+    {
+	// Levels smaller than the cached pixmap are never used for zooming
+
+	_pyramid = ImagePyramid::create( fullPath(),
+					 _pixmap.size(),
+					 ImagePyramid::DefaultMaxSize,
+					 fileContent() );
+    }
+
+    return _pyramid;
+}
+
+
+void Photo::dropPyramid()
+{
+    // Don't wait for the builder thread: It releases the pyramid when it is
+    // done, which is soon after it is cancelled.
+
+    if ( _pyramid )
+	_pyramid->cancel();
+
+    _pyramid.clear();
 }
 
 
@@ -136,9 +290,32 @@ QSize Photo::size()
 }
 
 
+QByteArray Photo::fileContent() const
+{
+    if ( _photoDir && _photoDir->prefetchCache() )
+	return _photoDir->prefetchCache()->fileContent( _fileName );
+
+    return QByteArray();
+}
+
+
 PhotoMetaData Photo::metaData()
 {
-    return PhotoMetaData( this );
+    if ( ! _metaDataValid )
+    {
+	if ( _photoDir && _photoDir->prefetchCache() )
+	{
+	    _metaDataValid =
+		_photoDir->prefetchCache()->metaData( _fileName, &_metaData );
+	}
+	else
+	{
+	    _metaData = PhotoMetaData( this );
+	    _metaDataValid = true;
+	}
+    }
+
+    return _metaData;
 }
 
 
@@ -10,12 +10,15 @@
 #define Photo_h
 
 #include <QString>
+#include <QByteArray>
 #include <QPixmap>
 #include <QSize>
+#include <QSharedPointer>
 
 #include "PhotoMetaData.h"
 
 class PhotoDir;
+class ImagePyramid;
 
 
 /**
@@ -37,21 +40,100 @@ public:
 
     /**
      * Return the full size pixmap of this photo.
+     * This uses the image pyramid (see pyramid()). Like the pyramid, this
+     * uses the file content from the prefetch cache if it is there.
      */
     QPixmap fullSizePixmap();
 
     /**
      * Return the pixmap of this photo resized to the specified size.
-     * This might use a cached pixmap that gets scaled down.
+     * This might use a cached pixmap that gets scaled down. Sizes larger than
+     * that are scaled from the image pyramid (see pyramid()).
      */
     QPixmap pixmap( const QSize	 & size );
     QPixmap pixmap( const QSizeF & size );
 
     /**
-     * Clear any cached pixmaps for this photo.
+     * Fetch the screen size pixmap of this photo from the prefetch cache if
+     * it is not cached in this photo already. Return 'true' if there is a
+     * pixmap now (which may be just a preview, see setPreviewPixmap()).
+     *
+     * A preview that is cached in this photo is replaced if the real image
+     * is in the prefetch cache now; if not, the real image is requested.
+     *
+     * If 'wait' is false, this never loads the image in the caller's thread
+     * and never waits for it: If it is not in the prefetch cache, the
+     * prefetch cache loads it in the background and emits imageReady() when
+     * it is ready, and this returns 'false'.
+     */
+    bool loadPixmap( bool wait = true );
+
+    /**
+     * Fetch the screen size pixmap of this photo from the prefetch cache
+     * ahead of time if it is there already, so converting the image to a
+     * pixmap does not cost any time when this photo becomes the current
+     * one. This never loads anything and never waits. Return 'true' if
+     * there is a pixmap now.
+     */
+    bool preparePixmap();
+
+    /**
+     * Use 'pixmap' (a first frame or the embedded EXIF preview) as a preview
+     * until the real pixmap is loaded (see pixmapIsPreview()). This does
+     * nothing if the real pixmap is already loaded.
+     */
+    void setPreviewPixmap( const QPixmap & pixmap );
+
+    /**
+     * Return 'true' if the screen size pixmap of this photo is available
+     * without loading anything: Either it is cached in this photo, or it is
+     * in the prefetch cache. A cached preview doesn't count.
+     */
+    bool pixmapAvailable();
+
+    /**
+     * Return 'true' if the cached pixmap of this photo is only a preview
+     * (see setPreviewPixmap()) because the real image was not loaded yet.
+     * In that case, the prefetch cache emits imageReady() for this photo
+     * when the real image is available; call dropCache() and pixmap() again
+     * then.
+     */
+    bool pixmapIsPreview() const { return _pixmapIsPreview; }
+
+    /**
+     * Return the number of bytes of the pixmap cached in this photo (0 if
+     * there is none).
+     */
+    qint64 pixmapByteCount() const;
+
+    /**
+     * Clear any cached pixmaps for this photo, including the image pyramid.
      */
     void dropCache();
 
+    /**
+     * The image file changed: Drop everything cached for this photo,
+     * including its size and thumbnail.
+     */
+    void invalidate();
+
+    /**
+     * Return the image pyramid for zooming this photo. If there is none yet,
+     * create it; that starts building it in the background.
+     *
+     * Since the pyramid can take a lot of memory, it should only exist for
+     * the current photo: Call dropPyramid() when navigating away. Users in
+     * other threads (like the TileCache) keep it alive until they release
+     * it.
+     */
+    QSharedPointer<ImagePyramid> pyramid();
+
+    /**
+     * Delete the image pyramid of this photo (if there is one). This only
+     * cancels building it; it does not wait for the builder thread.
+     */
+    void dropPyramid();
+
     /**
      * Return the original pixel size of the photo.
      */
@@ -70,7 +152,14 @@ public:
 
     /**
      * Return the meta data for this photo.
-     * If they are not loaded yet, load them first.
+     *
+     * They are read in the background by the prefetch cache and kept here
+     * once they are there. If they are not read yet, this returns empty meta
+     * data and moves this photo to the front of the queue; the prefetch
+     * cache emits metaDataReady() when they are available. This never reads
+     * the image file in the caller's thread unless there is no prefetch
+     * cache.
+     *
      * Notice that this is independent of loading the pixmap.
      */
     PhotoMetaData metaData();
@@ -155,6 +244,21 @@ public:
      */
     static QPixmap scale( const QPixmap & origPixmap, qreal scaleFactor );
 
+protected:
+
+    /**
+     * Return the content of the image file if the prefetch cache has it in
+     * memory already (see PrefetchCache::fileContent()) or a null byte
+     * array if not.
+     */
+    QByteArray fileContent() const;
+
+    /**
+     * If the cached pixmap is only a preview and the prefetch cache has the
+     * real image meanwhile, drop the preview so the real image is used.
+     */
+    void dropStalePreview();
+
 private:
     Q_DISABLE_COPY( Photo );
 
@@ -163,8 +267,12 @@ private:
     QString	_path;
 
     QPixmap	_pixmap;
+    bool	_pixmapIsPreview;
+    QSharedPointer<ImagePyramid> _pyramid;
     QPixmap	_thumbnail;
     QSize	_size;
+    PhotoMetaData _metaData;
+    bool	_metaDataValid;
 
     long	_lastPixmapAccess;
     long	_lastThumbnailAccess;
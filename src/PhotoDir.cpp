@@ -7,10 +7,16 @@
  */
 
 #include <QDir>
+#include <QDirIterator>
 #include <QFileInfo>
 #include <QStringList>
+#include <QMultiMap>
+#include <QSet>
+#include <QDateTime>
 #include <QDebug>
 
+#include <algorithm>
+
 #include "PhotoDir.h"
 #include "Photo.h"
 #include "PrefetchCache.h"
@@ -18,9 +24,13 @@
 
 
 PhotoDir::PhotoDir( const QString & path, bool jpgOnly )
-    : _path( path )
+    : QObject()
+    , _path( path )
     , _current( -1 )
+    , _lastCurrent( 0 )
     , _jpgOnly( jpgOnly )
+    , _scanThread( 0 )
+    , _rescanThread( 0 )
 {
     while ( _path.endsWith( "/" ) && _path.size() > 1 )
         _path.chop( 1 );
@@ -39,53 +49,313 @@ PhotoDir::PhotoDir( const QString & path, bool jpgOnly )
     }
 
     logInfo() << "Using dir " << _path << endl;
-    _prefetchCache = new PrefetchCache( _path );
-    read( _path, startPhotoName );
+    _prefetchCache   = new PrefetchCache( _path );
+    _prefetchMaxSize  = _prefetchCache->maxSize();
+    _readAheadMaxSize = _prefetchCache->readAheadCache().maxSize();
+    read( startPhotoName );
 }
 
 
 PhotoDir::~PhotoDir()
 {
+    if ( _scanThread )
+    {
+	_scanThread->abort();
+	_scanThread->wait();
+	delete _scanThread;
+    }
+
+    if ( _rescanThread )
+    {
+	_rescanThread->abort();
+	_rescanThread->wait();
+	delete _rescanThread;
+    }
+
     qDeleteAll( _photos );
     delete _prefetchCache;
 }
 
 
-void PhotoDir::read( const QString & dirPath, const QString & startPhotoName )
+void PhotoDir::read( const QString & startPhotoName )
 {
-    QStringList nameFilters;
-    nameFilters << "*.jpg" << "*.jpeg" << "*.JPG" << "*.JPEG";
+    _path = QDir( _path ).absolutePath();
 
-    if ( ! _jpgOnly )
+    // Don't wait for the directory to show the start photo
+
+    if ( ! startPhotoName.isEmpty() &&
+	 PhotoDirScanThread::isImageFile( startPhotoName, _jpgOnly ) &&
+	 QFileInfo( _path + "/" + startPhotoName ).isFile() )
     {
-	nameFilters << "*.png"	<< "*.PNG"
-		    << "*.gif"	<< "*.GIF"
-		    << "*.bmp"	<< "*.BMP"
-		    << "*.tif"	<< "*.TIF"
-		    << "*.tiff" << "*.TIFF"
-		    << "*.xpm"	<< "*.XPM"
-		    << "*.ppm"	<< "*.PPM"
-		    << "*.pgm"	<< "*.PGM"
-		    << "*.pbm"	<< "*.PBM";
+	_photos.append( new Photo( startPhotoName, this ) );
+	_current = 0;
     }
 
-    QDir dir ( dirPath );
-    _path = dir.absolutePath();
-    QStringList imageFileNames = dir.entryList( nameFilters,
-						QDir::Files,  // wanted type
-						QDir::Name ); // sort by
+    _scanTime.start();
+    _scanThread = new PhotoDirScanThread( _path, _jpgOnly );
+
+    connect( _scanThread, SIGNAL( filesFound( QStringList ) ),
+	     this,	  SLOT	( addFiles  ( QStringList ) ) );
+
+    connect( _scanThread, SIGNAL( finished() ),
+	     this,	  SLOT	( scanDone() ) );
+
+    _scanThread->start();
+
+    _rescanTimer.setSingleShot( true );
+
+    connect( &_rescanTimer, SIGNAL( timeout() ),
+	     this,	    SLOT  ( rescan()  ) );
 
-    foreach ( QString imageFileName, imageFileNames )
+    connect( &_watcher, SIGNAL( directoryChanged( QString ) ),
+	     this,	SLOT  ( directoryChanged()	    ) );
+
+    connect( &_watcher, SIGNAL( fileChanged( QString ) ),
+	     this,	SLOT  ( fileChanged( QString ) ) );
+
+    if ( ! _watcher.addPath( _path ) )
+	logWarning() << "Can't watch " << _path << " for changes" << endl;
+}
+
+
+void PhotoDir::addFiles( const QStringList & foundNames )
+{
+    QStringList newNames = foundNames;
+    std::sort( newNames.begin(), newNames.end() );
+
+    // Merge them into the sorted list of photos. Only the start photo can be
+    // there already.
+
+    Photo *	   current = this->current();
+    QList<Photo *> merged;
+    QStringList	   added;
+    int		   i = 0;
+
+    merged.reserve( _photos.size() + newNames.size() );
+
+    foreach ( const QString & fileName, newNames )
     {
-	Photo * photo = new Photo( imageFileName, this );
-	_photos.append( photo );
+	while ( i < _photos.size() && _photos.at( i )->fileName() < fileName )
+	    merged << _photos.at( i++ );
+
+	if ( i < _photos.size() && _photos.at( i )->fileName() == fileName )
+	    continue;
 
-	if ( imageFileName == startPhotoName )
-	    _current = _photos.size()-1;
+	merged << new Photo( fileName, this );
+	added  << fileName;
     }
 
-    if ( ! _photos.isEmpty() && _current < 0 )
-	_current = 0;
+    while ( i < _photos.size() )
+	merged << _photos.at( i++ );
+
+    if ( added.isEmpty() )
+	return;
+
+    _photos  = merged;
+    _current = current ? _photos.indexOf( current ) : 0;
+
+    if ( ! current )
+	currentChanged();
+
+    logDebug() << "Added " << added.size() << " photos; now "
+	       << _photos.size() << endl;
+
+    _prefetchCache->addFileNames( added );
+    _prefetchCache->setCurrentIndex( _current );
+    _prefetchCache->prefetch( added );
+
+    emit photosAdded();
+}
+
+
+void PhotoDir::scanDone()
+{
+    logInfo() << "Found " << _photos.size() << " photos in "
+	      << _scanTime.elapsed() << " millisec" << endl;
+
+    _scanThread->wait(); // finished() is emitted just before it returns
+    _scanThread->deleteLater();
+    _scanThread = 0;
+
+    // The scan did not stat the files to be fast, so there is nothing yet
+    // to compare a changed file with: Get the sizes and modification times
+    // now that all photos are known.
+
+    rescan();
+}
+
+
+void PhotoDir::directoryChanged()
+{
+    // Files are often created in several steps (create, write, rename), and
+    // many files may arrive at once: Wait until things calm down.
+
+    _rescanTimer.start( RescanDelay );
+}
+
+
+void PhotoDir::fileChanged( const QString & path )
+{
+    // Replacing the file by renaming another one over it removes it from
+    // the watcher: Watch the new one.
+
+    if ( ! _watcher.files().contains( path ) && QFileInfo( path ).isFile() )
+	_watcher.addPath( path );
+
+    _rescanTimer.start( RescanDelay );
+}
+
+
+void PhotoDir::rescan()
+{
+    if ( _scanThread || _rescanThread )
+    {
+	// Still busy reading the directory: Try again later
+
+	_rescanTimer.start( RescanDelay );
+	return;
+    }
+
+    _rescanThread = new PhotoDirScanThread( _path, _jpgOnly,
+					    true ); // withStats
+
+    connect( _rescanThread, SIGNAL( finished()	 ),
+	     this,	    SLOT  ( rescanDone() ) );
+
+    _rescanThread->start();
+}
+
+
+void PhotoDir::rescanDone()
+{
+    _rescanThread->wait();
+    PhotoDirScanThread::FileStats stats = _rescanThread->stats();
+    _rescanThread->deleteLater();
+    _rescanThread = 0;
+
+    // Modification times in the future (clock skew with a network file
+    // system) don't count as unsettled: That would never change.
+
+    qint64 now	     = QDateTime::currentMSecsSinceEpoch();
+    qint64 settled   = now - SettleTime;
+    bool   unsettled = false;
+
+    // Remove the photos whose files are gone and invalidate the ones whose
+    // files changed (only those: All other cached images stay valid).
+
+    Photo *	   current	  = this->current();
+    bool	   currentInvalid = false;
+    int		   newCurrent	  = -1;
+    int		   removedCount	  = 0;
+    QStringList	   changed;
+    QSet<QString>  known;
+    QList<Photo *> kept;
+
+    foreach ( Photo * photo, _photos )
+    {
+	QString fileName = photo->fileName();
+
+	if ( ! stats.contains( fileName ) )
+	{
+	    if ( photo == current )
+	    {
+		// The next photo that is kept takes its place
+
+		currentInvalid = true;
+		newCurrent     = kept.size();
+	    }
+
+	    if ( photo == _lastCurrent )
+		_lastCurrent = 0;
+
+	    _prefetchCache->invalidate( fileName );
+	    emit photoRemoved( photo );
+	    delete photo;
+	    ++removedCount;
+
+	    continue;
+	}
+
+	PhotoDirScanThread::FileStat stat = stats.value( fileName );
+
+	if ( _fileStats.contains( fileName ) && _fileStats.value( fileName ) != stat )
+	{
+	    photo->invalidate();
+	    _prefetchCache->invalidate( fileName );
+	    changed << fileName;
+
+	    if ( photo == current )
+		currentInvalid = true;
+	}
+
+	if ( stat.second > settled && stat.second <= now )
+	    unsettled = true;
+
+	if ( photo == current )
+	    newCurrent = kept.size();
+
+	known.insert( fileName );
+	kept << photo;
+    }
+
+    _photos  = kept;
+    _current = _photos.isEmpty() ? -1 : qBound( 0, newCurrent, _photos.size()-1 );
+
+    // New files, unless they are still being written
+
+    QStringList added;
+    PhotoDirScanThread::FileStats::const_iterator it = stats.constBegin();
+
+    while ( it != stats.constEnd() )
+    {
+	if ( ! known.contains( it.key() ) )
+	{
+	    if ( it.value().second > settled && it.value().second <= now )
+		unsettled = true;
+	    else
+		added << it.key();
+	}
+
+	++it;
+    }
+
+    // The new baseline: Everything that is a photo now
+
+    _fileStats.clear();
+
+    foreach ( const QString & fileName, known )
+	_fileStats.insert( fileName, stats.value( fileName ) );
+
+    foreach ( const QString & fileName, added )
+	_fileStats.insert( fileName, stats.value( fileName ) );
+
+    if ( removedCount > 0 || ! changed.isEmpty() || ! added.isEmpty() )
+    {
+	logInfo() << "Directory changed: " << added.size() << " new, "
+		  << removedCount << " removed, "
+		  << changed.size() << " changed" << endl;
+    }
+
+    if ( removedCount > 0 || ! changed.isEmpty() )
+    {
+	_prefetchCache->setFileNames( fileNames() );
+	_prefetchCache->setCurrentIndex( _current );
+
+	if ( ! changed.isEmpty() )
+	    _prefetchCache->prefetch( changed );
+    }
+
+    if ( currentInvalid )
+    {
+	currentChanged();
+	emit currentInvalidated();
+    }
+
+    if ( ! added.isEmpty() )
+	addFiles( added ); // this prefetches them, nearest first
+
+    if ( unsettled )
+	_rescanTimer.start( SettleTime );
 }
 
 
@@ -132,6 +402,8 @@ Photo * PhotoDir::setCurrent( int index )
 	return 0;
 
     _current = qBound( 0, index, _photos.size()-1 );
+    currentChanged();
+
     return _photos.at( _current );
 }
 
@@ -141,7 +413,10 @@ void PhotoDir::setCurrent( Photo * photo )
     int index = find( photo );
 
     if ( index >= 0 )
+    {
 	_current = index;
+	currentChanged();
+    }
 }
 
 
@@ -157,6 +432,8 @@ Photo * PhotoDir::toFirst()
 	return 0;
 
     _current = 0;
+    currentChanged();
+
     return _photos.first();
 }
 
@@ -167,6 +444,8 @@ Photo * PhotoDir::toLast()
 	return 0;
 
     _current = _photos.size()-1;
+    currentChanged();
+
     return _photos.last();
 }
 
@@ -178,6 +457,7 @@ Photo * PhotoDir::toNext()
 
     ++_current;
     _current = qBound( 0, _current, _photos.size()-1 );
+    currentChanged();
 
     return _photos.at( _current );
 }
@@ -190,6 +470,7 @@ Photo * PhotoDir::toPrevious()
 
     --_current;
     _current = qBound( 0, _current, _photos.size()-1 );
+    currentChanged();
 
     return _photos.at( _current );
 }
@@ -200,40 +481,136 @@ void PhotoDir::prefetch()
     if ( _photos.isEmpty() )
 	return;
 
-    QStringList jobs;
-    int last = _photos.size()-1;
-
-    if ( _current >= 0	 )     addJob( jobs, _current	);
-    if ( _current < last )     addJob( jobs, _current+1 );
-    if ( _current > 0	 )     addJob( jobs, _current-1 );
+    // The prefetch cache orders its jobs by their distance from the current
+    // photo and re-ranks them whenever the current photo changes, so there is
+    // no need to sort them here.
 
-    if ( _current > 1	   )   addJob( jobs, 0 );
-    if ( last > _current+1 )   addJob( jobs, last );
+    _prefetchCache->setFileNames( fileNames() );
+    _prefetchCache->setCurrentIndex( _current );
+    _prefetchCache->prefetch( fileNames() );
+}
 
-    for ( int i = _current+2; i < last; ++i )
-	addJob( jobs, i );
 
-    for ( int i = _current-2; i > 0; --i )
-	addJob( jobs,  i );
+void PhotoDir::dropCache()
+{
+    _prefetchCache->clear();
 
-    _prefetchCache->prefetch( jobs );
+    foreach ( Photo * photo, _photos )
+    {
+	photo->dropCache();
+    }
 }
 
 
-void PhotoDir::addJob( QStringList & jobs, int index )
+qint64 PhotoDir::releaseMemory( qint64 wanted )
 {
-    jobs.append( _photos.at( index )->fileName() );
-}
+    // First the compressed files in the read-ahead cache: They are the
+    // cheapest to get back.
 
+    ReadAheadCache & readAhead = _prefetchCache->readAheadCache();
+    qint64 readAheadBytes   = readAhead.byteCount();
+    qint64 readAheadMaxSize = qMax( readAheadBytes - wanted, (qint64) MinReadAheadCacheSize );
 
-void PhotoDir::dropCache()
-{
-    _prefetchCache->clear();
+    if ( readAheadMaxSize < readAhead.maxSize() )
+	readAhead.setMaxSize( readAheadMaxSize );
 
-    foreach ( Photo * photo, _photos )
+    qint64 readAheadReleased = qMax( 0LL, readAheadBytes - readAhead.byteCount() );
+    qint64 cacheReleased = 0;
+
+    if ( readAheadReleased < wanted )
+    {
+	// The prefetch cache evicts the images farthest away from the current
+	// one first. Keep a minimum so the neighbours can still be prefetched.
+
+	qint64 cacheBytes = _prefetchCache->byteCount();
+	qint64 maxSize	  = qMax( cacheBytes - ( wanted - readAheadReleased ),
+				  (qint64) MinPrefetchCacheSize );
+
+	if ( _prefetchCache->maxSize() == 0 || maxSize < _prefetchCache->maxSize() )
+	    _prefetchCache->setMaxSize( maxSize );
+
+	cacheReleased = qMax( 0LL, cacheBytes - _prefetchCache->byteCount() );
+    }
+
+    // Then the pixmaps cached in the photos, farthest away first
+
+    QMultiMap<int, Photo *> byDistance;
+
+    for ( int i = 0; i < _photos.size(); ++i )
     {
+	int distance = qAbs( i - _current );
+
+	if ( distance > 1 && _photos.at( i )->pixmapByteCount() > 0 )
+	    byDistance.insert( distance, _photos.at( i ) );
+    }
+
+    qint64 pixmapReleased = 0;
+    int	   pixmapCount	  = 0;
+    QMapIterator<int, Photo *> it( byDistance );
+    it.toBack();
+
+    while ( it.hasPrevious() &&
+	    readAheadReleased + cacheReleased + pixmapReleased < wanted )
+    {
+	Photo * photo = it.previous().value();
+
+	pixmapReleased += photo->pixmapByteCount();
+	++pixmapCount;
 	photo->dropCache();
     }
+
+    qint64 released = readAheadReleased + cacheReleased + pixmapReleased;
+
+    logInfo() << "Memory is low: Released "
+	      << released / ( 1024 * 1024 ) << " MB of "
+	      << wanted / ( 1024 * 1024 ) << " MB wanted ("
+	      << readAheadReleased / ( 1024 * 1024 ) << " MB from the read-ahead cache, now limited to "
+	      << readAhead.maxSize() / ( 1024 * 1024 ) << " MB; "
+	      << cacheReleased / ( 1024 * 1024 ) << " MB from the prefetch cache, now limited to "
+	      << _prefetchCache->maxSize() / ( 1024 * 1024 ) << " MB; "
+	      << pixmapReleased / ( 1024 * 1024 ) << " MB in "
+	      << pixmapCount << " pixmaps)" << endl;
+
+    return released;
+}
+
+
+void PhotoDir::restoreMemory()
+{
+    ReadAheadCache & readAhead = _prefetchCache->readAheadCache();
+    qint64 maxSize	    = _prefetchCache->maxSize();
+    qint64 readAheadMaxSize = readAhead.maxSize();
+
+    if ( maxSize == _prefetchMaxSize && readAheadMaxSize == _readAheadMaxSize )
+	return;
+
+    // Grow back in steps: Memory might get low again right away.
+
+    maxSize	     = restoredSize( maxSize, _prefetchMaxSize, MinPrefetchCacheSize );
+    readAheadMaxSize = restoredSize( readAheadMaxSize, _readAheadMaxSize, MinReadAheadCacheSize );
+
+    _prefetchCache->setMaxSize( maxSize );
+    readAhead.setMaxSize( readAheadMaxSize );
+
+    logInfo() << "Memory is ok again: Prefetch cache limit raised to "
+	      << ( maxSize == 0 ? QString( "unlimited" ) :
+		   QString( "%1 MB" ).arg( maxSize / ( 1024 * 1024 ) ) )
+	      << "; read-ahead cache limit raised to "
+	      << readAheadMaxSize / ( 1024 * 1024 ) << " MB" << endl;
+}
+
+
+qint64 PhotoDir::restoredSize( qint64 maxSize, qint64 origMaxSize, qint64 minSize )
+{
+    if ( maxSize == origMaxSize )
+	return maxSize;
+
+    maxSize = qMax( maxSize + minSize, maxSize * 5 / 4 );
+
+    if ( origMaxSize == 0 || maxSize >= origMaxSize )
+	maxSize = origMaxSize;
+
+    return maxSize;
 }
 
 
@@ -249,4 +626,142 @@ void PhotoDir::take( Photo * photo )
 
     photo->reparent( 0 );
     _photos.removeAt( index );
+
+    if ( photo == _lastCurrent )
+    {
+	photo->dropPyramid();
+	_lastCurrent = 0;
+    }
+
+    _prefetchCache->setFileNames( fileNames() );
+    currentChanged();
+}
+
+
+QStringList PhotoDir::fileNames() const
+{
+    QStringList fileNames;
+
+    foreach ( Photo * photo, _photos )
+	fileNames << photo->fileName();
+
+    return fileNames;
+}
+
+
+void PhotoDir::currentChanged()
+{
+    _prefetchCache->setCurrentIndex( _current );
+
+    Photo * photo = current();
+
+    if ( _lastCurrent && _lastCurrent != photo )
+	_lastCurrent->dropPyramid();
+
+    _lastCurrent = photo;
+
+    // The directory watch only reports files that are created, removed or
+    // renamed, not a file that is written in place: Watch the current one
+    // for that, since that is the one the user looks at.
+
+    QString watchedFile = photo ? photo->fullPath() : QString();
+
+    if ( watchedFile != _watchedFile )
+    {
+	if ( ! _watchedFile.isEmpty() )
+	    _watcher.removePath( _watchedFile );
+
+	_watchedFile = watchedFile;
+
+	if ( ! _watchedFile.isEmpty() )
+	    _watcher.addPath( _watchedFile );
+    }
+}
+
+
+
+
+PhotoDirScanThread::PhotoDirScanThread( const QString & path,
+					bool		jpgOnly,
+					bool		withStats ):
+    QThread(),
+    _path( path ),
+    _jpgOnly( jpgOnly ),
+    _withStats( withStats )
+{
+
+}
+
+
+static QSet<QString> imageSuffixes( bool jpgOnly )
+{
+    QSet<QString> suffixes;
+    suffixes << "jpg" << "jpeg";
+
+    if ( ! jpgOnly )
+    {
+	suffixes << "png" << "gif" << "bmp" << "tif" << "tiff"
+		 << "xpm" << "ppm" << "pgm" << "pbm";
+    }
+
+    return suffixes;
+}
+
+
+bool PhotoDirScanThread::isImageFile( const QString & fileName, bool jpgOnly )
+{
+    static const QSet<QString> jpgSuffixes = imageSuffixes( true  );
+    static const QSet<QString> allSuffixes = imageSuffixes( false );
+
+    int dot = fileName.lastIndexOf( '.' );
+
+    if ( dot < 0 )
+	return false;
+
+    QString suffix = fileName.mid( dot + 1 ).toLower();
+
+    return jpgOnly ? jpgSuffixes.contains( suffix ) : allSuffixes.contains( suffix );
+}
+
+
+void PhotoDirScanThread::run()
+{
+    // QDirIterator only stats a file if the file system does not report
+    // its type in the directory entry, and it does not sort: Both would take
+    // a long time for a directory with 100000 files.
+
+    QDirIterator it( _path, QDir::Files );
+    QStringList	 batch;
+    QElapsedTimer timer;
+    timer.start();
+
+    while ( it.hasNext() && ! _abort.loadAcquire() )
+    {
+	it.next();
+	QString fileName = it.fileName();
+
+	if ( ! isImageFile( fileName, _jpgOnly ) )
+	    continue;
+
+	if ( _withStats )
+	{
+	    QFileInfo fileInfo = it.fileInfo();
+	    _stats.insert( fileName,
+			   FileStat( fileInfo.size(),
+				     fileInfo.lastModified().toMSecsSinceEpoch() ) );
+	    continue;
+	}
+
+	batch << fileName;
+
+	if ( timer.elapsed() >= BatchInterval )
+	{
+	    emit filesFound( batch );
+	    batch.clear();
+	    timer.restart();
+	}
+    }
+
+    if ( ! batch.isEmpty() && ! _abort.loadAcquire() )
+	emit filesFound( batch );
 }
@@ -9,23 +9,117 @@
 #ifndef PhotoDir_h
 #define PhotoDir_h
 
+#include <QObject>
 #include <QString>
 #include <QList>
+#include <QStringList>
 #include <QSize>
+#include <QThread>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPair>
+#include <QTimer>
+#include <QFileSystemWatcher>
 
 class Photo;
 class PrefetchCache;
 
 
+/**
+ * Helper class: Scan thread. This reads a disk directory in the background
+ * and reports the image files in it in batches, in the order they come from
+ * the file system, not sorted.
+ *
+ * With 'withStats', it reports nothing while it runs, but collects the size
+ * and modification time of each image file; see stats().
+ */
+class PhotoDirScanThread: public QThread
+{
+    Q_OBJECT
+
+public:
+
+    typedef QPair<qint64, qint64>	FileStat;  // size, mtime in millisec
+    typedef QHash<QString, FileStat>	FileStats; // by file name
+
+    /**
+     * Constructor. If 'jpgOnly' is true, only JPG files are reported.
+     */
+    PhotoDirScanThread( const QString & path,
+			bool		jpgOnly,
+			bool		withStats = false );
+
+    /**
+     * Return the size and modification time of all image files. This is
+     * only complete after the thread is finished, and only filled if
+     * 'withStats' was passed to the constructor.
+     */
+    FileStats stats() const { return _stats; }
+
+    /**
+     * Make the thread return as soon as possible. This does not wait for it.
+     */
+    void abort() { _abort.storeRelease( 1 ); }
+
+    /**
+     * Return 'true' if 'fileName' has the extension of an image file that
+     * can be displayed (only JPG if 'jpgOnly' is true).
+     */
+    static bool isImageFile( const QString & fileName, bool jpgOnly );
+
+    /**
+     * Time in milliseconds to collect files before they are reported
+     */
+    static const int BatchInterval = 100;
+
+signals:
+
+    /**
+     * Emitted for each batch of image files found. 'fileNames' are without
+     * path.
+     */
+    void filesFound( const QStringList & fileNames );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    QString    _path;
+    bool       _jpgOnly;
+    bool       _withStats;
+    QAtomicInt _abort;
+    FileStats  _stats;
+};
+
+
 /**
  * A collection of photos that corresponds to one disk directory.
  * This class takes care of reading the disk directory, filtering out all image
  * files in that directory that can be displayed, creating a corresponding
  * instance of the Photo class for each one, managing those objects and
  * destroying them in its destructor.
+ *
+ * The directory is read in a background thread, so even with a very large
+ * directory the start photo can be shown right away: If a file was passed
+ * to the constructor, that is the only photo at first. The others are added
+ * in sorted order as they are found (see photosAdded()); the current photo
+ * stays the same while the index of it may change.
+ *
+ * After that, the directory is watched for changes (e.g. new files during
+ * tethered shooting): Photos are added and removed as their files come and
+ * go, and photos whose files changed are loaded again. A file that is
+ * written in place (not replaced) is only noticed for the current photo,
+ * since only that file is watched itself.
  */
-class PhotoDir
+class PhotoDir: public QObject
 {
+    Q_OBJECT
+
 public:
     /**
      * Constructor. 'path' can be the file system path of the directory or one
@@ -125,6 +219,12 @@ public:
      */
     Photo * toPrevious();
 
+    /**
+     * Return the file names (without path) of all photos in this PhotoDir in
+     * directory order.
+     */
+    QStringList fileNames() const;
+
     /**
      * Begin prefetching photos.
      */
@@ -135,6 +235,23 @@ public:
      */
     void dropCache();
 
+    /**
+     * Memory is low: Release about 'wanted' bytes, first from the read-ahead
+     * cache (compressed files) and the prefetch cache by lowering their
+     * memory budgets, then the pixmaps cached in the photos. All of them
+     * drop the images farthest away from the current photo first; the
+     * pixmaps of the current photo and its neighbours are kept.
+     * Return the number of bytes released.
+     */
+    qint64 releaseMemory( qint64 wanted );
+
+    /**
+     * Memory is no longer low: Raise the memory budgets of the read-ahead
+     * and the prefetch cache one step back towards what they were before
+     * releaseMemory().
+     */
+    void restoreMemory();
+
     /**
      * Take the specified photo out of this collection. Ownership is
      * transferred to the caller, i.e. the caller has to take care of deleting
@@ -153,19 +270,118 @@ public:
      */
     PrefetchCache * prefetchCache() const { return _prefetchCache; }
 
+    /**
+     * Return 'true' if the directory is still being read, i.e. more photos
+     * may still be added.
+     */
+    bool isScanning() const { return _scanThread != 0; }
+
+    /**
+     * The lowest memory budget releaseMemory() sets for the prefetch cache
+     */
+    static const qint64 MinPrefetchCacheSize = 64LL * 1024 * 1024;
+
+    /**
+     * The lowest memory budget releaseMemory() sets for the read-ahead cache
+     */
+    static const qint64 MinReadAheadCacheSize = 32LL * 1024 * 1024;
+
+    /**
+     * Time in milliseconds to wait for more changes of the directory before
+     * reading it again
+     */
+    static const int RescanDelay = 500;
+
+    /**
+     * Files that were modified less than this many milliseconds ago are
+     * probably still being written: New ones are only added after that,
+     * and the directory is read again then.
+     */
+    static const int SettleTime = 2000;
+
+
+signals:
+
+    /**
+     * Emitted when photos were added while the directory is read or
+     * because new files appeared in it.
+     */
+    void photosAdded();
+
+    /**
+     * Emitted when the file of the current photo changed or was removed:
+     * It has to be shown again. In the latter case, the next photo is the
+     * current one now.
+     */
+    void currentInvalidated();
+
+    /**
+     * Emitted right before 'photo' is deleted because its file was removed:
+     * Don't use any pointer to it after this.
+     */
+    void photoRemoved( Photo * photo );
+
+
+protected slots:
+
+    /**
+     * Add a batch of image files found by the scan thread: Create a Photo
+     * object for each one and insert it into the sorted list of photos,
+     * keeping the current photo.
+     */
+    void addFiles( const QStringList & foundNames );
+
+    /**
+     * Notification that the scan thread is done.
+     */
+    void scanDone();
+
+    /**
+     * Notification from the file system watcher that the directory changed:
+     * Read it again after a short delay.
+     */
+    void directoryChanged();
+
+    /**
+     * Notification from the file system watcher that the file of the
+     * current photo changed: Read the directory again after a short delay,
+     * just like for directoryChanged().
+     */
+    void fileChanged( const QString & path );
+
+    /**
+     * Read the directory again with file sizes and modification times.
+     */
+    void rescan();
+
+    /**
+     * Notification that the rescan thread is done: Add, remove and
+     * invalidate photos accordingly.
+     */
+    void rescanDone();
+
 
 protected:
 
     /**
-     * Read the disk directory 'dirPath', create a Photo object for each image
-     * file, and set _current to the directory entry 'startPhotoName'.
+     * Start reading the disk directory. If 'startPhotoName' is an image
+     * file, it becomes the current photo right away.
+     */
+    void read( const QString & startPhotoName );
+
+    /**
+     * Notify the prefetch cache that the current photo changed so it can
+     * move its window of cached images accordingly, and drop the image
+     * pyramid of the previous current photo.
      */
-    void read( const QString & dirPath, const QString & startPhotoName );
+    void currentChanged();
 
     /**
-     * Add a prefetch job for the photo with the specified index to 'jobs'.
+     * Return the next step for raising a memory budget from 'maxSize' back
+     * to 'origMaxSize' (0 means unlimited) in restoreMemory(). 'minSize' is
+     * the minimum step.
      */
-    void addJob( QStringList & jobs, int index );
+    static qint64 restoredSize( qint64 maxSize, qint64 origMaxSize, qint64 minSize );
 
 
 private:
@@ -173,8 +389,18 @@ private:
     QString		_path;
     QList<Photo *>	_photos;
     int			_current;
+    Photo *		_lastCurrent;
     bool		_jpgOnly;
     PrefetchCache *	_prefetchCache;
+    qint64		_prefetchMaxSize; // before releaseMemory()
+    qint64		_readAheadMaxSize; // before releaseMemory()
+    PhotoDirScanThread * _scanThread;
+    QElapsedTimer	_scanTime;
+    QFileSystemWatcher	_watcher;
+    QString		_watchedFile; // full path of the current photo
+    QTimer		_rescanTimer;
+    PhotoDirScanThread * _rescanThread;
+    PhotoDirScanThread::FileStats _fileStats; // as of the last rescan
 };
 
 
@@ -9,14 +9,18 @@
 #include <exiv2/image.hpp>
 #include <exiv2/exif.hpp>
 #include <QDebug>
+#include <QElapsedTimer>
 
 #include "PhotoMetaData.h"
 #include "Photo.h"
+#include "MappedFile.h"
+#include "ExifReader.h"
+#include "Logger.h"
 
 
 PhotoMetaData::PhotoMetaData( Photo * photo )
 {
-    _isEmpty = true;
+    init();
 
     if ( photo )
     {
@@ -27,13 +31,102 @@ PhotoMetaData::PhotoMetaData( Photo * photo )
 }
 
 
+PhotoMetaData::PhotoMetaData( const MappedFile & file, const QSize & size )
+{
+    init();
+
+    _photoFullPath = file.fileName();
+    _size	   = size;
+    readExifData( file );
+}
+
+
+PhotoMetaData::PhotoMetaData()
+{
+    init();
+}
+
+
+void PhotoMetaData::init()
+{
+    _isEmpty		  = true;
+    _iso		  = 0;
+    _focalLength	  = 0;
+    _focalLength35mmEquiv = 0;
+}
+
+
 void PhotoMetaData::readExifData( const QString & fileName )
 {
-    try
+    MappedFile file( fileName );
+    file.open();
+
+    readExifData( file );
+}
+
+
+void PhotoMetaData::readExifData( const MappedFile & file )
+{
+    if ( useFastExifReader() && readFastExifData( file ) )
+	return;
+
+    readExiv2ExifData( file );
+}
+
+
+bool PhotoMetaData::useFastExifReader()
+{
+    static const bool useFast =
+	qgetenv( "QPHOTOVIEW_EXIF_READER" ).toLower() != "exiv2";
+
+    return useFast;
+}
+
+
+bool PhotoMetaData::readFastExifData( const MappedFile & file )
+{
+    ExifReader reader;
+
+    if ( file.isInMemory() )
     {
-	Exiv2::Image::AutoPtr image =
-	    Exiv2::ImageFactory::open( _photoFullPath.toStdString() );
+	if ( ! reader.read( file.data(), file.size() ) )
+	    return false;
+    }
+    else if ( file.device() )
+    {
+	// The Exif segment is at the start of the file: Don't read all of it
+
+	QByteArray header = file.device()->peek( ExifReader::MaxHeaderSize );
+
+	if ( ! reader.read( (const uchar *) header.constData(), header.size() ) )
+	    return false;
+    }
+    else
+    {
+	return false;
+    }
+
+    if ( ! reader.hasExifData() )
+	return true;
 
+    _isEmpty		  = false;
+    _exposureTime	  = reader.exposureTime();
+    _aperture		  = reader.aperture();
+    _iso		  = reader.iso();
+    _focalLength	  = reader.focalLength().toDouble();
+    _focalLength35mmEquiv = reader.focalLength35mmEquiv();
+    _origSize		  = reader.pixelDimensions();
+    _dateTimeTaken	  = QDateTime::fromString( reader.dateTimeOriginal(), Qt::ISODate );
+
+    return true;
+}
+
+
+void PhotoMetaData::readExiv2ExifData( const MappedFile & file )
+{
+    try
+    {
+	Exiv2::Image::AutoPtr image = file.exiv2Image();
 	image->readMetadata();
 	Exiv2::ExifData &exifData = image->exifData();
 
@@ -58,7 +151,86 @@ void PhotoMetaData::readExifData( const QString & fileName )
     catch ( Exiv2::Error& exception )
     {
 	qWarning() << "Caught Exiv2 exception:" << exception.what()
-		   << "for" << fileName;
+		   << "for" << file.fileName();
+    }
+}
+
+
+bool PhotoMetaData::sameExifData( const PhotoMetaData & other ) const
+{
+    return _isEmpty			 == other._isEmpty			&&
+	_exposureTime.numerator()	 == other._exposureTime.numerator()	&&
+	_exposureTime.denominator()	 == other._exposureTime.denominator()	&&
+	_aperture.numerator()		 == other._aperture.numerator()		&&
+	_aperture.denominator()		 == other._aperture.denominator()	&&
+	_iso				 == other._iso				&&
+	_focalLength			 == other._focalLength			&&
+	_focalLength35mmEquiv		 == other._focalLength35mmEquiv		&&
+	_origSize			 == other._origSize			&&
+	_dateTimeTaken			 == other._dateTimeTaken;
+}
+
+
+void PhotoMetaData::benchmark( const QString &	   path,
+			       const QStringList & fileNames )
+{
+    logInfo() << "*** EXIF reader benchmark: " << fileNames.size()
+	      << " files in " << path << endl;
+
+    qint64 fastTime   = 0; // nanosec
+    qint64 exiv2Time  = 0;
+    qint64 fastOnly   = 0; // only the files ExifReader handled
+    int	   fastCount  = 0;
+    int	   mismatches = 0;
+
+    foreach ( const QString & fileName, fileNames )
+    {
+	MappedFile file( path + "/" + fileName );
+
+	if ( ! file.open() )
+	    continue;
+
+	// Once without timing so both find the file in the page cache
+
+	PhotoMetaData warmUp;
+	warmUp.readExiv2ExifData( file );
+
+	PhotoMetaData fast;
+	PhotoMetaData exiv2;
+	QElapsedTimer timer;
+
+	timer.start();
+	bool handled = fast.readFastExifData( file );
+	qint64 elapsed = timer.nsecsElapsed();
+	fastTime += elapsed;
+
+	timer.restart();
+	exiv2.readExiv2ExifData( file );
+	exiv2Time += timer.nsecsElapsed();
+
+	if ( handled )
+	{
+	    ++fastCount;
+	    fastOnly += elapsed;
+
+	    if ( ! fast.sameExifData( exiv2 ) )
+	    {
+		++mismatches;
+		logWarning() << "EXIF data differ for " << fileName << endl;
+	    }
+	}
+    }
+
+    logInfo() << "ExifReader: " << fastTime / 1000 << " usec; handled "
+	      << fastCount << " of " << fileNames.size() << " files in "
+	      << fastOnly / 1000 << " usec" << endl;
+
+    logInfo() << "Exiv2:      " << exiv2Time / 1000 << " usec" << endl;
+
+    if ( fastTime > 0 )
+    {
+	logInfo() << "Speedup: " << QString::number( exiv2Time / (double) fastTime, 'f', 1 )
+		  << "x; mismatches: " << mismatches << endl;
     }
 }
 
@@ -116,3 +288,19 @@ QString PhotoMetaData::exifString( Exiv2::ExifData &  exifData,
 }
 
 
+
+
+PhotoMetaDataBenchmarkThread::PhotoMetaDataBenchmarkThread( const QString &	path,
+							    const QStringList & fileNames ):
+    QThread(),
+    _path( path ),
+    _fileNames( fileNames )
+{
+
+}
+
+
+void PhotoMetaDataBenchmarkThread::run()
+{
+    PhotoMetaData::benchmark( _path, _fileNames );
+}
@@ -10,12 +10,15 @@
 #define PhotoMetaData_h
 
 #include <QString>
+#include <QStringList>
 #include <QSize>
 #include <QDateTime>
+#include <QThread>
 
 #include "Fraction.h"
 
 class Photo;
+class MappedFile;
 
 namespace Exiv2
 {
@@ -23,8 +26,41 @@ namespace Exiv2
 };
 
 
+/**
+ * Helper class: Thread that runs PhotoMetaData::benchmark(), so that does
+ * not block the UI thread while it reads a whole directory twice.
+ */
+class PhotoMetaDataBenchmarkThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    PhotoMetaDataBenchmarkThread( const QString &     path,
+				  const QStringList & fileNames );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    QString	_path;
+    QStringList _fileNames;
+};
+
+
 /**
  * Class representing meta data (EXIF/IPTC/XMP) for one photo.
+ *
+ * For JPEG files, the EXIF data are read with the lightweight ExifReader;
+ * Exiv2 is only used for other formats and for files ExifReader can't
+ * handle. The environment variable QPHOTOVIEW_EXIF_READER=exiv2 makes it
+ * always use Exiv2.
  */
 class PhotoMetaData
 {
@@ -36,6 +72,19 @@ public:
      */
     PhotoMetaData( Photo * photo );
 
+    /**
+     * Constructor: Read the meta data from 'file', which is open already.
+     * 'size' is the current size of the image. Unlike the other constructor,
+     * this does not need any Photo object, so it can be used in any thread.
+     * If the content of 'file' is in memory, this never reads the file.
+     */
+    PhotoMetaData( const MappedFile & file, const QSize & size );
+
+    /**
+     * Default constructor: Empty meta data.
+     */
+    PhotoMetaData();
+
     // Gladly using the default C++ provided default bitwise copy constructor
 
     /**
@@ -94,6 +143,13 @@ public:
      */
     QString photoFullPath() const { return _photoFullPath; }
 
+    /**
+     * Read the EXIF data of all files in 'fileNames' in 'path' with
+     * ExifReader and with Exiv2, log the time each one needs and check
+     * that both get the same values.
+     */
+    static void benchmark( const QString & path, const QStringList & fileNames );
+
 #if 0
     /**
      * Return the camera the photo was taken with.
@@ -109,11 +165,43 @@ public:
 
 private:
 
+    /**
+     * Initialize all fields to empty values.
+     */
+    void init();
+
     /**
      * Read the EXIF data from the specified file name.
      */
     void readExifData( const QString & fileName );
 
+    /**
+     * Read the EXIF data from 'file', which is open already.
+     */
+    void readExifData( const MappedFile & file );
+
+    /**
+     * Read the EXIF data from 'file' with ExifReader. Return 'false' if it
+     * can't handle the file, i.e. if Exiv2 has to be used.
+     */
+    bool readFastExifData( const MappedFile & file );
+
+    /**
+     * Read the EXIF data from 'file' with Exiv2.
+     */
+    void readExiv2ExifData( const MappedFile & file );
+
+    /**
+     * Return 'true' if the EXIF data are the same as in 'other'.
+     */
+    bool sameExifData( const PhotoMetaData & other ) const;
+
+    /**
+     * Return 'true' if ExifReader should be used (unless disabled with
+     * QPHOTOVIEW_EXIF_READER=exiv2).
+     */
+    static bool useFastExifReader();
+
     /**
      * Get the EXIF value with key 'exifKey' return it as Fraction.
      */
@@ -17,7 +17,13 @@
 #include "PhotoView.h"
 #include "PhotoDir.h"
 #include "Photo.h"
+#include "PrefetchCache.h"
 #include "Canvas.h"
+#include "TileCache.h"
+#include "ImageScaler.h"
+#include "MemoryMonitor.h"
+#include "ReadAheadCache.h"
+#include "PhotoMetaData.h"
 #include "Panner.h"
 #include "SensitiveBorder.h"
 #include "BorderPanel.h"
@@ -27,6 +33,8 @@
 
 
 static const int DefaultIdleTimeout = 4000; // millisec
+static const int NavigationDelay    =   50; // millisec
+static const int PrepareDelay	    =  300; // millisec
 
 
 PhotoView::PhotoView( PhotoDir * photoDir )
@@ -36,13 +44,17 @@ PhotoView::PhotoView( PhotoDir * photoDir )
     , _zoomMode( ZoomFitImage )
     , _zoomFactor( 1.0	 )
     , _zoomIncrement( 1.2 )
+    , _firstPixelsShown( false )
     , _idleTimeout( DefaultIdleTimeout )
     , _actions( this )
+    , _benchmarkThread( 0 )
 {
     Q_CHECK_PTR( photoDir );
     setScene( new QGraphicsScene );
 
     _canvas = new Canvas( this );
+    _tileCache = new TileCache( this );
+    _memoryMonitor = new MemoryMonitor( this );
     createBorders();
 
     QSize pannerMaxSize( qApp->desktop()->screenGeometry().size() / 6 );
@@ -89,6 +101,53 @@ PhotoView::PhotoView( PhotoDir * photoDir )
     _idleTimer.start( _idleTimeout );
     _cursor = viewport()->cursor();
 
+    connect( &_navigationTimer, SIGNAL( timeout()		 ),
+	     this,		SLOT  ( loadNavigationTarget() ) );
+
+    _navigationTimer.setSingleShot( true );
+    _navigationTimer.setInterval( NavigationDelay );
+
+    connect( &_prepareTimer, SIGNAL( timeout()	       ),
+	     this,	     SLOT  ( prepareNeighbours() ) );
+
+    _prepareTimer.setSingleShot( true );
+    _prepareTimer.setInterval( PrepareDelay );
+
+    connect( _photoDir->prefetchCache(), SIGNAL( imageReady( QString ) ),
+	     this,			 SLOT  ( imageReady( QString ) ) );
+
+    connect( _photoDir->prefetchCache(), SIGNAL( imageFailed( QString ) ),
+	     this,			 SLOT  ( imageFailed( QString ) ) );
+
+    connect( _photoDir->prefetchCache(), SIGNAL( firstFrameReady( QString, QImage ) ),
+	     this,			 SLOT  ( firstFrameReady( QString, QImage ) ) );
+
+    connect( _photoDir->prefetchCache(), SIGNAL( metaDataReady( QString ) ),
+	     _exifPanel,		 SLOT  ( metaDataReady( QString ) ) );
+
+    connect( _tileCache, SIGNAL( tileReady( QRect ) ),
+	     this,	 SLOT  ( tileReady( QRect ) ) );
+
+    connect( _memoryMonitor, SIGNAL( memoryLow( qint64 ) ),
+	     this,	     SLOT  ( memoryLow( qint64 ) ) );
+
+    connect( _memoryMonitor, SIGNAL( memoryOk() ),
+	     this,	     SLOT  ( memoryOk() ) );
+
+    connect( _photoDir, SIGNAL( photosAdded() ),
+	     this,	SLOT  ( photosAdded() ) );
+
+    connect( _photoDir, SIGNAL( currentInvalidated() ),
+	     this,	SLOT  ( currentInvalidated() ) );
+
+    connect( _photoDir, SIGNAL( photoRemoved( Photo * ) ),
+	     this,	SLOT  ( photoRemoved( Photo * ) ) );
+
+    connect( _photoDir, SIGNAL( photoRemoved( Photo * ) ),
+	     _exifPanel, SLOT  ( photoRemoved( Photo * ) ) );
+
+    _memoryMonitor->start();
+
     //
     // Load images
     //
@@ -108,12 +167,23 @@ PhotoView::~PhotoView()
 	delete style();
     }
 
+    if ( _benchmarkThread )
+    {
+	// The benchmark uses neither this view nor the PhotoDir, but it
+	// can't be interrupted either.
+
+	_benchmarkThread->wait();
+	delete _benchmarkThread;
+    }
+
     delete scene();
 }
 
 
 bool PhotoView::loadImage()
 {
+    _navigationTimer.stop();
+    _awaitedImage.clear();
     _zoomMode = ZoomFitImage;
     bool success = reloadCurrent( size() );
 
@@ -124,27 +194,13 @@ bool PhotoView::loadImage()
 	if ( success && photo )
 	{
             logInfo() << "Loading " << photo->fileName() << endl;
-	    QString title( "QPhotoView	" + photo->fileName() );
-	    QString resolution;
-
-	    if ( photo->size().isValid() )
-	    {
-		resolution = QString( "	 %1 x %2" )
-		    .arg( photo->size().width() )
-		    .arg( photo->size().height() );
-	    }
-
-	    setWindowTitle( title + "  " + resolution );
-
-	    QString panelText = photo->fullPath();
-	    panelText += "\n" + resolution;
-
-	    _titlePanel->setText( panelText );
-	    _titlePanel->setTextAlignment( Qt::AlignRight | Qt::AlignVCenter );
+	    updateTitle( photo );
 
 	    if ( _exifPanel->isActive() )
 		_exifPanel->setMetaData();
 	}
+
+	_prepareTimer.start();
     }
     else // ! success
     {
@@ -156,9 +212,72 @@ bool PhotoView::loadImage()
 }
 
 
+void PhotoView::photosAdded()
+{
+    // If no start photo was passed, there is nothing to show before the
+    // first photos of the directory are found.
+
+    if ( ! _lastPhoto && _photoDir->current() )
+	loadImage();
+}
+
+
+void PhotoView::currentInvalidated()
+{
+    // The photo shown might be deleted already
+
+    _lastPhoto = 0;
+
+    if ( _photoDir->current() )
+	loadImage();
+}
+
+
+void PhotoView::photoRemoved( Photo * photo )
+{
+    if ( photo == _lastPhoto )
+	_lastPhoto = 0;
+}
+
+
+void PhotoView::benchmarkFinished()
+{
+    if ( _benchmarkThread )
+    {
+	_benchmarkThread->deleteLater();
+	_benchmarkThread = 0;
+    }
+
+    _photoDir->prefetchCache()->readAheadCache().setPaused( false );
+}
+
+
+void PhotoView::updateTitle( Photo * photo )
+{
+    QString title( "QPhotoView	" + photo->fileName() );
+    QString resolution;
+
+    if ( photo->size().isValid() )
+    {
+	resolution = QString( "	 %1 x %2" )
+	    .arg( photo->size().width() )
+	    .arg( photo->size().height() );
+    }
+
+    setWindowTitle( title + "  " + resolution );
+
+    QString panelText = photo->fullPath();
+    panelText += "\n" + resolution;
+
+    _titlePanel->setText( panelText );
+    _titlePanel->setTextAlignment( Qt::AlignRight | Qt::AlignVCenter );
+}
+
+
 void PhotoView::clear()
 {
     _canvas->clear();
+    _tileCache->clear();
     setWindowTitle( "QPhotoView" );
 }
 
@@ -184,11 +303,20 @@ bool PhotoView::reloadCurrent( const QSize & size )
     QPixmap pixmap;
     QSizeF origSize = photo->size();
 
+    // At 1:1 and when zooming in, the zoomed image can be many times the size
+    // of the original image: Show only the visible tiles of it.
+
+    bool tiled = origSize.isValid() &&
+	( _zoomMode == NoZoom ||
+	  ( _zoomMode == UseZoomFactor && _zoomFactor >= 1.0 ) );
+
     switch ( _zoomMode )
     {
 	case NoZoom:
-	    pixmap = photo->fullSizePixmap();
 	    _zoomFactor = 1.0;
+
+	    if ( ! tiled )
+		pixmap = photo->fullSizePixmap();
 	    break;
 
 
@@ -233,14 +361,39 @@ bool PhotoView::reloadCurrent( const QSize & size )
 	    break;
 
 	case UseZoomFactor:
-	    pixmap = photo->pixmap( _zoomFactor * origSize );
+
+	    if ( ! tiled )
+		pixmap = photo->pixmap( _zoomFactor * origSize );
 	    break;
 
 	    // Deliberately omitting 'default' branch so the compiler will warn
 	    // about unhandled enum values
     };
 
-    _canvas->setPixmap( pixmap );
+    if ( tiled )
+    {
+	// The photo scaled to the window is cheap (it is normally cached), so
+	// use it as a placeholder for the tiles that are not rendered yet.
+
+	pixmap = photo->pixmap( size );
+
+	// The canvas may show the tile cache already, so its size changes
+	// right in setImage()
+
+	_canvas->prepareSizeChange();
+	_tileCache->setImage( photo->fullPath(), photo->size(), _zoomFactor,
+			      photo->pyramid() );
+	_canvas->setTileCache( _tileCache, pixmap );
+    }
+    else
+    {
+	// Detach the tile cache first: Clearing it changes its size
+
+	_canvas->setTileCache( 0 );
+	_tileCache->clear();
+	_canvas->setPixmap( pixmap );
+    }
+
     success = ! pixmap.isNull();
 
     if ( success )
@@ -253,6 +406,7 @@ bool PhotoView::reloadCurrent( const QSize & size )
 
 	updatePanner( size );
 	_canvas->fixPosAnimated( false ); // not animated
+	logLoadTime( photo );
     }
 
     setSceneRect( 0, 0, size.width(), size.height() );
@@ -430,6 +584,146 @@ void PhotoView::hideBorder()
 }
 
 
+void PhotoView::imageReady( const QString & imageFileName )
+{
+    Photo * photo = _photoDir->current();
+
+    if ( ! photo || photo->fileName() != imageFileName )
+    {
+	// Maybe the next or the previous photo: Convert it to a pixmap once
+	// things have calmed down.
+
+	if ( _awaitedImage.isEmpty() && ! _navigationTimer.isActive() )
+	    _prepareTimer.start();
+
+	return;
+    }
+
+    if ( imageFileName == _awaitedImage )
+    {
+	if ( photo->pixmapIsPreview() ) // the first frame
+	    photo->dropCache();
+
+	loadImage();
+    }
+    else if ( photo->pixmapIsPreview() )
+    {
+	logDebug() << "Replacing preview with " << imageFileName << endl;
+	photo->dropCache();
+	reloadCurrent( size() );
+    }
+}
+
+
+void PhotoView::imageFailed( const QString & imageFileName )
+{
+    Photo * photo = _photoDir->current();
+
+    if ( photo && photo->fileName() == imageFileName &&
+	 imageFileName == _awaitedImage )
+    {
+	loadImage();
+    }
+}
+
+
+void PhotoView::loadNavigationTarget()
+{
+    Photo * photo = _photoDir->current();
+
+    if ( ! photo )
+	return;
+
+    if ( photo->loadPixmap( false ) ) // don't wait
+    {
+	// In the prefetch cache meanwhile or a preview from last time
+
+	loadImage();
+    }
+    else
+    {
+	logDebug() << "Waiting for " << photo->fileName() << endl;
+	_awaitedImage = photo->fileName();
+	_photoDir->prefetchCache()->requestFirstFrame( _awaitedImage );
+    }
+}
+
+
+void PhotoView::prepareNeighbours()
+{
+    // Navigation is still going on: Anything prepared now might be useless.
+
+    if ( _navigationTimer.isActive() || ! _awaitedImage.isEmpty() )
+	return;
+
+    int current = _photoDir->currentIndex();
+    Photo * next = _photoDir->photo( current + 1 );
+    Photo * prev = _photoDir->photo( current - 1 );
+
+    if ( next )
+	next->preparePixmap();
+
+    if ( prev )
+	prev->preparePixmap();
+}
+
+
+void PhotoView::firstFrameReady( const QString & imageFileName, const QImage & image )
+{
+    Photo * photo = _photoDir->current();
+
+    if ( photo && photo->fileName() == imageFileName &&
+	 imageFileName == _awaitedImage )
+    {
+	photo->setPreviewPixmap( QPixmap::fromImage( image ) );
+	_zoomMode = ZoomFitImage;
+	reloadCurrent( size() );
+    }
+}
+
+
+void PhotoView::logLoadTime( Photo * photo )
+{
+    if ( ! _loadTime.isValid() )
+	return;
+
+    qint64 elapsed = _loadTime.elapsed();
+
+    if ( ! _firstPixelsShown )
+    {
+	logInfo() << "Time to first pixels for " << photo->fileName() << ": "
+		  << PrefetchCache::formatTime( elapsed ) << endl;
+	_firstPixelsShown = true;
+    }
+
+    if ( ! photo->pixmapIsPreview() )
+    {
+	logInfo() << "Time to final image for " << photo->fileName() << ": "
+		  << PrefetchCache::formatTime( elapsed ) << endl;
+	_loadTime.invalidate();
+    }
+}
+
+
+void PhotoView::tileReady( const QRect & rect )
+{
+    if ( _canvas->tileCache() )
+	_canvas->update( rect );
+}
+
+
+void PhotoView::memoryLow( qint64 wanted )
+{
+    _photoDir->releaseMemory( wanted );
+}
+
+
+void PhotoView::memoryOk()
+{
+    _photoDir->restoreMemory();
+}
+
+
 void PhotoView::setIdleTimeout( int millisec )
 {
     _idleTimeout = millisec;
@@ -530,7 +824,28 @@ void PhotoView::navigate( NavigationTarget where )
         case NavigateLast:      _photoDir->toLast();     break;
     }
 
-    loadImage();
+    Photo * photo = _photoDir->current();
+    _awaitedImage.clear();
+    _loadTime.start();
+    _firstPixelsShown = false;
+
+    if ( photo && photo->pixmapAvailable() )
+    {
+	// Nothing to load: Show it right away
+
+	loadImage();
+    }
+    else
+    {
+	// Don't load anything yet: Key repeat or a high resolution touchpad
+	// can send many of these in a row, and only the last one matters.
+	// Meanwhile, keep showing the previous photo with the new title.
+
+	if ( photo )
+	    updateTitle( photo );
+
+	_navigationTimer.start();
+    }
 }
 
 
@@ -592,6 +907,66 @@ void PhotoView::keyPressEvent( QKeyEvent * event )
 	    }
 	    break;
 
+	case Qt::Key_X:
+	    // Scaler benchmark: Qt vs. SIMD with the current photo. Decoding
+	    // it in full size and scaling it 30 times takes a while, so this
+	    // runs in a thread of its own as well.
+
+	    if ( _benchmarkThread )
+	    {
+		logInfo() << "Benchmark still running" << endl;
+		break;
+	    }
+
+	    if ( ! _photoDir->current() )
+		break;
+
+	    _benchmarkThread = new ImageScalerBenchmarkThread( _photoDir->current()->fullPath(),
+							       size() );
+	    connect( _benchmarkThread, SIGNAL( finished()	  ),
+		     this,	       SLOT  ( benchmarkFinished() ) );
+	    _benchmarkThread->start();
+	    break;
+
+	case Qt::Key_Z:
+	    // Reader benchmark: threads vs. io_uring with the current directory.
+	    // This takes a while, so it runs in a thread of its own, and the
+	    // read-ahead readers are paused meanwhile so they don't compete
+	    // with it for the storage.
+
+	    if ( _benchmarkThread )
+	    {
+		logInfo() << "Benchmark still running" << endl;
+		break;
+	    }
+
+	    _photoDir->prefetchCache()->readAheadCache().setPaused( true );
+	    _benchmarkThread = new ReadAheadCacheBenchmarkThread( _photoDir->path(),
+								  _photoDir->fileNames() );
+	    connect( _benchmarkThread, SIGNAL( finished()	  ),
+		     this,	       SLOT  ( benchmarkFinished() ) );
+	    _benchmarkThread->start();
+	    break;
+
+	case Qt::Key_E:
+	    // EXIF benchmark: ExifReader vs. Exiv2 with the current directory.
+	    // This reads every file twice, so it runs in a thread of its own as
+	    // well.
+
+	    if ( _benchmarkThread )
+	    {
+		logInfo() << "Benchmark still running" << endl;
+		break;
+	    }
+
+	    _photoDir->prefetchCache()->readAheadCache().setPaused( true );
+	    _benchmarkThread = new PhotoMetaDataBenchmarkThread( _photoDir->path(),
+								 _photoDir->fileNames() );
+	    connect( _benchmarkThread, SIGNAL( finished()	  ),
+		     this,	       SLOT  ( benchmarkFinished() ) );
+	    _benchmarkThread->start();
+	    break;
+
 	default:
 	    QGraphicsView::keyPressEvent( event );
     }
@@ -12,14 +12,18 @@
 #include <QGraphicsView>
 #include <QAction>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QCursor>
 
 class QGraphicsPixmapItem;
 class QResizeEvent;
 class QKeyEvent;
+class QThread;
 class PhotoDir;
 class Photo;
 class Canvas;
+class TileCache;
+class MemoryMonitor;
 class Panner;
 class SensitiveBorder;
 class BorderPanel;
@@ -162,6 +166,12 @@ public slots:
     /**
      * Navigate to another image in the image directory (next, previous, first,
      * last, current).
+     *
+     * This moves to the new photo right away, but it shows it right away
+     * only if it is already loaded. Otherwise, it is loaded in the
+     * background once there was no more navigation for a short while, so a
+     * burst of navigation events (key repeat, touchpad scrolling) loads only
+     * the last photo.
      */
     void navigate( NavigationTarget where );
 
@@ -237,6 +247,11 @@ public:
      */
     Canvas * canvas() const { return _canvas; }
 
+    /**
+     * Return the tile cache that the canvas uses for high zoom factors.
+     */
+    TileCache * tileCache() const { return _tileCache; }
+
     /**
      * Return the internal panner graphics item that displays the scroll status.
      */
@@ -257,9 +272,100 @@ protected slots:
      */
     void hideBorder();
 
+    /**
+     * Notification that the prefetch cache finished loading an image: If the
+     * current photo is only displayed as a preview so far, replace it with
+     * the real image.
+     */
+    void imageReady( const QString & imageFileName );
+
+    /**
+     * Notification that the prefetch cache could not load an image: If that
+     * is the current photo that navigate() is waiting for, load it here to
+     * show the error.
+     */
+    void imageFailed( const QString & imageFileName );
+
+    /**
+     * Notification that the prefetch cache has a cheap first frame (or the
+     * embedded preview) of an image: If the current photo is still waiting to be loaded, show that
+     * until it is loaded in full quality.
+     */
+    void firstFrameReady( const QString & imageFileName, const QImage & image );
+
+    /**
+     * Load the photo that navigate() moved to after navigation came to
+     * rest. This never loads the image in the UI thread: If it is not in
+     * the prefetch cache, it requests a cheap first frame and waits for
+     * imageReady().
+     */
+    void loadNavigationTarget();
+
+    /**
+     * Convert the images of the next and the previous photo to pixmaps
+     * while the user is looking at the current one, so that is not done in
+     * loadImage() when navigating there. See Photo::preparePixmap().
+     */
+    void prepareNeighbours();
+
+    /**
+     * Notification that the tile cache finished rendering the tile that
+     * covers 'rect' (in canvas coordinates): Repaint that part of the
+     * canvas.
+     */
+    void tileReady( const QRect & rect );
+
+    /**
+     * Notification that memory is low: Release about 'wanted' bytes of
+     * cached images (see PhotoDir::releaseMemory()).
+     */
+    void memoryLow( qint64 wanted );
+
+    /**
+     * Notification that memory is no longer low: Let the caches grow back
+     * (see PhotoDir::restoreMemory()).
+     */
+    void memoryOk();
+
+    /**
+     * Notification that the PhotoDir found more photos while reading the
+     * directory: Show the current one if nothing is shown yet.
+     */
+    void photosAdded();
+
+    /**
+     * Notification that the file of the current photo changed or was
+     * removed: Show the (new) current photo.
+     */
+    void currentInvalidated();
+
+    /**
+     * Notification that the PhotoDir is about to delete 'photo': Forget it
+     * if it is the photo shown last.
+     */
+    void photoRemoved( Photo * photo );
+
+    /**
+     * Notification that the benchmark thread started from keyPressEvent()
+     * finished: Delete it and resume the read-ahead readers.
+     */
+    void benchmarkFinished();
+
 
 protected:
 
+    /**
+     * Update the window title and the title panel for 'photo'.
+     */
+    void updateTitle( Photo * photo );
+
+    /**
+     * Log the time to the first pixels and the time to the final image of
+     * the photo that navigation moved to, if there is any such photo that
+     * was not completely shown yet.
+     */
+    void logLoadTime( Photo * photo );
+
     /**
      * Reload the current photo in the specified size.
      * Return 'true' on success, 'false' on error.
@@ -309,14 +415,22 @@ private:
     PhotoDir *	_photoDir;
     Canvas   *	_canvas;
     Panner   *	_panner;
+    TileCache *	_tileCache;
+    MemoryMonitor * _memoryMonitor;
     Photo    *	_lastPhoto;
     ZoomMode	_zoomMode;
     qreal	_zoomFactor;
     qreal	_zoomIncrement;
     QTimer	_idleTimer;
+    QTimer	_navigationTimer;
+    QTimer	_prepareTimer;
+    QString	_awaitedImage;
+    QElapsedTimer _loadTime;
+    bool	_firstPixelsShown;
     int		_idleTimeout;
     QCursor	_cursor;
     Actions     _actions;
+    QThread *	_benchmarkThread;
 
     SensitiveBorder *	_topLeftCorner;
     SensitiveBorder *	_topBorder;
@@ -9,123 +9,961 @@
 #include <QDebug>
 #include <QApplication>
 #include <QDesktopWidget>
+#include <QImageReader>
+
+#include <exiv2/image.hpp>
+#include <exiv2/preview.hpp>
+
+#include <utility>
 
 #include "PrefetchCache.h"
 #include "Photo.h"
+#include "ImageScaler.h"
+#include "MappedFile.h"
 #include "Logger.h"
 
 
-PrefetchCache::PrefetchCache( const QString & path )
-    : _path( path )
-    , _workerThread( this )
-{
-    _fullScreenSize = qApp->desktop()->screenGeometry().size();
-}
+PrefetchCache::PrefetchCache( const QString & path, qint64 maxSize )
+    : _byteCount( 0 )
+    , _duplicatesAvoided( 0 )
+    , _maxSize( maxSize )
+    , _depth( envValue( "QPHOTOVIEW_PREFETCH_DEPTH", 0 ) )
+    , _path( path )
+    , _spillByteCount( 0 )
+    , _summaryLogged( false )
+    , _readAhead( path,
+		  envValue( "QPHOTOVIEW_READ_AHEAD_DEPTH",   ReadAheadCache::DefaultDepth ),
+		  ReadAheadCache::DefaultMaxSize,
+		  envValue( "QPHOTOVIEW_READ_AHEAD_READERS", ReadAheadCache::DefaultReaderCount ) )
+    , _sizeProbeThread( this )
+    , _firstFrameThread( this )
+{
+    _fullScreenSize = qApp->desktop()->screenGeometry().size();
+    setWorkerCount( 0 ); // one for each CPU core
+
+    for ( int i=0; i < MetaDataThreadCount; ++i )
+	_metaDataThreads << new PrefetchCacheMetaDataThread( this );
+
+    logDebug() << "Prefetch depth: " << _depth
+	       << "; read-ahead depth: " << _readAhead.depth()
+	       << " with " << _readAhead.readerCount() << " readers ("
+	       << ReadAheadCache::backendName( _readAhead.backend() ) << ")" << endl;
+}
+
+
+PrefetchCache::~PrefetchCache()
+{
+    int percent = 0;
+
+    if ( _sizes.size() > 0 )
+        percent = 100 * _cache.size() / _sizes.size();
+
+    logDebug() << "Unused images in prefetch cache: " << _cache.size()
+               << " (" <<  percent << "%)" << endl;
+    logDebug() << "Duplicate loads avoided: " << _duplicatesAvoided << endl;
+    _sizeProbeThread.abort();
+    _firstFrameThread.abort();
+
+    foreach ( PrefetchCacheMetaDataThread * thread, _metaDataThreads )
+	thread->abort();
+
+    clear();
+    waitForWorkers();
+    _sizeProbeThread.wait();
+    _firstFrameThread.wait();
+
+    foreach ( PrefetchCacheMetaDataThread * thread, _metaDataThreads )
+	thread->wait();
+
+    qDeleteAll( _workers );
+    qDeleteAll( _metaDataThreads );
+}
+
+
+void PrefetchCache::prefetch( const QStringList & fileNames )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+        logDebug() << "Prefetching " << fileNames.size() << " images" << endl;
+        _stopWatch.start();
+	_summaryLogged = false;
+
+	foreach ( QString fileName, fileNames )
+	{
+	    _jobQueue.add( fileName );
+	}
+    }
+
+    startSizeProbe( fileNames );
+    startWorkers();
+    prefetchMetaData( fileNames );
+}
+
+
+void PrefetchCache::startSizeProbe( const QStringList & fileNames )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	// A running probe thread just picks these up as well, in the same
+	// order as the prefetch jobs.
+
+	foreach ( const QString & fileName, fileNames )
+	{
+	    if ( ! _sizes.contains( fileName ) )
+		_sizeProbeQueue.add( fileName );
+	}
+
+	if ( _sizeProbeQueue.isEmpty() || ! _sizeProbeThread._finished )
+	    return;
+
+	_sizeProbeThread._finished = false;
+    }
+
+    _sizeProbeThread.wait(); // see startWorkers()
+    _sizeProbeThread.start( QThread::LowPriority );
+}
+
+
+void PrefetchCache::startWorkers()
+{
+    QList<PrefetchCacheWorkerThread *> idleWorkers;
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _jobQueue.isEmpty() && _spill.isEmpty() )
+	    return;
+
+	foreach ( PrefetchCacheWorkerThread * worker, _workers )
+	{
+	    if ( worker->_finished )
+	    {
+		worker->_finished = false;
+		idleWorkers << worker;
+	    }
+	}
+    }
+
+    foreach ( PrefetchCacheWorkerThread * worker, idleWorkers )
+    {
+	// A worker that just ran out of jobs might not have returned from
+	// run() yet; QThread::start() would silently do nothing then.
+
+	worker->wait();
+	worker->start();
+    }
+}
+
+
+void PrefetchCache::prefetchMetaData( const QStringList & fileNames )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	foreach ( const QString & fileName, fileNames )
+	{
+	    if ( ! _metaData.contains( fileName ) )
+		_metaDataQueue.add( fileName );
+	}
+    }
+
+    startMetaDataThreads();
+}
+
+
+void PrefetchCache::startMetaDataThreads()
+{
+    QList<PrefetchCacheMetaDataThread *> idleThreads;
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _metaDataQueue.isEmpty() && _metaDataRequests.isEmpty() )
+	    return;
+
+	foreach ( PrefetchCacheMetaDataThread * thread, _metaDataThreads )
+	{
+	    if ( thread->_finished )
+	    {
+		thread->_finished = false;
+		idleThreads << thread;
+	    }
+	}
+    }
+
+    foreach ( PrefetchCacheMetaDataThread * thread, idleThreads )
+    {
+	thread->wait(); // see startWorkers()
+	thread->start( QThread::LowPriority );
+    }
+}
+
+
+bool PrefetchCache::metaData( const QString & imageFileName, PhotoMetaData * metaData )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _metaData.contains( imageFileName ) )
+	{
+	    if ( metaData )
+		*metaData = _metaData.value( imageFileName );
+
+	    return true;
+	}
+
+	if ( _metaDataInFlight.contains( imageFileName ) &&
+	     ! _metaDataInvalidated.contains( imageFileName ) )
+	{
+	    // metaDataReady() will follow soon
+
+	    return false;
+	}
+
+	// Somebody is waiting for this one: Read it before all others
+
+	_metaDataQueue.remove( imageFileName );
+	_metaDataRequests.removeAll( imageFileName );
+	_metaDataRequests.prepend( imageFileName );
+    }
+
+    startMetaDataThreads();
+
+    return false;
+}
+
+
+QByteArray PrefetchCache::fileContent( const QString & imageFileName )
+{
+    return _readAhead.cachedBytes( imageFileName );
+}
+
+
+void PrefetchCache::storeMetaData( const QString &    imageFileName,
+				   const MappedFile & file,
+				   const QSize &      size )
+{
+    if ( ! file.isInMemory() )
+	return; // leave it to the meta data threads
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _metaData.contains( imageFileName ) ||
+	     _metaDataInFlight.contains( imageFileName ) )
+	{
+	    return;
+	}
+
+	_metaDataInFlight.insert( imageFileName );
+    }
+
+    PhotoMetaData metaData( file, size );
+    bool	  changed;
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	_metaDataInFlight.remove( imageFileName );
+	changed = _metaDataInvalidated.remove( imageFileName ) || file.isDamaged();
+
+	if ( ! changed )
+	{
+	    _metaData.insert( imageFileName, metaData );
+	    _metaDataQueue.remove( imageFileName );
+	    _metaDataRequests.removeAll( imageFileName );
+	}
+    }
+
+    if ( changed )
+    {
+	// Discard what was read, but a request that came in meanwhile had
+	// to wait for this: The meta data threads can take it now.
+
+	startMetaDataThreads();
+	return;
+    }
+
+    emit metaDataReady( imageFileName );
+}
+
+
+void PrefetchCache::waitForWorkers()
+{
+    foreach ( PrefetchCacheWorkerThread * worker, _workers )
+	worker->wait();
+}
+
+
+void PrefetchCache::setWorkerCount( int count )
+{
+    if ( count <= 0 )
+	count = QThread::idealThreadCount();
+
+    if ( count <= 0 ) // idealThreadCount() could not determine it
+	count = 1;
+
+    // Workers only pick up the changed worker count after they are finished,
+    // so temporarily take the jobs away from them.
+
+    PrefetchJobQueue jobs;
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+	jobs = _jobQueue;
+	_jobQueue.clear();
+	_budgetCondition.wakeAll();
+    }
+
+    waitForWorkers();
+    qDeleteAll( _workers );
+    _workers.clear();
+
+    for ( int i=0; i < count; ++i )
+	_workers << new PrefetchCacheWorkerThread( this, i );
+
+    logDebug() << "Using " << count << " prefetch worker threads" << endl;
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+	_jobQueue = jobs;
+    }
+
+    startWorkers();
+}
+
+
+void PrefetchCache::workerFinished()
+{
+    if ( _summaryLogged )
+	return;
+
+    foreach ( PrefetchCacheWorkerThread * worker, _workers )
+    {
+	if ( ! worker->_finished && ! worker->_waiting )
+	    return;
+    }
+
+    _summaryLogged = true;
+
+    qint64 elapsed = _stopWatch.elapsed();
+    qint64 timePerImage = 0;
+
+    if ( size() > 0 )
+	timePerImage = elapsed / size();
+
+    logInfo() << "Prefetching done after " << formatTime( elapsed ) << endl;
+    logInfo() << "Cached images: " << size()
+	      << " (" << byteCount() / ( 1024 * 1024 ) << " MB)" << endl;
+    logInfo() << "Time per image: " << formatTime( timePerImage ) << endl;
+
+    foreach ( PrefetchCacheWorkerThread * worker, _workers )
+	logInfo() << worker->statistics() << endl;
+}
+
+
+QPixmap PrefetchCache::pixmap( const QString & imageFileName,
+			      bool	      take,
+			      bool	      wait )
+{
+    QImage image;
+    bool cacheMiss = true;
+
+    if ( ! wait && ! contains( imageFileName ) )
+    {
+	logDebug() << "Requesting " << imageFileName << endl;
+	requestImage( imageFileName );
+
+	return QPixmap();
+    }
+
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( ! _cache.contains( imageFileName ) &&
+	     _inFlight.contains( imageFileName ) )
+	{
+	    // A worker thread is loading this image right now. Loading it here
+	    // as well would take at least as long, so rather wait for the
+	    // worker.
+
+	    logDebug() << "Waiting for prefetch worker: " << imageFileName << endl;
+
+	    while ( _inFlight.contains( imageFileName ) )
+		_inFlightCondition.wait( &_cacheMutex );
+
+	    if ( _cache.contains( imageFileName ) )
+		++_duplicatesAvoided;
+	}
+
+	if ( _cache.contains( imageFileName ) )
+	{
+	    if ( take )
+	    {
+		image = _cache.take( imageFileName );
+		_byteCount -= image.byteCount();
+		_budgetCondition.wakeAll();
+	    }
+	    else
+	    {
+		image = _cache.value( imageFileName );
+	    }
+
+	    cacheMiss = false;
+	    // logVerbose() << "Prefetch cache hit: " << imageFileName << endl;
+	}
+	else
+	{
+	    // Make sure no worker starts loading this image while we do
+
+	    _jobQueue.remove( imageFileName );
+	}
+    }
+
+    if ( cacheMiss )
+    {
+	logDebug() << "Prefetch cache miss: " << imageFileName << endl;
+	QSize size;
+	image = load( imageFileName, &size, CancelToken(), true ); // parallel
+	bool spilled = false;
+
+	{
+	    QMutexLocker locker( &_cacheMutex );
+
+	    if ( ! image.isNull() )
+	    {
+		if ( ! take )
+		    insert( imageFileName, image );
+
+		_sizes.insert( imageFileName, size  );
+	    }
+
+	    spilled = ! _spill.isEmpty();
+	}
+
+	// Inserting may have evicted images to spill: Make sure a worker is
+	// running to write them to the disk cache.
+
+	if ( spilled )
+	    startWorkers();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QPixmap pixmap;
+
+#if QT_VERSION >= QT_VERSION_CHECK( 5, 3, 0 )
+    if ( take )
+    {
+	// Nothing else shares this image now, so QPixmap can take over its
+	// pixels without copying them.
+
+	pixmap = QPixmap::fromImage( std::move( image ) );
+    }
+    else
+#endif
+    {
+	pixmap = QPixmap::fromImage( image );
+    }
+
+    logDebug() << "Pixmap conversion for " << imageFileName << ": "
+	       << formatTime( timer.elapsed() ) << endl;
+
+    return pixmap;
+}
+
+
+void PrefetchCache::requestFirstFrame( const QString & imageFileName )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+	_firstFrameImage = imageFileName;
+    }
+
+    _firstFrameThread.abort();
+    _firstFrameThread.wait();
+    _firstFrameThread.setFileName( imageFileName );
+    _firstFrameThread.start();
+}
+
+
+bool PrefetchCache::contains( const QString & imageFileName )
+{
+    QMutexLocker locker( &_cacheMutex );
+
+    return _cache.contains( imageFileName );
+}
+
+
+QImage PrefetchCache::previewImage( const QString & imageFileName )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _hasPreview.contains( imageFileName ) &&
+	     ! _hasPreview.value( imageFileName ) )
+	{
+	    return QImage();
+	}
+    }
+
+    QImage preview;
+    QSize  size;
+
+    try
+    {
+	MappedFile file( fullPath( imageFileName ) );
+	file.open();
+
+	Exiv2::Image::AutoPtr image = file.exiv2Image();
+	image->readMetadata();
+	size = QSize( image->pixelWidth(), image->pixelHeight() );
+
+	Exiv2::PreviewManager previewManager( *image );
+	Exiv2::PreviewPropertiesList previews = previewManager.getPreviewProperties();
+
+	// The list is sorted by size, so the last one is the largest
+
+	if ( ! previews.empty() &&
+	     (int) qMax( previews.back().width_, previews.back().height_ ) >= MinPreviewSize )
+	{
+	    Exiv2::PreviewImage previewData =
+		previewManager.getPreviewImage( previews.back() );
+
+	    preview.loadFromData( previewData.pData(), previewData.size() );
+	}
+    }
+    catch ( Exiv2::Error & exception )
+    {
+	logDebug() << "No preview for " << imageFileName << ": "
+		   << exception.what() << endl;
+    }
+
+    QMutexLocker locker( &_cacheMutex );
+    _hasPreview.insert( imageFileName, ! preview.isNull() );
+
+    if ( size.isValid() && ! size.isEmpty() && ! _sizes.contains( imageFileName ) )
+	_sizes.insert( imageFileName, size );
+
+    return preview;
+}
+
+
+void PrefetchCache::requestImage( const QString & imageFileName )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _cache.contains( imageFileName ) || _inFlight.contains( imageFileName ) )
+	    return;
+
+	_jobQueue.add( imageFileName );
+    }
+
+    startWorkers();
+}
+
+
+QSize PrefetchCache::pixelSize( const QString & imageFileName )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _sizes.contains( imageFileName ) )
+	    return _sizes.value( imageFileName );
+    }
+
+    // Not probed by the size probe thread yet: Do it right now, but never
+    // load the complete image just for the size.
+
+    QSize size = probeSize( imageFileName );
+
+    if ( size.isValid() )
+    {
+	QMutexLocker locker( &_cacheMutex );
+	_sizes.insert( imageFileName, size );
+    }
+
+    return size;
+}
+
+
+QSize PrefetchCache::probeSize( const QString & imageFileName )
+{
+    // For all relevant formats, this only reads the image header
+    // (JPEG SOF, PNG IHDR etc.).
+
+    return QImageReader( fullPath( imageFileName ) ).size();
+}
+
+
+void PrefetchCache::clear()
+{
+    QMutexLocker locker( &_cacheMutex );
+
+    // Not waiting for the workers: Any image they are working on right now is
+    // cancelled; they will abort reading it and discard whatever they already
+    // have.
+
+    foreach ( CancelToken token, _inFlight )
+	token.cancel();
+
+    _inFlight.clear();
+    _inFlightCondition.wakeAll();
+    _jobQueue.clear();
+    _spill.clear();
+    _spillByteCount = 0;
+    _cache.clear();
+    _byteCount = 0;
+    // not clearing _sizes - this is very cheap
+
+    _budgetCondition.wakeAll();
+    _readAhead.clear();
+}
+
+
+void PrefetchCache::invalidate( const QString & imageFileName )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( _inFlight.contains( imageFileName ) )
+	{
+	    // The worker discards what it loaded (see clear())
+
+	    _inFlight.take( imageFileName ).cancel();
+	    _inFlightCondition.wakeAll();
+	}
+
+	if ( _cache.contains( imageFileName ) )
+	    _byteCount -= _cache.take( imageFileName ).byteCount();
+
+	for ( int i = _spill.size() - 1; i >= 0; --i )
+	{
+	    if ( _spill.at( i ).first == imageFileName )
+		_spillByteCount -= _spill.takeAt( i ).second.byteCount();
+	}
+
+	_sizes.remove( imageFileName );
+	_hasPreview.remove( imageFileName );
+	_metaData.remove( imageFileName );
+	_jobQueue.remove( imageFileName );
+
+	if ( _metaDataInFlight.contains( imageFileName ) )
+	    _metaDataInvalidated.insert( imageFileName ); // discard the result
+
+	_budgetCondition.wakeAll();
+    }
+
+    _readAhead.invalidate( imageFileName );
+}
+
+
+QImage PrefetchCache::load( const QString &	imageFileName,
+			    QSize *		origSize,
+			    const CancelToken & token,
+			    bool		parallel )
+{
+    QImage cached = _diskCache.image( fullPath( imageFileName ),
+				      _fullScreenSize,
+				      origSize );
+    if ( ! cached.isNull() )
+	return ImageScaler::toNativeFormat( cached );
+
+    // If the read-ahead cache has the file already, decode it from there;
+    // otherwise read it directly.
+
+    QByteArray bytes = _readAhead.bytes( imageFileName, token );
+    MappedFile file( fullPath( imageFileName ), token );
+
+    if ( ! ( bytes.isNull() ? file.open() : file.open( bytes ) ) )
+	return QImage();
+
+    QImageReader reader( file.device() );
+    QSize size = reader.size(); // only reads the header
+
+    if ( size.isValid() &&
+	 reader.format() == "jpeg" &&
+	 reader.supportsOption( QImageIOHandler::ScaledSize ) &&
+	 Photo::scaleFactor( size, _fullScreenSize ) < 1.0 )
+    {
+	// Let libjpeg do most of the scaling during decoding with DCT domain
+	// scaling, and ImageScaler (below) the rest of the way. This saves most
+	// of the cost of decoding and scaling the full size image.
+	//
+	// Request exactly the size libjpeg decodes to: For any other size, the
+	// JPEG handler resizes the result itself with a fast, low quality
+	// transformation. And without the quality set, it also uses the fast
+	// integer DCT and no fancy upsampling.
+
+	reader.setScaledSize( dctScaledSize( size, _fullScreenSize ) );
+	reader.setQuality( 100 );
+    }
+
+    QImage image = reader.read();
+
+    if ( image.isNull() || token.isCancelled() )
+	return QImage();
+
+    if ( file.isDamaged() )
+    {
+	// Truncated while it was read: The rescan will notice the change
+
+	logWarning() << "File changed while loading: " << imageFileName << endl;
+	return QImage();
+    }
+
+    if ( ! size.isValid() )
+	size = image.size();
+
+    if ( origSize )
+	*origSize = size;
 
+    // The file content is still in memory (or mapped): Take the meta data
+    // from there right away. But not while the user is waiting for the
+    // image: Let a meta data thread read them first thing instead.
 
-PrefetchCache::~PrefetchCache()
-{
-    int percent = 0;
+    if ( parallel )
+	metaData( imageFileName, 0 );
+    else
+	storeMetaData( imageFileName, file, size );
 
-    if ( _sizes.size() > 0 )
-        percent = 100 * _cache.size() / _sizes.size();
+    if ( Photo::scaleFactor( image.size(), _fullScreenSize ) < 1.0 )
+    {
+	bool firstFrame = false;
 
-    logDebug() << "Unused images in prefetch cache: " << _cache.size()
-               << " (" <<  percent << "%)" << endl;
-    clear();
+	if ( ! reader.scaledSize().isValid() ) // not a JPEG: see requestFirstFrame()
+	{
+	    QMutexLocker locker( &_cacheMutex );
+
+	    if ( _firstFrameImage == imageFileName )
+	    {
+		_firstFrameImage.clear();
+		firstFrame = true;
+	    }
+	}
+
+	if ( firstFrame )
+	{
+	    emit firstFrameReady( imageFileName,
+				  image.scaled( _fullScreenSize,
+						Qt::KeepAspectRatio,
+						Qt::FastTransformation ) );
+	}
+
+	QSize scaledSize = image.size().scaled( _fullScreenSize, Qt::KeepAspectRatio );
+
+	image = parallel ?
+	    ImageScaler::parallelScaled( image, scaledSize ) :
+	    ImageScaler::scaled	       ( image, scaledSize );
+    }
 
-    if ( _workerThread.isRunning() )
-	_workerThread.wait();
+    if ( token.isCancelled() )
+	return QImage();
+
+    // Convert to the format the paint engine uses here in the worker thread
+    // rather than in the UI thread for every QPixmap::fromImage(): Indexed8
+    // or grayscale images would need that, and it is a no-op for the usual
+    // RGB32 photos.
+
+    return ImageScaler::toNativeFormat( image );
 }
 
 
-void PrefetchCache::prefetch( const QStringList & fileNames )
+void PrefetchCache::setMaxSize( qint64 maxSize )
 {
     {
 	QMutexLocker locker( &_cacheMutex );
-        logDebug() << "Prefetching " << fileNames.size() << " images" << endl;
-        _stopWatch.start();
 
-	foreach ( QString fileName, fileNames )
-	{
-	    _jobQueue.append( fileName );
-	}
+	_maxSize = maxSize;
+	evict();
+	_budgetCondition.wakeAll();
     }
 
-    if ( ! _workerThread.isRunning() )
-	_workerThread.start();
+    startWorkers();
 }
 
 
-QPixmap PrefetchCache::pixmap( const QString & imageFileName, bool take )
+void PrefetchCache::setFileNames( const QStringList & fileNames )
 {
-    QImage image;
-    bool cacheMiss = true;
+    {
+	QMutexLocker locker( &_cacheMutex );
+	_jobQueue.setFileNames( fileNames );
+	_metaDataQueue.setFileNames( fileNames );
+	_sizeProbeQueue.setFileNames( fileNames );
+    }
+
+    _readAhead.setFileNames( fileNames );
+}
+
 
+void PrefetchCache::addFileNames( const QStringList & fileNames )
+{
     {
 	QMutexLocker locker( &_cacheMutex );
+	_jobQueue.addFileNames( fileNames );
+	_metaDataQueue.addFileNames( fileNames );
+	_sizeProbeQueue.addFileNames( fileNames );
+    }
 
-	if ( _cache.contains( imageFileName ) )
-	{
+    _readAhead.addFileNames( fileNames );
+}
 
-	    image = take ?
-		_cache.take ( imageFileName ) :
-		_cache.value( imageFileName );
 
-	    cacheMiss = false;
-	    // logVerbose() << "Prefetch cache hit: " << imageFileName << endl;
-	}
+void PrefetchCache::setCurrentIndex( int index )
+{
+    {
+	QMutexLocker locker( &_cacheMutex );
+
+	if ( index == _jobQueue.currentIndex() )
+	    return;
+
+	_jobQueue.setCurrentIndex( index );
+	_metaDataQueue.setCurrentIndex( index );
+	_sizeProbeQueue.setCurrentIndex( index );
+	_budgetCondition.wakeAll();
     }
 
-    if ( cacheMiss )
+    _readAhead.setCurrentIndex( index );
+
+    // Images evicted earlier might be wanted again now
+
+    startWorkers();
+}
+
+
+void PrefetchCache::insert( const QString & imageFileName, const QImage & image )
+{
+    if ( _cache.contains( imageFileName ) )
+	_byteCount -= _cache.value( imageFileName ).byteCount();
+
+    _cache.insert( imageFileName, image );
+    _byteCount += image.byteCount();
+
+    evict( distance( imageFileName ) );
+}
+
+
+void PrefetchCache::evict( int minDistance )
+{
+    // Spilled images count until they are written to the disk cache
+
+    while ( _maxSize > 0 && _byteCount + _spillByteCount > _maxSize )
     {
-	logDebug() << "Prefetch cache miss: " << imageFileName << endl;
-	image.load( fullPath( imageFileName ) );
-	QSize size = image.size();
-	qreal scaleFactor = Photo::scaleFactor( size, _fullScreenSize );
+	QString farthest;
+	int	farthestDistance = -1;
 
-	if ( scaleFactor < 1.0 )
+	for ( QMap<QString, QImage>::const_iterator it = _cache.constBegin();
+	      it != _cache.constEnd();
+	      ++it )
 	{
-	    image = image.scaled( _fullScreenSize,
-				  Qt::KeepAspectRatio,
-				  Qt::SmoothTransformation );
+	    int dist = distance( it.key() );
+
+	    if ( dist > farthestDistance )
+	    {
+		farthest	 = it.key();
+		farthestDistance = dist;
+	    }
 	}
 
-	QMutexLocker locker( &_cacheMutex );
-	if ( take )
-	    _cache.insert( imageFileName, image );
-	_sizes.insert( imageFileName, size  );
+	if ( farthestDistance <= minDistance )
+	    return;
 
-	if ( _jobQueue.contains( imageFileName ) )
-	    _jobQueue.removeAll( imageFileName );
-    }
+	// logVerbose() << "Evicting " << farthest << endl;
+	QImage image = _cache.take( farthest );
+	_byteCount -= image.byteCount();
+
+	// Spill it to the disk cache (done by the next worker thread that
+	// looks for a job), and queue it again for when the current image
+	// comes closer to it; then it will come from the disk cache.
+	//
+	// Whether it is in the disk cache already (write-through) is only
+	// checked by that worker: That needs a stat() and a hash, which is too
+	// much while holding _cacheMutex.
 
-    return QPixmap::fromImage( image );
+	_spill.append( qMakePair( farthest, image ) );
+	_spillByteCount += image.byteCount();
+	_budgetCondition.wakeAll(); // a waiting worker writes it
+
+	_jobQueue.add( farthest );
+    }
 }
 
 
-QSize PrefetchCache::pixelSize( const QString & imageFileName )
+QString PrefetchCache::nextJob() const
 {
-    if ( _sizes.contains( imageFileName ) )
-	return _sizes.value( imageFileName );
-    else
-	return pixmap( imageFileName ).size();
+    QString job = _jobQueue.first();
+
+    if ( job.isEmpty() )
+	return job;
+
+    // Since the job queue is ordered by distance, no other job is within
+    // the depth either.
+
+    if ( _depth > 0 && distance( job ) > _depth )
+	return QString();
+
+    if ( _maxSize <= 0 || _byteCount + _spillByteCount < _maxSize )
+	return job;
+
+    // The budget is used up. A job is only worthwhile if its image is closer
+    // to the current image than the farthest one in the cache: That one would
+    // be evicted in favour of it. Since the job queue is ordered by distance,
+    // only the first job needs to be checked.
+
+    int farthestDistance = -1;
+
+    foreach ( const QString & cached, _cache.keys() )
+	farthestDistance = qMax( farthestDistance, distance( cached ) );
+
+    if ( distance( job ) < farthestDistance )
+	return job;
+
+    return QString();
 }
 
 
-void PrefetchCache::clear()
+void PrefetchCache::setDepth( int depth )
 {
     {
 	QMutexLocker locker( &_cacheMutex );
-	_jobQueue.clear();
+	_depth = qMax( 0, depth );
+	_budgetCondition.wakeAll();
     }
 
-    if ( _workerThread.isRunning() )
-	_workerThread.wait();
+    startWorkers();
+}
 
-    QMutexLocker locker( &_cacheMutex ); // not strictly necessary
-    _cache.clear();
-    // not clearing _sizes - this is very cheap
+
+QSize PrefetchCache::dctScaledSize( const QSize & size, const QSize & boundingSize )
+{
+    QSize target = Photo::scale( size, boundingSize );
+    QSize result = size;
+
+    for ( int denom = 2; denom <= 8; denom *= 2 )
+    {
+	// libjpeg rounds up
+
+	QSize reduced( ( size.width()  + denom - 1 ) / denom,
+		       ( size.height() + denom - 1 ) / denom );
+
+	if ( reduced.width() < target.width() || reduced.height() < target.height() )
+	    break;
+
+	result = reduced;
+    }
+
+    return result;
+}
+
+
+int PrefetchCache::envValue( const char * name, int defaultValue )
+{
+    bool ok   = false;
+    int value = QString::fromLocal8Bit( qgetenv( name ) ).toInt( &ok );
+
+    return ok ? value : defaultValue;
 }
 
 
@@ -166,10 +1004,31 @@ QString PrefetchCache::formatTime( qint64 millisec )
 
 
 
-PrefetchCacheWorkerThread::PrefetchCacheWorkerThread( PrefetchCache * prefetchCache )
+PrefetchCacheWorkerThread::PrefetchCacheWorkerThread( PrefetchCache * prefetchCache,
+                                                      int             id )
     : _prefetchCache( prefetchCache )
+    , _id( id )
+    , _imageCount( 0 )
+    , _busyTime( 0 )
+    , _finished( true )
+    , _waiting( false )
+{
+
+}
+
+
+QString PrefetchCacheWorkerThread::statistics() const
 {
+    qreal imagesPerSec = 0.0;
+
+    if ( _busyTime > 0 )
+	imagesPerSec = _imageCount * 1000.0 / _busyTime;
 
+    return QString( "Worker #%1: %2 images in %3 (%4 images/sec)" )
+	.arg( _id )
+	.arg( _imageCount )
+	.arg( PrefetchCache::formatTime( _busyTime ) )
+	.arg( imagesPerSec, 0, 'f', 1 );
 }
 
 
@@ -177,51 +1036,353 @@ void PrefetchCacheWorkerThread::run()
 {
     while ( true )
     {
-	QString imageName;
+	QString	    imageName;
+	CancelToken token;
+	PrefetchCache::SpillList spill;
 
 	{
 	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
 
-	    if ( _prefetchCache->_jobQueue.isEmpty() )
+	    spill = _prefetchCache->_spill;
+	    _prefetchCache->_spill.clear();
+
+	    if ( spill.isEmpty() )
+	    {
+		if ( _prefetchCache->_jobQueue.isEmpty() )
+		{
+		    _finished = true;
+		    _prefetchCache->workerFinished();
+		    return;
+		}
+
+		imageName = _prefetchCache->nextJob();
+
+		if ( imageName.isEmpty() )
+		{
+		    // Memory budget exhausted or no job within the depth:
+		    // Wait until the current image changes, images are taken
+		    // out of the cache or the job queue is cleared.
+
+		    _waiting = true;
+		    _prefetchCache->workerFinished();
+		    _prefetchCache->_budgetCondition.wait( &_prefetchCache->_cacheMutex );
+		    _waiting = false;
+		    continue;
+		}
+
+		_prefetchCache->_jobQueue.remove( imageName );
+		_prefetchCache->_inFlight.insert( imageName, token );
+	    }
+	}
+
+	if ( ! spill.isEmpty() )
+	{
+	    // Images that were evicted from the cache: Write them to the disk
+	    // cache before doing the next job unless they are there already.
+
+	    qint64 written = 0;
+
+	    foreach ( const PrefetchCache::SpillEntry & entry, spill )
 	    {
-                qint64 elapsed = _prefetchCache->stopWatch().elapsed();
-                qint64 timePerImage = 0;
+		QString fullPath = _prefetchCache->fullPath( entry.first );
 
-                if ( _prefetchCache->size() > 0 )
-                    timePerImage = elapsed / _prefetchCache->size();
+		if ( ! _prefetchCache->_diskCache.contains( fullPath, _prefetchCache->_fullScreenSize ) )
+		{
+		    _prefetchCache->_diskCache.store( fullPath,
+						      _prefetchCache->_fullScreenSize,
+						      entry.second,
+						      _prefetchCache->pixelSize( entry.first ) );
+		}
 
-		logInfo() << "Prefetching done after " << PrefetchCache::formatTime( elapsed ) << endl;
-                logInfo() << "Cached images: " << _prefetchCache->size() << endl;
-                logInfo() << "Time per image: " << PrefetchCache::formatTime( timePerImage ) << endl;
-		return;
+		written += entry.second.byteCount();
 	    }
 
-	    imageName = _prefetchCache->_jobQueue.takeFirst();
+	    spill.clear();
+
+	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
+
+	    // clear() might have reset the count meanwhile
+
+	    _prefetchCache->_spillByteCount = qMax( 0LL, _prefetchCache->_spillByteCount - written );
+	    _prefetchCache->_budgetCondition.wakeAll();
+
+	    continue;
 	}
 
-	QString fullPath = _prefetchCache->fullPath( imageName );
-	// logDebug() << "Prefetching " << fullPath << endl;
-	QImage image;
+	// logDebug() << "Prefetching " << imageName << endl;
+	QElapsedTimer timer;
+	timer.start();
+	QSize size;
+	QImage image = _prefetchCache->load( imageName, &size, token );
+
+	QMutexLocker locker( &_prefetchCache->_cacheMutex );
+	bool ready  = false;
+	bool failed = false;
+
+	if ( _prefetchCache->_inFlight.value( imageName ) == token )
+	{
+	    _prefetchCache->_inFlight.remove( imageName );
+	    _prefetchCache->_inFlightCondition.wakeAll();
+	}
 
-	if ( ! image.load( fullPath ) )
+	if ( token.isCancelled() )
+	{
+	    logDebug() << "Prefetching cancelled for " << imageName << endl;
+	}
+	else if ( image.isNull() )
 	{
-	    logWarning() << "Prefetching failed for " << fullPath << endl;
+	    logWarning() << "Prefetching failed for "
+			 << _prefetchCache->fullPath( imageName ) << endl;
+	    failed = true;
 	}
 	else
 	{
-	    QSize size = image.size();
-	    QSize targetSize = _prefetchCache->_fullScreenSize;
+	    _prefetchCache->insert( imageName, image );
+	    _prefetchCache->_sizes.insert( imageName, size  );
+	    ++_imageCount;
+	    ready = true;
+	}
+
+	_busyTime += timer.elapsed();
+	locker.unlock();
+
+	if ( failed )
+	    emit _prefetchCache->imageFailed( imageName );
+
+	if ( ready )
+	{
+	    emit _prefetchCache->imageReady( imageName );
+
+	    // Write through to the disk cache so the next session doesn't need
+	    // to load this image again. This does nothing if the image came from
+	    // the disk cache in the first place.
+
+	    _prefetchCache->_diskCache.store( _prefetchCache->fullPath( imageName ),
+					      _prefetchCache->_fullScreenSize,
+					      image, size );
+	}
+    }
+}
+
+
+
+PrefetchCacheSizeProbeThread::PrefetchCacheSizeProbeThread( PrefetchCache * prefetchCache )
+    : _prefetchCache( prefetchCache )
+    , _abort( 0 )
+    , _finished( true )
+{
+
+}
+
+
+void PrefetchCacheSizeProbeThread::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+    int count = 0;
+
+    while ( ! _abort.loadAcquire() )
+    {
+	QString fileName;
+
+	{
+	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
+	    fileName = _prefetchCache->_sizeProbeQueue.takeFirst();
 
-	    if ( Photo::scaleFactor( size, targetSize ) < 1.0 )
+	    if ( fileName.isEmpty() )
 	    {
-		image = image.scaled( targetSize,
-				      Qt::KeepAspectRatio,
-				      Qt::SmoothTransformation );
+		_finished = true;
+		break;
 	    }
 
+	    if ( _prefetchCache->_sizes.contains( fileName ) )
+		continue;
+	}
+
+	QSize size = _prefetchCache->probeSize( fileName );
+
+	if ( size.isValid() )
+	{
 	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
-	    _prefetchCache->_cache.insert( imageName, image );
-	    _prefetchCache->_sizes.insert( imageName, size  );
+	    _prefetchCache->_sizes.insert( fileName, size );
+	    ++count;
+	}
+    }
+
+    if ( count > 0 )
+    {
+	logDebug() << "Probed " << count << " image sizes in "
+		   << PrefetchCache::formatTime( timer.elapsed() ) << endl;
+    }
+}
+
+
+
+
+PrefetchCacheFirstFrameThread::PrefetchCacheFirstFrameThread( PrefetchCache * prefetchCache )
+    : _prefetchCache( prefetchCache )
+{
+
+}
+
+
+void PrefetchCacheFirstFrameThread::setFileName( const QString & fileName )
+{
+    _fileName = fileName;
+    _token    = CancelToken();
+}
+
+
+void PrefetchCacheFirstFrameThread::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // An embedded (EXIF) preview is usually larger than a 1/8 scaled first
+    // frame, and it is just as cheap to get.
+
+    QImage image = _prefetchCache->previewImage( _fileName );
+
+    if ( _token.isCancelled() )
+	return;
+
+    if ( image.isNull() )
+    {
+	MappedFile file( _prefetchCache->fullPath( _fileName ), _token );
+
+	if ( ! file.open() )
+	    return;
+
+	QImageReader reader( file.device() );
+	QSize size = reader.size(); // only reads the header
+
+	if ( ! size.isValid() ||
+	     reader.format() != "jpeg" ||
+	     ! reader.supportsOption( QImageIOHandler::ScaledSize ) )
+	{
+	    // The worker thread that loads this image emits the first frame
+
+	    return;
+	}
+
+	reader.setScaledSize( QSize( qMax( 1, size.width()  / 8 ),
+				     qMax( 1, size.height() / 8 ) ) );
+	image = reader.read();
+
+	if ( image.isNull() || _token.isCancelled() || file.isDamaged() )
+	    return;
+    }
+
+    {
+	QMutexLocker locker( &_prefetchCache->_cacheMutex );
+
+	if ( _prefetchCache->_firstFrameImage != _fileName )
+	    return;
+
+	_prefetchCache->_firstFrameImage.clear();
+    }
+
+    logDebug() << "First frame for " << _fileName << " " << image.size()
+	       << " in " << PrefetchCache::formatTime( timer.elapsed() ) << endl;
+
+    emit _prefetchCache->firstFrameReady( _fileName, image );
+}
+
+
+
+
+PrefetchCacheMetaDataThread::PrefetchCacheMetaDataThread( PrefetchCache * prefetchCache )
+    : _prefetchCache( prefetchCache )
+    , _abort( 0 )
+    , _finished( true )
+{
+
+}
+
+
+void PrefetchCacheMetaDataThread::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+    int count = 0;
+
+    while ( ! _abort.loadAcquire() )
+    {
+	QString fileName;
+
+	{
+	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
+
+	    // A request for a file that is still being read from before it
+	    // changed has to wait until that read is done; the thread doing
+	    // it takes the request then.
+
+	    foreach ( const QString & request, _prefetchCache->_metaDataRequests )
+	    {
+		if ( ! _prefetchCache->_metaDataInFlight.contains( request ) )
+		{
+		    fileName = request;
+		    break;
+		}
+	    }
+
+	    if ( ! fileName.isEmpty() )
+		_prefetchCache->_metaDataRequests.removeOne( fileName );
+	    else
+		fileName = _prefetchCache->_metaDataQueue.takeFirst();
+
+	    if ( fileName.isEmpty() )
+	    {
+		_finished = true;
+		break;
+	    }
+
+	    if ( _prefetchCache->_metaData.contains( fileName ) ||
+		 _prefetchCache->_metaDataInFlight.contains( fileName ) )
+	    {
+		continue;
+	    }
+
+	    _prefetchCache->_metaDataInFlight.insert( fileName );
+	}
+
+	// The size normally comes from the size probe thread; if not, this
+	// reads the image header, not the whole image.
+
+	QSize size = _prefetchCache->pixelSize( fileName );
+
+	// Use the content from the read-ahead cache if it is there already
+
+	MappedFile file( _prefetchCache->fullPath( fileName ) );
+	QByteArray bytes = _prefetchCache->fileContent( fileName );
+
+	if ( bytes.isNull() )
+	    file.open();
+	else
+	    file.open( bytes );
+
+	PhotoMetaData metaData( file, size );
+
+	{
+	    QMutexLocker locker( &_prefetchCache->_cacheMutex );
+	    _prefetchCache->_metaDataInFlight.remove( fileName );
+
+	    if ( _prefetchCache->_metaDataInvalidated.remove( fileName ) ||
+		 file.isDamaged() )
+	    {
+		continue; // the file changed meanwhile
+	    }
+
+	    _prefetchCache->_metaData.insert( fileName, metaData );
 	}
+
+	++count;
+	emit _prefetchCache->metaDataReady( fileName );
+    }
+
+    if ( count > 0 )
+    {
+	logDebug() << "Read meta data of " << count << " images in "
+		   << PrefetchCache::formatTime( timer.elapsed() ) << endl;
     }
 }
@@ -12,27 +12,100 @@
 #include <QPixmap>
 #include <QImage>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QThread>
 #include <QMap>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QPair>
 #include <QSize>
 #include <QElapsedTimer>
 
+#include "PrefetchJobQueue.h"
+#include "CancellableFile.h"
+#include "DiskCache.h"
+#include "ReadAheadCache.h"
+#include "PhotoMetaData.h"
+
 
 class PrefetchCache;
+class MappedFile;
 
 /**
- * Helper class: Worker thread. This is the secondary thread where images are
- * read and scaled down.
+ * Helper class: Worker thread. This is a secondary thread where images are
+ * read and scaled down. The PrefetchCache has a pool of them that all take
+ * their jobs from the same job queue.
  */
 class PrefetchCacheWorkerThread: public QThread
 {
     Q_OBJECT
 
+public:
+    /**
+     * Constructor. 'id' is only used for logging.
+     */
+    PrefetchCacheWorkerThread( PrefetchCache *prefetchCache, int id );
+
+    /**
+     * Return the number of images this worker has loaded so far.
+     */
+    int imageCount() const { return _imageCount; }
+
+    /**
+     * Return the time in milliseconds this worker spent loading and scaling
+     * images so far (not including any time waiting for jobs).
+     */
+    qint64 busyTime() const { return _busyTime; }
+
+    /**
+     * Return a one-line summary of the throughput of this worker.
+     */
+    QString statistics() const;
+
+    friend class PrefetchCache;
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    PrefetchCache * _prefetchCache;
+    int             _id;
+    int             _imageCount;
+    qint64          _busyTime;
+    bool            _finished;  // protected by the cache mutex
+    bool            _waiting;   // for the budget; protected by the cache mutex
+};
+
+
+/**
+ * Helper class: Size probe thread. This is a low-priority secondary thread
+ * that reads only the headers of all images to get their original size, so
+ * PrefetchCache::pixelSize() never needs to load a complete image.
+ *
+ * It takes the images from the size probe queue of the PrefetchCache, the
+ * closest to the current image first, until that queue is empty.
+ */
+class PrefetchCacheSizeProbeThread: public QThread
+{
+    Q_OBJECT
+
 public:
     /**
      * Constructor.
      */
-    PrefetchCacheWorkerThread( PrefetchCache *prefetchCache );
+    PrefetchCacheSizeProbeThread( PrefetchCache * prefetchCache );
+
+    /**
+     * Make the thread return as soon as possible. This does not wait for it.
+     */
+    void abort() { _abort.storeRelease( 1 ); }
+
+    friend class PrefetchCache;
 
 protected:
     /**
@@ -43,6 +116,87 @@ protected:
 
 private:
     PrefetchCache * _prefetchCache;
+    QAtomicInt      _abort;
+    bool            _finished;  // protected by the cache mutex
+};
+
+
+/**
+ * Helper class: First frame thread. This extracts the embedded (EXIF)
+ * preview of an image or, if there is none, decodes a JPEG image with
+ * libjpeg's 1/8 DCT domain scaling, which only needs the DC coefficient of
+ * each 8x8 block, so there is something to show while a worker thread is
+ * still loading the image in full quality.
+ */
+class PrefetchCacheFirstFrameThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    PrefetchCacheFirstFrameThread( PrefetchCache * prefetchCache );
+
+    /**
+     * Set the name of the image to decode. Call this only while the thread
+     * is not running.
+     */
+    void setFileName( const QString & fileName );
+
+    /**
+     * Make the thread return as soon as possible. This does not wait for it.
+     */
+    void abort() { _token.cancel(); }
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    PrefetchCache * _prefetchCache;
+    QString         _fileName;
+    CancelToken     _token;
+};
+
+
+/**
+ * Helper class: Meta data thread. This is one of a small pool of
+ * low-priority secondary threads that read the meta data (EXIF) of all
+ * images in the order of the prefetch jobs, so PrefetchCache::metaData()
+ * never needs to read a file in the UI thread.
+ */
+class PrefetchCacheMetaDataThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    PrefetchCacheMetaDataThread( PrefetchCache * prefetchCache );
+
+    /**
+     * Make the thread return as soon as possible. This does not wait for it.
+     */
+    void abort() { _abort.storeRelease( 1 ); }
+
+    friend class PrefetchCache;
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    PrefetchCache * _prefetchCache;
+    QAtomicInt      _abort;
+    bool            _finished;  // protected by the cache mutex
 };
 
 
@@ -52,16 +206,52 @@ private:
  *
  * Contrary to popular belief, it's not reading JPG files that is so very
  * expensive, but scaling them down to a reasonable size. Scaling takes about
- * 4-5 times as long as loading.
+ * 4-5 times as long as loading. This is why JPG files are not decoded at full
+ * size, but with libjpeg's DCT domain scaling to a fraction of their original
+ * size, so only a small final scaling step is needed (see load()).
+ *
+ * The cache has a memory budget (maxSize()) in bytes. When that budget is
+ * used up, the images farthest away from the current image (see
+ * setCurrentIndex()) are evicted first, so what remains in the cache is a
+ * sliding window around the current image. If all cached images are closer
+ * to the current image than the next prefetch job, the worker thread pauses
+ * until the user navigates elsewhere or images are taken out of the cache.
+ *
+ * The jobs are done by a pool of worker threads; by default one for each CPU
+ * core.
+ *
+ * The meta data (EXIF) of all images are read in the same order by a few
+ * low-priority threads and kept for the whole session (see metaData()).
+ * A worker that loads an image takes its meta data from the same memory
+ * right away, and both use the file content from the read-ahead cache if
+ * it has it, so each file is normally read only once.
+ *
+ * Below this in-memory cache, there is a persistent DiskCache: The workers
+ * write each image they load through to it, images evicted from the
+ * in-memory cache are spilled to it, and load() takes images from there if
+ * possible.
+ *
+ * Below that, a ReadAheadCache holds the compressed file contents of a much
+ * deeper window of images than the decoded ones, so on slow storage the
+ * workers find the files in memory when they get to them.
+ *
+ * The depth of both windows can be configured with the environment
+ * variables QPHOTOVIEW_PREFETCH_DEPTH (decoded images; 0 means only limited
+ * by the memory budget) and QPHOTOVIEW_READ_AHEAD_DEPTH (compressed files),
+ * the number of threads reading compressed files with
+ * QPHOTOVIEW_READ_AHEAD_READERS.
  */
-class PrefetchCache
+class PrefetchCache: public QObject
 {
+    Q_OBJECT
+
 public:
 
     /**
-     * Constructor: Create a prefetch cache for 'path'.
+     * Constructor: Create a prefetch cache for 'path' with a memory budget
+     * of 'maxSize' bytes. 0 means unlimited.
      */
-    PrefetchCache( const QString & path );
+    PrefetchCache( const QString & path, qint64 maxSize = DefaultMaxSize );
 
     /**
      * Destructor.
@@ -70,33 +260,197 @@ public:
 
     /**
      * Prefetch all file names in 'fileNames' from the directory specified in
-     * the constructor.
+     * the constructor. The images are prefetched in the order of their
+     * distance from the current image (see setCurrentIndex()), not in the
+     * order of 'fileNames'.
      */
     void prefetch( const QStringList & fileNames );
 
     /**
      * Get the pixmap for the specified file in full screen size, either from
-     * the cache or directly from the disk file.
+     * the cache or directly from the disk file. If a worker thread is
+     * loading that file right now, this waits for its result rather than
+     * loading the file a second time.
      * If 'take' is true, the pixmap is taken out of the cache, i.e., the
      * corresponding cached object is deleted.
+     *
+     * If 'wait' is false, this never loads the image in the caller's thread
+     * and never waits for a worker thread: On a cache miss, it requests the
+     * image like requestImage() and returns a null pixmap; imageReady() or
+     * imageFailed() is emitted later. Use requestFirstFrame() to get
+     * something to show in the meantime.
+     */
+    QPixmap pixmap( const QString & imageFileName,
+		    bool	    take = false,
+		    bool	    wait = true );
+
+    /**
+     * Return 'true' if the specified image is in the cache right now.
+     */
+    bool contains( const QString & imageFileName );
+
+    /**
+     * Make sure the specified image will be loaded next by a worker thread
+     * unless it is already in the cache or being loaded.
+     */
+    void requestImage( const QString & imageFileName );
+
+    /**
+     * Request a very cheap first frame of the specified image for
+     * progressive display while it is loaded in full quality (see
+     * requestImage()): firstFrameReady() is emitted when it is ready.
+     *
+     * A separate thread extracts the embedded (EXIF) preview image if there
+     * is a usable one (see previewImage()). If not, it decodes JPEG images
+     * with 1/8 DCT domain scaling. For all other formats, the worker thread
+     * that loads the image emits a Qt::FastTransformation scaled version
+     * right after decoding, before the expensive smooth scaling.
+     *
+     * Only the latest requested image gets a first frame.
+     */
+    void requestFirstFrame( const QString & imageFileName );
+
+    /**
+     * Return the largest embedded (EXIF) preview image of the specified file
+     * or a null image if there is none that is large enough to be useful
+     * for display. This is remembered for each file, so files without a
+     * usable preview are only checked once.
+     *
+     * This reads the file, so don't call it from the UI thread; the first
+     * frame thread uses it (see requestFirstFrame()).
+     */
+    QImage previewImage( const QString & imageFileName );
+
+    /**
+     * Get the meta data of the specified image into 'metaData' if they were
+     * read already and return 'true'. If not, make sure they are read next
+     * by a meta data thread and return 'false'; metaDataReady() is emitted
+     * when they are available.
+     *
+     * This never reads the image file in the caller's thread.
+     */
+    bool metaData( const QString & imageFileName, PhotoMetaData * metaData );
+
+    /**
+     * Return the content of the specified image file if the read-ahead
+     * cache has it already or a null byte array if not. This never reads
+     * the file. The bytes are shared, so they stay valid even if the
+     * read-ahead cache drops them meanwhile.
      */
-    QPixmap pixmap( const QString & imageFileName, bool take = false );
+    QByteArray fileContent( const QString & imageFileName );
 
     /**
      * Return the original pixel size of the specified image.
+     *
+     * The sizes of all images passed to prefetch() are read from their
+     * headers in a background thread, so this is normally just a lookup. If
+     * the size is not known yet, the header is read right away. This never
+     * loads the complete image. If the size cannot be determined from the
+     * header, this returns an invalid size until the image was loaded.
      */
     QSize pixelSize( const QString & imageFileName );
 
     /**
      * Clear all cached images and the job queue.
+     *
+     * This does not wait for the worker threads: Images they are working on
+     * right now are cancelled, and the workers discard them rather than
+     * inserting them into the cache.
      */
     void clear();
 
+    /**
+     * The specified image file changed or was removed: Drop everything
+     * cached for it (the disk cache notices by itself) and cancel loading
+     * it. Use prefetch() to load it again.
+     */
+    void invalidate( const QString & imageFileName );
+
     /**
      * Return the size of the cache (the number of cached images).
      */
     int size() const { return _cache.size(); }
 
+    /**
+     * Return how many times pixmap() waited for a worker thread that was
+     * loading the requested image instead of loading it a second time.
+     */
+    int duplicatesAvoided() const { return _duplicatesAvoided; }
+
+    /**
+     * Return the memory used by the cached images in bytes.
+     */
+    qint64 byteCount() const { return _byteCount; }
+
+    /**
+     * Return the memory budget in bytes. 0 means unlimited.
+     */
+    qint64 maxSize() const { return _maxSize; }
+
+    /**
+     * Set the memory budget in bytes. 0 means unlimited.
+     * If the cache currently uses more than that, the images farthest away
+     * from the current image are evicted immediately.
+     */
+    void setMaxSize( qint64 maxSize );
+
+    /**
+     * Return the maximum distance from the current image of images that are
+     * prefetched. 0 means no limit other than the memory budget.
+     */
+    int depth() const { return _depth; }
+
+    /**
+     * Set the maximum distance from the current image of images that are
+     * prefetched. 0 means no limit other than the memory budget.
+     */
+    void setDepth( int depth );
+
+    /**
+     * Return the read-ahead cache for the compressed files below this cache.
+     */
+    ReadAheadCache & readAheadCache() { return _readAhead; }
+
+    /**
+     * Set the file names of the directory in directory order. This is what
+     * the distance of an image from the current image is calculated from.
+     * Images that are not in this list are considered infinitely far away.
+     */
+    void setFileNames( const QStringList & fileNames );
+
+    /**
+     * Add file names to the ones set with setFileNames() in their sorted
+     * position, e.g. the ones a directory scan just found. This is much
+     * cheaper than setting all of them again.
+     */
+    void addFileNames( const QStringList & fileNames );
+
+    /**
+     * Set the index (in the list set with setFileNames()) of the image that
+     * is currently displayed. This moves the sliding window of cached images,
+     * re-ranks the pending prefetch jobs by their distance from the new
+     * current image and wakes up worker threads that were paused because of
+     * the memory budget.
+     */
+    void setCurrentIndex( int index );
+
+    /**
+     * Return the number of worker threads.
+     */
+    int workerCount() const { return _workers.size(); }
+
+    /**
+     * Set the number of worker threads. If 'count' is 0 or less, one worker
+     * for each CPU core is used. This waits for all workers that are
+     * currently busy to finish their current image.
+     */
+    void setWorkerCount( int count );
+
+    /**
+     * Return the persistent disk cache below this in-memory cache.
+     */
+    DiskCache & diskCache() { return _diskCache; }
+
     /**
      * Return the full path for the specified image.
      */
@@ -112,19 +466,241 @@ public:
      */
     static QString formatTime( qint64 millisec );
 
+    /**
+     * Default memory budget in bytes.
+     */
+    static const qint64 DefaultMaxSize = 1024LL * 1024 * 1024;
+
+    /**
+     * Minimum width (or height for portrait images) of an embedded preview
+     * image to be used instead of the real image (see previewImage()).
+     */
+    static const int MinPreviewSize = 640;
+
+    /**
+     * Number of meta data threads
+     */
+    static const int MetaDataThreadCount = 2;
+
+
+signals:
+
+    /**
+     * Emitted when a worker thread inserted an image into the cache.
+     *
+     * Notice that this is emitted from a worker thread, so connections to it
+     * are queued.
+     */
+    void imageReady( const QString & imageFileName );
+
+    /**
+     * Emitted when a worker thread could not load an image.
+     *
+     * Like imageReady(), this is emitted from a worker thread.
+     */
+    void imageFailed( const QString & imageFileName );
+
+    /**
+     * Emitted when the first frame requested with requestFirstFrame() is
+     * ready. 'image' is smaller than full screen size, sometimes much
+     * smaller.
+     *
+     * Like imageReady(), this is emitted from a worker thread.
+     */
+    void firstFrameReady( const QString & imageFileName, const QImage & image );
+
+    /**
+     * Emitted when the meta data of an image are available (see
+     * metaData()).
+     *
+     * Like imageReady(), this is emitted from a secondary thread.
+     */
+    void metaDataReady( const QString & imageFileName );
+
 
     friend class PrefetchCacheWorkerThread;
+    friend class PrefetchCacheSizeProbeThread;
+    friend class PrefetchCacheFirstFrameThread;
+    friend class PrefetchCacheMetaDataThread;
+
+    typedef QPair<QString, QImage> SpillEntry;
+    typedef QList<SpillEntry>	   SpillList;
+
+protected:
+
+    /**
+     * Return the distance of the specified image from the current image,
+     * i.e. the number of images between them in directory order.
+     *
+     * The caller has to hold _cacheMutex.
+     */
+    int distance( const QString & imageFileName ) const
+        { return _jobQueue.distance( imageFileName ); }
+
+    /**
+     * Insert 'image' into the cache and evict the images farthest away from
+     * the current image until the cache fits into the memory budget again.
+     * An image is never evicted in favour of one that is farther away, so
+     * the new image itself may exceed the budget by its own size.
+     *
+     * The caller has to hold _cacheMutex.
+     */
+    void insert( const QString & imageFileName, const QImage & image );
+
+    /**
+     * Evict images farther away from the current image than
+     * 'minDistance' until the cache fits into the memory budget.
+     * Evicted images are spilled to the disk cache (by the next worker
+     * thread that looks for a job, which also skips images that are in the
+     * disk cache already) and put back into the job queue so they
+     * are prefetched again once the current image comes closer to them.
+     *
+     * The caller has to hold _cacheMutex.
+     */
+    void evict( int minDistance = -1 );
+
+    /**
+     * Load the specified image and scale it down to full screen size.
+     * If 'origSize' is non-null, the original size of the image is returned
+     * there. JPEG images are scaled down already while decoding them.
+     *
+     * If 'token' is cancelled while this is running, reading the file is
+     * aborted and a null image is returned. This also returns a null image
+     * if the image could not be loaded.
+     *
+     * If the image is in the disk cache, it is taken from there.
+     *
+     * If 'parallel' is true, the image is scaled on all cores (see
+     * ImageScaler::parallelScaled()); this is for when the user is waiting
+     * for it. The prefetch workers scale single-threaded: There is one of
+     * them per image anyway. The meta data are then left to the meta data
+     * threads instead of reading them here (see storeMetaData()).
+     *
+     * This does not access any in-memory cache data, so it is safe to call
+     * this without holding _cacheMutex.
+     */
+    QImage load( const QString &     imageFileName,
+		 QSize *	     origSize = 0,
+		 const CancelToken & token    = CancelToken(),
+		 bool		     parallel = false );
+
+    /**
+     * Return the name of the next job in the job queue the worker thread
+     * should do or an empty string if there is none, if the memory budget
+     * is exhausted or if the next job is farther away than depth(). This
+     * does not remove the job from the queue.
+     *
+     * The caller has to hold _cacheMutex.
+     */
+    QString nextJob() const;
+
+    /**
+     * Read only the header of the specified image and return its size or an
+     * invalid size if that is not possible. This does not access any cache
+     * data.
+     */
+    QSize probeSize( const QString & imageFileName );
+
+    /**
+     * Queue all images in 'fileNames' whose size is not known yet for the
+     * size probe thread and start it unless it is running already.
+     */
+    void startSizeProbe( const QStringList & fileNames );
+
+    /**
+     * Start any worker threads that are not already running if there are
+     * any jobs.
+     */
+    void startWorkers();
+
+    /**
+     * Queue reading the meta data of all images in 'fileNames' that were
+     * not read yet and start the meta data threads.
+     */
+    void prefetchMetaData( const QStringList & fileNames );
+
+    /**
+     * Start any meta data threads that are not already running if there are
+     * any meta data to read.
+     */
+    void startMetaDataThreads();
+
+    /**
+     * Read the meta data of an image from 'file' while it is open anyway
+     * for loading the image unless they were read already or a meta data
+     * thread is reading them right now. 'size' is the original size of
+     * the image.
+     */
+    void storeMetaData( const QString &	   imageFileName,
+			const MappedFile & file,
+			const QSize &	   size );
+
+    /**
+     * Wait until all worker threads are finished.
+     */
+    void waitForWorkers();
+
+    /**
+     * Called by a worker thread when it runs out of jobs or when it has to
+     * wait because no queued job may be done now (depth or memory budget).
+     * When the last one is done or waiting, this logs the summary for all
+     * workers once for each prefetch().
+     *
+     * The caller has to hold _cacheMutex.
+     */
+    void workerFinished();
+
+    /**
+     * Return the value of the environment variable 'name' as a number or
+     * 'defaultValue' if it is not set or not a number.
+     */
+    static int envValue( const char * name, int defaultValue );
+
+    /**
+     * Return the size libjpeg decodes an image of 'size' to with the
+     * largest DCT domain reduction (1/2, 1/4 or 1/8) that is still at least
+     * as large as 'size' scaled to fit into 'boundingSize', or 'size' itself
+     * if there is none.
+     */
+    static QSize dctScaledSize( const QSize & size, const QSize & boundingSize );
+
 
 private:
 
     QMap<QString, QImage> _cache;
     QMap<QString, QSize>  _sizes;
+    qint64                _byteCount;
+    int                   _duplicatesAvoided;
+    qint64                _maxSize;
+    int                   _depth;
     QString	          _path;
-    QStringList           _jobQueue;
-    QMutex	          _cacheMutex; // protects _cache, _sizes, _jobQueue
+    PrefetchJobQueue      _jobQueue;
+    QHash<QString, CancelToken> _inFlight; // images the workers are loading
+    QHash<QString, bool>  _hasPreview;
+    SpillList             _spill;	// evicted, not yet written to disk
+    qint64                _spillByteCount; // _spill and being written
+    QString               _firstFrameImage; // see requestFirstFrame()
+    QMutex	          _cacheMutex; // protects _cache ... _firstFrameImage
+    QWaitCondition        _budgetCondition;
+    QWaitCondition        _inFlightCondition; // an _inFlight job finished
     QSize	          _fullScreenSize;
     QElapsedTimer         _stopWatch;
-    PrefetchCacheWorkerThread _workerThread;
+    bool                  _summaryLogged; // see workerFinished()
+    QList<PrefetchCacheWorkerThread *> _workers;
+    DiskCache             _diskCache;
+    ReadAheadCache        _readAhead;
+    PrefetchCacheSizeProbeThread _sizeProbeThread;
+    PrefetchJobQueue      _sizeProbeQueue; // protected by _cacheMutex
+    PrefetchCacheFirstFrameThread _firstFrameThread;
+
+    // Meta data, all protected by _cacheMutex
+
+    QHash<QString, PhotoMetaData> _metaData;
+    PrefetchJobQueue      _metaDataQueue;
+    QStringList           _metaDataRequests; // before _metaDataQueue
+    QSet<QString>         _metaDataInFlight; // being read right now
+    QSet<QString>         _metaDataInvalidated; // changed while in flight
+    QList<PrefetchCacheMetaDataThread *> _metaDataThreads;
 };
 
 
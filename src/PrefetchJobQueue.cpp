@@ -0,0 +1,215 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <climits>
+#include <algorithm>
+
+#include "PrefetchJobQueue.h"
+
+
+PrefetchJobQueue::PrefetchJobQueue()
+    : _currentIndex( 0 )
+{
+
+}
+
+
+void PrefetchJobQueue::setFileNames( const QStringList & fileNames )
+{
+    QStringList pendingJobs = jobs();
+
+    _fileNames = fileNames;
+    _fileIndex.clear();
+    _pending.clear();
+    _unknown.clear();
+
+    for ( int i=0; i < fileNames.size(); ++i )
+	_fileIndex.insert( fileNames.at( i ), i );
+
+    foreach ( const QString & fileName, pendingJobs )
+	add( fileName );
+}
+
+
+void PrefetchJobQueue::addFileNames( const QStringList & fileNames )
+{
+    QStringList newNames = fileNames;
+    std::sort( newNames.begin(), newNames.end() );
+
+    QStringList merged;
+    int		firstNew = -1;
+    int		i	 = 0;
+
+    merged.reserve( _fileNames.size() + newNames.size() );
+
+    foreach ( const QString & fileName, newNames )
+    {
+	while ( i < _fileNames.size() && _fileNames.at( i ) < fileName )
+	    merged << _fileNames.at( i++ );
+
+	if ( ( i < _fileNames.size() && _fileNames.at( i ) == fileName ) ||
+	     ( ! merged.isEmpty() && merged.last() == fileName )	  ||
+	     _fileIndex.contains( fileName ) )
+	{
+	    continue;
+	}
+
+	if ( firstNew < 0 )
+	    firstNew = merged.size();
+
+	merged << fileName;
+    }
+
+    if ( firstNew < 0 )
+	return;
+
+    while ( i < _fileNames.size() )
+	merged << _fileNames.at( i++ );
+
+    _fileNames = merged;
+
+    // Only the jobs at or after the first new name move
+
+    QStringList moved;
+    QMap<int, QString>::iterator it = _pending.lowerBound( firstNew );
+
+    while ( it != _pending.end() )
+    {
+	moved << it.value();
+	it = _pending.erase( it );
+    }
+
+    for ( int index = firstNew; index < _fileNames.size(); ++index )
+	_fileIndex.insert( _fileNames.at( index ), index );
+
+    // Jobs for names that were unknown so far now have their place
+
+    QStringList unknown = _unknown;
+    _unknown.clear();
+    moved << unknown;
+
+    foreach ( const QString & fileName, moved )
+	add( fileName );
+}
+
+
+void PrefetchJobQueue::setCurrentIndex( int index )
+{
+    _currentIndex = index;
+}
+
+
+int PrefetchJobQueue::distance( const QString & fileName ) const
+{
+    int index = _fileIndex.value( fileName, -1 );
+
+    if ( index < 0 )
+	return INT_MAX;
+
+    return qAbs( index - _currentIndex );
+}
+
+
+void PrefetchJobQueue::add( const QString & fileName )
+{
+    int index = _fileIndex.value( fileName, -1 );
+
+    if ( index >= 0 )
+	_pending.insert( index, fileName );
+    else if ( ! _unknown.contains( fileName ) )
+	_unknown.append( fileName );
+}
+
+
+void PrefetchJobQueue::remove( const QString & fileName )
+{
+    int index = _fileIndex.value( fileName, -1 );
+
+    if ( index >= 0 )
+	_pending.remove( index );
+    else
+	_unknown.removeAll( fileName );
+}
+
+
+bool PrefetchJobQueue::contains( const QString & fileName ) const
+{
+    int index = _fileIndex.value( fileName, -1 );
+
+    if ( index >= 0 )
+	return _pending.contains( index );
+    else
+	return _unknown.contains( fileName );
+}
+
+
+QMap<int, QString>::const_iterator PrefetchJobQueue::nearest() const
+{
+    if ( _pending.isEmpty() )
+	return _pending.constEnd();
+
+    // The first job at or after the current index and the last one before it
+    // are the only candidates.
+
+    QMap<int, QString>::const_iterator next = _pending.lowerBound( _currentIndex );
+
+    if ( next == _pending.constBegin() )
+	return next;
+
+    QMap<int, QString>::const_iterator previous = next - 1;
+
+    if ( next == _pending.constEnd() )
+	return previous;
+
+    if ( next.key() - _currentIndex <= _currentIndex - previous.key() )
+	return next;
+    else
+	return previous;
+}
+
+
+QString PrefetchJobQueue::first() const
+{
+    QMap<int, QString>::const_iterator it = nearest();
+
+    if ( it != _pending.constEnd() )
+	return it.value();
+
+    if ( ! _unknown.isEmpty() )
+	return _unknown.first();
+
+    return QString();
+}
+
+
+QString PrefetchJobQueue::takeFirst()
+{
+    QString fileName = first();
+    remove( fileName );
+
+    return fileName;
+}
+
+
+QStringList PrefetchJobQueue::jobs() const
+{
+    QStringList result;
+    PrefetchJobQueue queue( *this );
+
+    while ( ! queue.isEmpty() )
+	result << queue.takeFirst();
+
+    return result;
+}
+
+
+void PrefetchJobQueue::clear()
+{
+    _pending.clear();
+    _unknown.clear();
+}
@@ -0,0 +1,145 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef PrefetchJobQueue_h
+#define PrefetchJobQueue_h
+
+#include <QString>
+#include <QStringList>
+#include <QMap>
+#include <QHash>
+
+
+/**
+ * Job queue for the PrefetchCache: The pending jobs are always ordered by
+ * their distance from the current image, i.e. the image closest to the
+ * current one comes first; for the same distance, the next image comes
+ * before the previous one.
+ *
+ * The jobs are kept in a map sorted by their index in the directory, so
+ * moving the current image (setCurrentIndex()) does not require any
+ * re-sorting at all, and finding the next job is a O(log n) lookup around
+ * the current index.
+ *
+ * Jobs for file names that are not known (see setFileNames()) come last in
+ * the order they were added.
+ *
+ * This class is not thread-safe; the PrefetchCache protects it with its
+ * mutex.
+ */
+class PrefetchJobQueue
+{
+public:
+    /**
+     * Constructor.
+     */
+    PrefetchJobQueue();
+
+    /**
+     * Set the file names of the directory in directory order. Pending jobs
+     * are kept.
+     */
+    void setFileNames( const QStringList & fileNames );
+
+    /**
+     * Add file names to the ones set with setFileNames() in their sorted
+     * position. This only updates the index of the files after the first
+     * new one, and it keeps the pending jobs. Names that are known already
+     * are ignored. The directory order has to be sorted for this.
+     */
+    void addFileNames( const QStringList & fileNames );
+
+    /**
+     * Return the file names in directory order.
+     */
+    const QStringList & fileNames() const { return _fileNames; }
+
+    /**
+     * Set the index of the current image. This implicitly re-ranks all
+     * pending jobs.
+     */
+    void setCurrentIndex( int index );
+
+    /**
+     * Return the index of the current image.
+     */
+    int currentIndex() const { return _currentIndex; }
+
+    /**
+     * Return the distance of the specified image from the current image,
+     * i.e. the difference of their indices in the directory, or INT_MAX if
+     * the image is unknown. This does not need to be a pending job.
+     */
+    int distance( const QString & fileName ) const;
+
+    /**
+     * Add a job for the specified image unless there already is one.
+     */
+    void add( const QString & fileName );
+
+    /**
+     * Remove the job for the specified image if there is one.
+     */
+    void remove( const QString & fileName );
+
+    /**
+     * Return 'true' if there is a job for the specified image.
+     */
+    bool contains( const QString & fileName ) const;
+
+    /**
+     * Return the job with the highest priority (the one closest to the
+     * current image) or an empty string if there is none. This does not
+     * remove the job.
+     */
+    QString first() const;
+
+    /**
+     * Remove the job with the highest priority and return it.
+     */
+    QString takeFirst();
+
+    /**
+     * Return all pending jobs ordered by priority.
+     */
+    QStringList jobs() const;
+
+    /**
+     * Remove all pending jobs.
+     */
+    void clear();
+
+    /**
+     * Return the number of pending jobs.
+     */
+    int size() const { return _pending.size() + _unknown.size(); }
+
+    /**
+     * Return 'true' if there are no pending jobs.
+     */
+    bool isEmpty() const { return size() == 0; }
+
+protected:
+
+    /**
+     * Return an iterator to the pending job with the highest priority or
+     * _pending.constEnd() if there is none.
+     */
+    QMap<int, QString>::const_iterator nearest() const;
+
+private:
+
+    QStringList		_fileNames;
+    QHash<QString, int>	_fileIndex;
+    QMap<int, QString>	_pending;	// directory index -> file name
+    QStringList		_unknown;	// file names not in _fileIndex
+    int			_currentIndex;
+};
+
+
+#endif // PrefetchJobQueue_h
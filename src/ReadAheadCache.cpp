@@ -0,0 +1,747 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QElapsedTimer>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ReadAheadCache.h"
+#include "UringReader.h"
+#include "PrefetchCache.h"
+#include "Logger.h"
+
+#define ReadChunkSize	(1024 * 1024)
+
+
+/**
+ * One file of the blocking reader in ReadAheadCache::benchmark()
+ */
+class ReadAheadCacheBenchmarkRead: public QRunnable
+{
+public:
+    ReadAheadCacheBenchmarkRead( const QString & fullPath )
+	: _fullPath( fullPath )
+	{}
+
+    virtual void run() Q_DECL_OVERRIDE
+    {
+	ReadAheadCache::readFile( _fullPath, CancelToken() );
+    }
+
+private:
+    QString _fullPath;
+};
+
+
+ReadAheadCache::ReadAheadCache( const QString & path,
+				int		depth,
+				qint64		maxSize,
+				int		readerCount )
+    : _path( path )
+    , _byteCount( 0 )
+    , _depth( depth )
+    , _maxSize( maxSize )
+    , _backend( defaultBackend() )
+    , _shutdown( false )
+    , _paused( false )
+{
+    readerCount = qMax( 1, readerCount );
+
+    if ( _backend == UringBackend )
+	readerCount = 1; // that one keeps UringQueueDepth reads in flight
+
+    for ( int i=0; i < readerCount; ++i )
+    {
+	ReadAheadCacheReaderThread * reader = new ReadAheadCacheReaderThread( this );
+	_readers << reader;
+	reader->start( QThread::LowPriority );
+    }
+}
+
+
+ReadAheadCache::~ReadAheadCache()
+{
+    {
+	QMutexLocker locker( &_mutex );
+
+	_shutdown = true;
+	_token.cancel();
+	_jobCondition.wakeAll();
+    }
+
+    foreach ( ReadAheadCacheReaderThread * reader, _readers )
+	reader->wait();
+
+    qDeleteAll( _readers );
+    _readers.clear();
+}
+
+
+ReadAheadCache::Backend ReadAheadCache::defaultBackend()
+{
+    QString env = QString::fromLocal8Bit( qgetenv( "QPHOTOVIEW_READER" ) ).toLower();
+
+    if ( env == "threads" )
+	return ThreadBackend;
+
+    return UringReader::isAvailable() ? UringBackend : ThreadBackend;
+}
+
+
+QString ReadAheadCache::backendName( Backend backend )
+{
+    switch ( backend )
+    {
+	case ThreadBackend: return "threads";
+	case UringBackend:  return "io_uring";
+    }
+
+    return "?";
+}
+
+
+QString ReadAheadCache::fullPath( const QString & fileName ) const
+{
+    return _path + "/" + fileName;
+}
+
+
+void ReadAheadCache::setFileNames( const QStringList & fileNames )
+{
+    QMutexLocker locker( &_mutex );
+
+    _failed.clear();
+    _jobQueue.setFileNames( fileNames );
+    updateJobs();
+    _jobCondition.wakeAll();
+}
+
+
+void ReadAheadCache::addFileNames( const QStringList & fileNames )
+{
+    QMutexLocker locker( &_mutex );
+
+    _jobQueue.addFileNames( fileNames );
+    updateJobs();
+    _jobCondition.wakeAll();
+}
+
+
+void ReadAheadCache::setCurrentIndex( int index )
+{
+    QMutexLocker locker( &_mutex );
+
+    _jobQueue.setCurrentIndex( index );
+    updateJobs();
+    _jobCondition.wakeAll();
+}
+
+
+bool ReadAheadCache::inWindow( const QString & fileName ) const
+{
+    return _jobQueue.distance( fileName ) <= _depth;
+}
+
+
+void ReadAheadCache::updateJobs()
+{
+    // Drop what is now out of reach
+
+    QHash<QString, QByteArray>::iterator it = _cache.begin();
+
+    while ( it != _cache.end() )
+    {
+	if ( inWindow( it.key() ) )
+	    ++it;
+	else
+	{
+	    _byteCount -= it.value().size();
+	    it = _cache.erase( it );
+	}
+    }
+
+    foreach ( const QString & fileName, _jobQueue.jobs() )
+    {
+	if ( ! inWindow( fileName ) )
+	{
+	    _jobQueue.remove( fileName );
+	    _advised.remove( fileName );
+	}
+    }
+
+    // Queue what is now within reach
+
+    int current = _jobQueue.currentIndex();
+    int first	= qMax( 0, current - _depth );
+    int last	= qMin( _jobQueue.fileNames().size() - 1, current + _depth );
+
+    for ( int i = first; i <= last; ++i )
+    {
+	const QString & fileName = _jobQueue.fileNames().at( i );
+
+	if ( ! _cache.contains( fileName ) &&
+	     ! _inFlight.contains( fileName ) &&
+	     ! _failed.contains( fileName ) )
+	{
+	    _jobQueue.add( fileName );
+	}
+    }
+
+    evict();
+}
+
+
+void ReadAheadCache::evict()
+{
+    while ( _byteCount > _maxSize && ! _cache.isEmpty() )
+    {
+	QString farthest;
+	int	maxDistance = -1;
+
+	for ( QHash<QString, QByteArray>::const_iterator it = _cache.constBegin();
+	      it != _cache.constEnd();
+	      ++it )
+	{
+	    int distance = _jobQueue.distance( it.key() );
+
+	    if ( distance > maxDistance )
+	    {
+		maxDistance = distance;
+		farthest    = it.key();
+	    }
+	}
+
+	_byteCount -= _cache.take( farthest ).size();
+    }
+}
+
+
+QString ReadAheadCache::nextJob() const
+{
+    if ( _paused )
+	return QString();
+
+    QString fileName = _jobQueue.first();
+
+    if ( fileName.isEmpty() || _byteCount < _maxSize )
+	return fileName;
+
+    // The budget is exhausted: Only read this file if it is closer to the
+    // current image than one that is already cached, so that one can make
+    // room for it.
+
+    int distance = _jobQueue.distance( fileName );
+
+    for ( QHash<QString, QByteArray>::const_iterator it = _cache.constBegin();
+	  it != _cache.constEnd();
+	  ++it )
+    {
+	if ( _jobQueue.distance( it.key() ) > distance )
+	    return fileName;
+    }
+
+    return QString();
+}
+
+
+QByteArray ReadAheadCache::bytes( const QString &	fileName,
+				  const CancelToken &	token )
+{
+    QMutexLocker locker( &_mutex );
+
+    while ( true )
+    {
+	QHash<QString, QByteArray>::const_iterator it = _cache.constFind( fileName );
+
+	if ( it != _cache.constEnd() )
+	    return it.value();
+
+	if ( ! _inFlight.contains( fileName ) || token.isCancelled() )
+	    break;
+
+	// A reader is just reading it; that is faster than starting over.
+	// Wake up now and then to check if the caller lost interest.
+
+	_readyCondition.wait( &_mutex, 100 ); // millisec
+    }
+
+    _jobQueue.remove( fileName );
+
+    return QByteArray();
+}
+
+
+QByteArray ReadAheadCache::cachedBytes( const QString & fileName )
+{
+    QMutexLocker locker( &_mutex );
+
+    return _cache.value( fileName );
+}
+
+
+void ReadAheadCache::clear()
+{
+    QMutexLocker locker( &_mutex );
+
+    // Reads that are in flight now notice the cancelled token and discard
+    // what they read.
+
+    _token.cancel();
+    _token = CancelToken();
+
+    _cache.clear();
+    _byteCount = 0;
+    _jobQueue.clear();
+    _advised.clear();
+    _failed.clear();
+    _invalidated.clear();
+}
+
+
+void ReadAheadCache::invalidate( const QString & fileName )
+{
+    QMutexLocker locker( &_mutex );
+
+    if ( _cache.contains( fileName ) )
+	_byteCount -= _cache.take( fileName ).size();
+
+    _failed.remove( fileName );
+
+    if ( _inFlight.contains( fileName ) )
+	_invalidated.insert( fileName ); // see finishRead()
+    else if ( inWindow( fileName ) )
+	_jobQueue.add( fileName );
+
+    _jobCondition.wakeAll();
+}
+
+
+int ReadAheadCache::depth() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _depth;
+}
+
+
+void ReadAheadCache::setDepth( int depth )
+{
+    QMutexLocker locker( &_mutex );
+
+    _depth = qMax( 0, depth );
+    updateJobs();
+    _jobCondition.wakeAll();
+}
+
+
+qint64 ReadAheadCache::maxSize() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _maxSize;
+}
+
+
+void ReadAheadCache::setMaxSize( qint64 maxSize )
+{
+    QMutexLocker locker( &_mutex );
+
+    _maxSize = maxSize;
+    evict();
+    _jobCondition.wakeAll();
+}
+
+
+qint64 ReadAheadCache::byteCount() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _byteCount;
+}
+
+
+void ReadAheadCache::setPaused( bool paused )
+{
+    QMutexLocker locker( &_mutex );
+
+    _paused = paused;
+
+    if ( ! _paused )
+	_jobCondition.wakeAll();
+}
+
+
+bool ReadAheadCache::isPaused() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _paused;
+}
+
+
+void ReadAheadCache::finishRead( const QString &     fileName,
+				 const QByteArray &  bytes,
+				 const CancelToken & token )
+{
+    _inFlight.remove( fileName );
+    _advised.remove( fileName );
+
+    // A file that left the window while it was read is simply dropped; it
+    // is queued again if it comes back. One that changed while it was read
+    // is read again.
+
+    if ( _invalidated.remove( fileName ) )
+    {
+	if ( inWindow( fileName ) )
+	    _jobQueue.add( fileName );
+
+	_jobCondition.wakeAll();
+    }
+    else if ( ! token.isCancelled() && inWindow( fileName ) )
+    {
+	if ( bytes.isEmpty() )
+	{
+	    _failed.insert( fileName );
+	}
+	else
+	{
+	    _cache.insert( fileName, bytes );
+	    _byteCount += bytes.size();
+	    evict();
+	}
+    }
+
+    _readyCondition.wakeAll();
+}
+
+
+void ReadAheadCache::advise( const QString & fullPath )
+{
+#ifdef POSIX_FADV_WILLNEED
+    int fd = ::open( QFile::encodeName( fullPath ).constData(), O_RDONLY );
+
+    if ( fd >= 0 )
+    {
+	// This only starts the read-ahead in the kernel and returns at once.
+	// Closing the file does not cancel it.
+
+	posix_fadvise( fd, 0, 0, POSIX_FADV_WILLNEED );
+	::close( fd );
+    }
+#else
+    Q_UNUSED( fullPath );
+#endif
+}
+
+
+void ReadAheadCache::dropFromPageCache( const QString & fullPath )
+{
+#ifdef POSIX_FADV_DONTNEED
+    int fd = ::open( QFile::encodeName( fullPath ).constData(), O_RDONLY );
+
+    if ( fd >= 0 )
+    {
+	posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+	::close( fd );
+    }
+#else
+    Q_UNUSED( fullPath );
+#endif
+}
+
+
+void ReadAheadCache::benchmark( const QString &	    path,
+				const QStringList & fileNames )
+{
+    QStringList fullPaths;
+    qint64	totalSize = 0;
+
+    foreach ( const QString & fileName, fileNames )
+    {
+	QString fullPath = path + "/" + fileName;
+	fullPaths << fullPath;
+	totalSize += QFileInfo( fullPath ).size();
+    }
+
+    logInfo() << "*** Reader benchmark: " << fullPaths.size() << " files, "
+	      << totalSize / ( 1024 * 1024 ) << " MB in " << path << endl;
+
+    QList<Backend> backends;
+    backends << ThreadBackend << UringBackend;
+
+    foreach ( Backend backend, backends )
+    {
+	if ( backend == UringBackend && ! UringReader::isAvailable() )
+	{
+	    logInfo() << "io_uring is not available" << endl;
+	    continue;
+	}
+
+	// Start each run with a cold page cache, as far as it can be done
+	// without root permissions: This drops clean pages of these files.
+
+	foreach ( const QString & fullPath, fullPaths )
+	    dropFromPageCache( fullPath );
+
+	QElapsedTimer timer;
+	timer.start();
+
+	if ( backend == UringBackend )
+	{
+	    UringReader reader( UringQueueDepth );
+	    int next = 0;
+
+	    while ( next < fullPaths.size() || reader.pending() > 0 )
+	    {
+		while ( next < fullPaths.size() && reader.pending() < reader.queueDepth() )
+		    reader.submit( fullPaths.at( next++ ) );
+
+		if ( ! reader.waitForCompletion( 0, 0 ) )
+		    break;
+	    }
+	}
+	else
+	{
+	    QThreadPool pool;
+	    pool.setMaxThreadCount( DefaultReaderCount );
+
+	    foreach ( const QString & fullPath, fullPaths )
+		pool.start( new ReadAheadCacheBenchmarkRead( fullPath ) );
+
+	    pool.waitForDone();
+	}
+
+	qint64 elapsed = qMax( 1LL, timer.elapsed() );
+	int    readers = backend == UringBackend ? (int) UringQueueDepth : (int) DefaultReaderCount;
+
+	logInfo() << backendName( backend )
+		  << " (" << readers << " reads in flight): "
+		  << PrefetchCache::formatTime( elapsed ) << ", "
+		  << QString::number( totalSize / 1024.0 / 1024.0 * 1000.0 / elapsed, 'f', 1 ) << " MB/s, "
+		  << QString::number( fullPaths.size() * 1000.0 / elapsed, 'f', 1 ) << " files/s"
+		  << endl;
+    }
+}
+
+
+QByteArray ReadAheadCache::readFile( const QString &	 fullPath,
+				     const CancelToken & token )
+{
+    QFile file( fullPath );
+
+    if ( ! file.open( QIODevice::ReadOnly | QIODevice::Unbuffered ) )
+    {
+	logWarning() << "Can't open " << fullPath << endl;
+	return QByteArray();
+    }
+
+    qint64 size = file.size();
+
+    if ( size <= 0 )
+	return file.readAll();
+
+    QByteArray data( (int) size, Qt::Uninitialized );
+    qint64 pos = 0;
+
+    // Read in chunks so a cancelled read stops quickly even on slow media
+
+    while ( pos < size )
+    {
+	if ( token.isCancelled() )
+	    return QByteArray();
+
+	qint64 len = file.read( data.data() + pos, qMin( (qint64) ReadChunkSize, size - pos ) );
+
+	if ( len <= 0 )
+	{
+	    logWarning() << "Error reading " << fullPath << ": "
+			 << file.errorString() << endl;
+	    return QByteArray();
+	}
+
+	pos += len;
+    }
+
+    return data;
+}
+
+
+
+
+ReadAheadCacheReaderThread::ReadAheadCacheReaderThread( ReadAheadCache * readAheadCache ):
+    QThread(),
+    _readAheadCache( readAheadCache )
+{
+
+}
+
+
+void ReadAheadCacheReaderThread::run()
+{
+    if ( _readAheadCache->_backend == ReadAheadCache::UringBackend )
+	runUring();
+    else
+	runBlocking();
+}
+
+
+void ReadAheadCacheReaderThread::runBlocking()
+{
+    ReadAheadCache * cache = _readAheadCache;
+    QMutexLocker locker( &cache->_mutex );
+
+    while ( ! cache->_shutdown )
+    {
+	QString fileName = cache->nextJob();
+
+	if ( fileName.isEmpty() )
+	{
+	    cache->_jobCondition.wait( &cache->_mutex );
+	    continue;
+	}
+
+	cache->_jobQueue.remove( fileName );
+	cache->_inFlight.insert( fileName );
+
+	// Tell the kernel about the next files that will be read, so the
+	// storage has many requests to work on at the same time, not just
+	// one per reader thread.
+
+	QStringList advise;
+
+	foreach ( const QString & job, cache->_jobQueue.jobs() )
+	{
+	    if ( advise.size() >= ReadAheadCache::AdviseAhead )
+		break;
+
+	    if ( ! cache->_advised.contains( job ) )
+	    {
+		cache->_advised.insert( job );
+		advise << cache->fullPath( job );
+	    }
+	}
+
+	CancelToken token    = cache->_token;
+	QString	    fullPath = cache->fullPath( fileName );
+
+	locker.unlock();
+
+	foreach ( const QString & path, advise )
+	    ReadAheadCache::advise( path );
+
+	QByteArray bytes = ReadAheadCache::readFile( fullPath, token );
+
+	locker.relock();
+	cache->finishRead( fileName, bytes, token );
+    }
+}
+
+
+void ReadAheadCacheReaderThread::runUring()
+{
+    ReadAheadCache * cache = _readAheadCache;
+    UringReader reader( ReadAheadCache::UringQueueDepth );
+
+    if ( ! reader.isValid() )
+    {
+	runBlocking();
+	return;
+    }
+
+    QHash<QString, QString>	fileNames; // full path -> file name
+    QHash<QString, CancelToken> tokens;	   // full path -> token when submitted
+    QMutexLocker locker( &cache->_mutex );
+
+    while ( ! cache->_shutdown )
+    {
+	// Keep the ring full
+
+	QStringList submit;
+
+	while ( reader.pending() + submit.size() < reader.queueDepth() )
+	{
+	    QString fileName = cache->nextJob();
+
+	    if ( fileName.isEmpty() )
+		break;
+
+	    cache->_jobQueue.remove( fileName );
+	    cache->_inFlight.insert( fileName );
+
+	    QString fullPath = cache->fullPath( fileName );
+	    fileNames.insert( fullPath, fileName );
+	    tokens.insert( fullPath, cache->_token );
+	    submit << fullPath;
+	}
+
+	if ( submit.isEmpty() && reader.pending() == 0 )
+	{
+	    cache->_jobCondition.wait( &cache->_mutex );
+	    continue;
+	}
+
+	locker.unlock();
+
+	QStringList failed;
+
+	foreach ( const QString & fullPath, submit )
+	{
+	    if ( ! reader.submit( fullPath ) )
+		failed << fullPath;
+	}
+
+	QString	   fullPath;
+	QByteArray bytes;
+	bool	   ok = reader.pending() == 0 || reader.waitForCompletion( &fullPath, &bytes );
+
+	locker.relock();
+
+	foreach ( const QString & path, failed )
+	    cache->finishRead( fileNames.take( path ), QByteArray(), tokens.take( path ) );
+
+	if ( ! fullPath.isEmpty() )
+	    cache->finishRead( fileNames.take( fullPath ), bytes, tokens.take( fullPath ) );
+
+	if ( ! ok )
+	{
+	    // The ring is broken. Give up what is still in it and continue
+	    // without it.
+
+	    foreach ( const QString & path, fileNames.keys() )
+		cache->finishRead( fileNames.take( path ), QByteArray(), tokens.take( path ) );
+
+	    locker.unlock();
+	    runBlocking();
+	    return;
+	}
+    }
+}
+
+
+
+
+ReadAheadCacheBenchmarkThread::ReadAheadCacheBenchmarkThread( const QString &	  path,
+							      const QStringList & fileNames ):
+    QThread(),
+    _path( path ),
+    _fileNames( fileNames )
+{
+
+}
+
+
+void ReadAheadCacheBenchmarkThread::run()
+{
+    ReadAheadCache::benchmark( _path, _fileNames );
+}
@@ -0,0 +1,365 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef ReadAheadCache_h
+#define ReadAheadCache_h
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+
+#include "PrefetchJobQueue.h"
+#include "CancellableFile.h"
+
+class ReadAheadCache;
+
+
+/**
+ * Helper class: Thread that reads image files for a ReadAheadCache.
+ */
+class ReadAheadCacheReaderThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    ReadAheadCacheReaderThread( ReadAheadCache * readAheadCache );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+    /**
+     * Read one file after the other with blocking reads.
+     */
+    void runBlocking();
+
+    /**
+     * Keep many reads in flight with io_uring. This falls back to
+     * runBlocking() if io_uring does not work.
+     */
+    void runUring();
+
+private:
+    ReadAheadCache * _readAheadCache;
+};
+
+
+/**
+ * Helper class: Thread that runs ReadAheadCache::benchmark(), so that does
+ * not block the UI thread for the many seconds it takes.
+ */
+class ReadAheadCacheBenchmarkThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    ReadAheadCacheBenchmarkThread( const QString &     path,
+				   const QStringList & fileNames );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    QString	_path;
+    QStringList _fileNames;
+};
+
+
+/**
+ * Read-ahead cache for the compressed bytes of image files: The first tier
+ * below the PrefetchCache, for slow storage like NFS or USB card readers
+ * where waiting for I/O, not decoding, is what takes the time.
+ *
+ * All image files up to depth() positions away from the current image are
+ * read completely into memory, closest first, by several reader threads in
+ * parallel, so many requests are in flight at the same time. Each reader
+ * also announces the next files it will read with
+ * posix_fadvise( POSIX_FADV_WILLNEED ), so the kernel can already fetch
+ * them in the background.
+ *
+ * Compressed images are much smaller than decoded ones, so this tier can be
+ * much deeper than the decoded one for the same memory; the PrefetchCache
+ * workers then decode from memory (see bytes()).
+ *
+ * On Linux with io_uring, a single reader thread keeps UringQueueDepth reads
+ * in flight instead (see UringReader). The environment variable
+ * QPHOTOVIEW_READER=threads selects the reader threads even then.
+ *
+ * This class is thread-safe.
+ */
+class ReadAheadCache
+{
+public:
+
+    enum Backend
+    {
+	ThreadBackend,	// several threads with blocking reads
+	UringBackend	// one thread with io_uring
+    };
+
+    /**
+     * Constructor: Create a read-ahead cache for the directory 'path' with
+     * 'readerCount' reader threads.
+     */
+    ReadAheadCache( const QString & path,
+		    int		    depth	= DefaultDepth,
+		    qint64	    maxSize	= DefaultMaxSize,
+		    int		    readerCount = DefaultReaderCount );
+
+    /**
+     * Destructor. This cancels all reads and waits for the reader threads.
+     */
+    virtual ~ReadAheadCache();
+
+    /**
+     * Set the file names of the directory in directory order.
+     */
+    void setFileNames( const QStringList & fileNames );
+
+    /**
+     * Add file names to the ones set with setFileNames() in their sorted
+     * position (see PrefetchJobQueue::addFileNames()).
+     */
+    void addFileNames( const QStringList & fileNames );
+
+    /**
+     * Set the index (in the list set with setFileNames()) of the current
+     * image. This moves the window of files to read: Files that are farther
+     * away than depth() are dropped, the ones that are now within reach are
+     * read.
+     */
+    void setCurrentIndex( int index );
+
+    /**
+     * Return the content of the specified file or a null byte array if it
+     * is not in this cache. If a reader thread is reading it right now, this
+     * waits for it unless 'token' is cancelled meanwhile.
+     *
+     * A file that is only waiting to be read is removed from the queue:
+     * The caller reads it itself then.
+     */
+    QByteArray bytes( const QString & fileName,
+		      const CancelToken & token = CancelToken() );
+
+    /**
+     * Return the content of the specified file if it is in this cache
+     * already or a null byte array if not. Unlike bytes(), this never waits
+     * and leaves the queue alone.
+     */
+    QByteArray cachedBytes( const QString & fileName );
+
+    /**
+     * Drop all file contents and cancel all reads.
+     */
+    void clear();
+
+    /**
+     * The specified file changed: Drop its content and read it again if it
+     * is within the window.
+     */
+    void invalidate( const QString & fileName );
+
+    /**
+     * Return the number of files before and after the current one that are
+     * read ahead.
+     */
+    int depth() const;
+
+    /**
+     * Set the number of files before and after the current one that are
+     * read ahead.
+     */
+    void setDepth( int depth );
+
+    /**
+     * Return the memory budget in bytes.
+     */
+    qint64 maxSize() const;
+
+    /**
+     * Set the memory budget in bytes.
+     */
+    void setMaxSize( qint64 maxSize );
+
+    /**
+     * Return the number of bytes of all files in this cache.
+     */
+    qint64 byteCount() const;
+
+    /**
+     * Pause or resume the reader threads: While paused, they finish the
+     * reads they started, but don't start any new ones. This keeps them
+     * from competing with benchmark() for the storage.
+     */
+    void setPaused( bool paused );
+
+    /**
+     * Return 'true' if the reader threads are paused.
+     */
+    bool isPaused() const;
+
+    /**
+     * Return the number of reader threads.
+     */
+    int readerCount() const { return _readers.size(); }
+
+    /**
+     * Return the backend the reader threads use.
+     */
+    Backend backend() const { return _backend; }
+
+    /**
+     * Return the backend to use: io_uring if it is available and not
+     * disabled with QPHOTOVIEW_READER=threads, otherwise threads.
+     */
+    static Backend defaultBackend();
+
+    /**
+     * Return the name of a backend.
+     */
+    static QString backendName( Backend backend );
+
+    /**
+     * Read all files in 'fileNames' in 'path' once with each backend and
+     * log the time and the throughput. Before each run, the files are
+     * dropped from the page cache as far as possible.
+     */
+    static void benchmark( const QString & path, const QStringList & fileNames );
+
+    /**
+     * Default for depth()
+     */
+    static const int DefaultDepth = 100;
+
+    /**
+     * Default for maxSize(): 256 MB, i.e. about 30 images of 24 megapixels
+     * as JPEGs, but well over 100 of them as screen size decoded images
+     */
+    static const qint64 DefaultMaxSize = 256LL * 1024 * 1024;
+
+    /**
+     * Default for the number of reader threads
+     */
+    static const int DefaultReaderCount = 4;
+
+    /**
+     * Number of queued files a reader announces to the kernel
+     */
+    static const int AdviseAhead = 16;
+
+    /**
+     * Number of reads in flight with the io_uring backend
+     */
+    static const int UringQueueDepth = 32;
+
+    friend class ReadAheadCacheReaderThread;
+    friend class ReadAheadCacheBenchmarkRead;
+
+protected:
+
+    /**
+     * Return the full path for the specified file.
+     */
+    QString fullPath( const QString & fileName ) const;
+
+    /**
+     * Return 'true' if the specified file is within depth() of the current
+     * image. The caller has to lock _mutex.
+     */
+    bool inWindow( const QString & fileName ) const;
+
+    /**
+     * Drop what is outside the window and queue what is inside and not read
+     * yet. The caller has to lock _mutex.
+     */
+    void updateJobs();
+
+    /**
+     * Drop the files farthest away from the current image until all fit
+     * into maxSize(). The caller has to lock _mutex.
+     */
+    void evict();
+
+    /**
+     * Return the next file a reader thread should read or an empty string
+     * if there is none, if the memory budget is exhausted or if the readers
+     * are paused. The caller has to lock _mutex.
+     */
+    QString nextJob() const;
+
+    /**
+     * Handle the result of reading a file: Cache it if it is still wanted.
+     * The caller has to lock _mutex.
+     */
+    void finishRead( const QString &	 fileName,
+		     const QByteArray &	 bytes,
+		     const CancelToken & token );
+
+    /**
+     * Tell the kernel that the specified file will be read soon.
+     */
+    static void advise( const QString & fullPath );
+
+    /**
+     * Tell the kernel that the specified file is not needed any more, so it
+     * drops the pages of it from the page cache that are not dirty.
+     */
+    static void dropFromPageCache( const QString & fullPath );
+
+    /**
+     * Read the complete file. Return a null byte array if that fails or if
+     * 'token' is cancelled meanwhile.
+     */
+    static QByteArray readFile( const QString &	    fullPath,
+				const CancelToken & token );
+
+private:
+    Q_DISABLE_COPY( ReadAheadCache );
+
+    QString			  _path;
+    mutable QMutex		  _mutex;	   // protects everything below
+    QWaitCondition		  _jobCondition;   // new jobs or shutdown
+    QWaitCondition		  _readyCondition; // a reader finished a file
+    PrefetchJobQueue		  _jobQueue;
+    QHash<QString, QByteArray>	  _cache;
+    QSet<QString>		  _inFlight;
+    QSet<QString>		  _advised;
+    QSet<QString>		  _failed;
+    QSet<QString>		  _invalidated;	   // changed while in flight
+    qint64			  _byteCount;
+    int				  _depth;
+    qint64			  _maxSize;
+    Backend			  _backend;
+    CancelToken			  _token;	   // for all current reads
+    bool			  _shutdown;
+    bool			  _paused;
+
+    QList<ReadAheadCacheReaderThread *> _readers;
+};
+
+
+#endif // ReadAheadCache_h
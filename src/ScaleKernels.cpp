@@ -0,0 +1,659 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "ScaleKernels.h"
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#  define SCALE_KERNELS_X86 1
+#  include <immintrin.h>
+#  define TARGET_SSE2 __attribute__(( target( "sse2" ) ))
+#  define TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+
+
+ScaleKernels::InstructionSet ScaleKernels::detectInstructionSet()
+{
+#ifdef SCALE_KERNELS_X86
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+	return AVX2;
+
+    if ( __builtin_cpu_supports( "sse2" ) )
+	return SSE2;
+#endif
+
+    return Scalar;
+}
+
+
+const char * ScaleKernels::name( InstructionSet instructionSet )
+{
+    switch ( instructionSet )
+    {
+	case Scalar: return "scalar";
+	case SSE2:   return "SSE2";
+	case AVX2:   return "AVX2";
+    }
+
+    return "?";
+}
+
+
+void ScaleKernels::halve( InstructionSet  instructionSet,
+			  const uint8_t * src,
+			  int		  srcBpl,
+			  uint8_t *	  dst,
+			  int		  dstBpl,
+			  int		  dstWidth,
+			  int		  dstHeight )
+{
+    switch ( instructionSet )
+    {
+	case AVX2:
+	    halveAVX2  ( src, srcBpl, dst, dstBpl, dstWidth, dstHeight );
+	    break;
+
+	case SSE2:
+	    halveSSE2  ( src, srcBpl, dst, dstBpl, dstWidth, dstHeight );
+	    break;
+
+	case Scalar:
+	    halveScalar( src, srcBpl, dst, dstBpl, dstWidth, dstHeight );
+	    break;
+    }
+}
+
+
+void ScaleKernels::resample( InstructionSet  instructionSet,
+			     const uint8_t * src,
+			     int	     srcWidth,
+			     int	     srcHeight,
+			     int	     srcBpl,
+			     uint8_t *	     dst,
+			     int	     dstWidth,
+			     int	     dstHeight,
+			     int	     dstBpl )
+{
+    Filter hFilter = filter( srcWidth,	dstWidth  );
+    Filter vFilter = filter( srcHeight, dstHeight );
+
+    resampleRows( instructionSet, src, srcBpl, dst, dstWidth, dstBpl,
+		  hFilter, vFilter, 0, dstHeight );
+}
+
+
+void ScaleKernels::resampleRows( InstructionSet	 instructionSet,
+				 const uint8_t * src,
+				 int		 srcBpl,
+				 uint8_t *	 dst,
+				 int		 dstWidth,
+				 int		 dstBpl,
+				 const Filter &	 hFilter,
+				 const Filter &	 vFilter,
+				 int		 firstRow,
+				 int		 rowCount )
+{
+    if ( rowCount < 1 )
+	return;
+
+    // The source rows the vertical filter needs for these destination rows:
+    // Both the first and the last source row of each filter only ever move
+    // down from one destination row to the next.
+
+    int lastRow	 = firstRow + rowCount - 1;
+    int srcFirst = vFilter.start[ firstRow ];
+    int srcLast	 = vFilter.start[ lastRow ] + vFilter.count[ lastRow ] - 1;
+
+    // Horizontal pass: Only those source rows, but already the destination
+    // width
+
+    int tmpBpl = dstWidth * 4;
+    std::vector<uint8_t> tmp( (size_t) tmpBpl * ( srcLast - srcFirst + 1 ) );
+
+    for ( int y = srcFirst; y <= srcLast; ++y )
+    {
+	const uint8_t * srcLine = src + (size_t) y * srcBpl;
+	uint8_t *	tmpLine = &tmp[ (size_t) ( y - srcFirst ) * tmpBpl ];
+
+	if ( instructionSet == Scalar )
+	    horizontalScalar( srcLine, tmpLine, dstWidth, hFilter );
+	else
+	    horizontalSSE2  ( srcLine, tmpLine, dstWidth, hFilter );
+    }
+
+    // Vertical pass
+
+    for ( int y = firstRow; y <= lastRow; ++y )
+    {
+	const uint8_t * tmpLines = &tmp[ (size_t) ( vFilter.start[ y ] - srcFirst ) * tmpBpl ];
+	const int16_t * weights	 = &vFilter.weights[ vFilter.offset[ y ] ];
+	uint8_t *	dstLine	 = dst + (size_t) y * dstBpl;
+	int		count	 = vFilter.count[ y ];
+
+	switch ( instructionSet )
+	{
+	    case AVX2:
+		verticalAVX2  ( tmpLines, tmpBpl, count, weights, dstLine, dstWidth );
+		break;
+
+	    case SSE2:
+		verticalSSE2  ( tmpLines, tmpBpl, count, weights, dstLine, dstWidth );
+		break;
+
+	    case Scalar:
+		verticalScalar( tmpLines, tmpBpl, count, weights, dstLine, dstWidth );
+		break;
+	}
+    }
+}
+
+
+ScaleKernels::Filter ScaleKernels::filter( int srcSize, int dstSize )
+{
+    Filter result;
+    double scale   = dstSize / (double) srcSize;
+    double support = scale < 1.0 ? 1.0 / scale : 1.0;
+    std::vector<double> weights;
+
+    for ( int i = 0; i < dstSize; ++i )
+    {
+	double center = ( i + 0.5 ) / scale - 0.5;
+	int    first  = (int) floor( center - support ) + 1;
+	int    last   = (int) ceil ( center + support ) - 1;
+
+	if ( first < 0 )
+	    first = 0;
+
+	if ( last > srcSize - 1 )
+	    last = srcSize - 1;
+
+	if ( last < first ) // only possible at the edges
+	{
+	    first = last = center < 0.0 ? 0 : srcSize - 1;
+	}
+
+	weights.clear();
+	double sum = 0.0;
+
+	for ( int j = first; j <= last; ++j )
+	{
+	    double weight = 1.0 - fabs( j - center ) / support;
+
+	    if ( weight < 0.0 )
+		weight = 0.0;
+
+	    weights.push_back( weight );
+	    sum += weight;
+	}
+
+	// Convert to fixed point numbers that add up to exactly 1.0. Any
+	// rounding error goes to the largest weight.
+
+	int offset  = result.weights.size();
+	int total   = 0;
+	int largest = offset;
+
+	for ( size_t j = 0; j < weights.size(); ++j )
+	{
+	    int weight = sum > 0.0 ?
+		(int) floor( weights[ j ] / sum * ( 1 << WeightBits ) + 0.5 ) :
+		( j == 0 ? 1 << WeightBits : 0 );
+
+	    result.weights.push_back( weight );
+	    total += weight;
+
+	    if ( weight > result.weights[ largest ] )
+		largest = result.weights.size() - 1;
+	}
+
+	result.weights[ largest ] += ( 1 << WeightBits ) - total;
+
+	result.start.push_back( first );
+	result.count.push_back( last - first + 1 );
+	result.offset.push_back( offset );
+    }
+
+    return result;
+}
+
+
+static inline uint8_t clampPixel( int value )
+{
+    value = ( value + ( 1 << ( ScaleKernels::WeightBits - 1 ) ) ) >> ScaleKernels::WeightBits;
+
+    return value < 0 ? 0 : ( value > 255 ? 255 : value );
+}
+
+
+//
+// Scalar versions
+//
+
+
+void ScaleKernels::halveScalar( const uint8_t * src, int srcBpl,
+				uint8_t * dst, int dstBpl,
+				int dstWidth, int dstHeight )
+{
+    for ( int y = 0; y < dstHeight; ++y )
+    {
+	const uint8_t * line0 = src + (size_t) 2 * y * srcBpl;
+	const uint8_t * line1 = line0 + srcBpl;
+	uint8_t *	out   = dst + (size_t) y * dstBpl;
+
+	for ( int i = 0; i < dstWidth * 4; ++i )
+	{
+	    int x = ( i & ~3 ) * 2 + ( i & 3 ); // same channel, first pixel
+
+	    out[ i ] = ( line0[ x ] + line0[ x + 4 ] +
+			 line1[ x ] + line1[ x + 4 ] + 2 ) >> 2;
+	}
+    }
+}
+
+
+void ScaleKernels::horizontalScalar( const uint8_t * src, uint8_t * dst,
+				     int dstWidth, const Filter & filter )
+{
+    for ( int i = 0; i < dstWidth; ++i )
+    {
+	const uint8_t * pixels	= src + 4 * filter.start[ i ];
+	const int16_t * weights = &filter.weights[ filter.offset[ i ] ];
+	int sum[4] = { 0, 0, 0, 0 };
+
+	for ( int k = 0; k < filter.count[ i ]; ++k )
+	{
+	    for ( int c = 0; c < 4; ++c )
+		sum[ c ] += pixels[ 4 * k + c ] * weights[ k ];
+	}
+
+	for ( int c = 0; c < 4; ++c )
+	    dst[ 4 * i + c ] = clampPixel( sum[ c ] );
+    }
+}
+
+
+void ScaleKernels::verticalScalar( const uint8_t * src, int srcBpl,
+				   int count, const int16_t * weights,
+				   uint8_t * dst, int width )
+{
+    for ( int i = 0; i < width * 4; ++i )
+    {
+	int sum = 0;
+
+	for ( int k = 0; k < count; ++k )
+	    sum += src[ (size_t) k * srcBpl + i ] * weights[ k ];
+
+	dst[ i ] = clampPixel( sum );
+    }
+}
+
+
+#ifdef SCALE_KERNELS_X86
+
+//
+// SSE2 versions
+//
+
+
+/**
+ * Return two 16 bit weights in each 32 bit lane for _mm_madd_epi16().
+ */
+static inline uint32_t weightPair( int16_t first, int16_t second )
+{
+    return (uint16_t) first | ( (uint32_t) (uint16_t) second << 16 );
+}
+
+
+TARGET_SSE2
+void ScaleKernels::halveSSE2( const uint8_t * src, int srcBpl,
+			      uint8_t * dst, int dstBpl,
+			      int dstWidth, int dstHeight )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two  = _mm_set1_epi16( 2 );
+
+    for ( int y = 0; y < dstHeight; ++y )
+    {
+	const uint8_t * line0 = src + (size_t) 2 * y * srcBpl;
+	const uint8_t * line1 = line0 + srcBpl;
+	uint8_t *	out   = dst + (size_t) y * dstBpl;
+	int x = 0;
+
+	// 8 source pixels from each line -> 4 destination pixels
+
+	for ( ; x + 4 <= dstWidth; x += 4 )
+	{
+	    __m128i a0 = _mm_loadu_si128( (const __m128i *) ( line0 + 8 * x	 ) );
+	    __m128i a1 = _mm_loadu_si128( (const __m128i *) ( line0 + 8 * x + 16 ) );
+	    __m128i b0 = _mm_loadu_si128( (const __m128i *) ( line1 + 8 * x	 ) );
+	    __m128i b1 = _mm_loadu_si128( (const __m128i *) ( line1 + 8 * x + 16 ) );
+
+	    // Vertical sums with 16 bits per channel: 2 pixels per register
+
+	    __m128i s01 = _mm_add_epi16( _mm_unpacklo_epi8( a0, zero ), _mm_unpacklo_epi8( b0, zero ) );
+	    __m128i s23 = _mm_add_epi16( _mm_unpackhi_epi8( a0, zero ), _mm_unpackhi_epi8( b0, zero ) );
+	    __m128i s45 = _mm_add_epi16( _mm_unpacklo_epi8( a1, zero ), _mm_unpacklo_epi8( b1, zero ) );
+	    __m128i s67 = _mm_add_epi16( _mm_unpackhi_epi8( a1, zero ), _mm_unpackhi_epi8( b1, zero ) );
+
+	    // Horizontal sums: Add the second pixel of each register to the first
+
+	    s01 = _mm_add_epi16( s01, _mm_srli_si128( s01, 8 ) );
+	    s23 = _mm_add_epi16( s23, _mm_srli_si128( s23, 8 ) );
+	    s45 = _mm_add_epi16( s45, _mm_srli_si128( s45, 8 ) );
+	    s67 = _mm_add_epi16( s67, _mm_srli_si128( s67, 8 ) );
+
+	    __m128i lo = _mm_unpacklo_epi64( s01, s23 );
+	    __m128i hi = _mm_unpacklo_epi64( s45, s67 );
+
+	    lo = _mm_srli_epi16( _mm_add_epi16( lo, two ), 2 );
+	    hi = _mm_srli_epi16( _mm_add_epi16( hi, two ), 2 );
+
+	    _mm_storeu_si128( (__m128i *) ( out + 4 * x ), _mm_packus_epi16( lo, hi ) );
+	}
+
+	if ( x < dstWidth )
+	{
+	    halveScalar( line0 + 8 * x, srcBpl, out + 4 * x, dstBpl,
+			 dstWidth - x, 1 );
+	}
+    }
+}
+
+
+TARGET_SSE2
+void ScaleKernels::horizontalSSE2( const uint8_t * src, uint8_t * dst,
+				   int dstWidth, const Filter & filter )
+{
+    const __m128i zero	= _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32( 1 << ( WeightBits - 1 ) );
+
+    for ( int i = 0; i < dstWidth; ++i )
+    {
+	const uint8_t * pixels	= src + 4 * filter.start[ i ];
+	const int16_t * weights = &filter.weights[ filter.offset[ i ] ];
+	int count = filter.count[ i ];
+	__m128i sum = zero;
+	int k = 0;
+
+	// Two source pixels at a time: Interleave their channels so
+	// _mm_madd_epi16() multiplies and adds them in one step.
+
+	for ( ; k + 2 <= count; k += 2 )
+	{
+	    __m128i px = _mm_loadl_epi64( (const __m128i *) ( pixels + 4 * k ) );
+	    px = _mm_unpacklo_epi8( px, zero );
+	    px = _mm_unpacklo_epi16( px, _mm_srli_si128( px, 8 ) );
+
+	    __m128i wt = _mm_set1_epi32( weightPair( weights[ k ], weights[ k + 1 ] ) );
+	    sum = _mm_add_epi32( sum, _mm_madd_epi16( px, wt ) );
+	}
+
+	if ( k < count )
+	{
+	    int32_t pixel;
+	    memcpy( &pixel, pixels + 4 * k, sizeof( pixel ) );
+
+	    __m128i px = _mm_unpacklo_epi8( _mm_cvtsi32_si128( pixel ), zero );
+	    px = _mm_unpacklo_epi16( px, zero );
+
+	    __m128i wt = _mm_set1_epi32( weightPair( weights[ k ], 0 ) );
+	    sum = _mm_add_epi32( sum, _mm_madd_epi16( px, wt ) );
+	}
+
+	sum = _mm_srai_epi32( _mm_add_epi32( sum, round ), WeightBits );
+	sum = _mm_packs_epi32( sum, sum );
+	sum = _mm_packus_epi16( sum, sum );
+
+	int32_t result = _mm_cvtsi128_si32( sum );
+	memcpy( dst + 4 * i, &result, sizeof( result ) );
+    }
+}
+
+
+TARGET_SSE2
+void ScaleKernels::verticalSSE2( const uint8_t * src, int srcBpl,
+				 int count, const int16_t * weights,
+				 uint8_t * dst, int width )
+{
+    const __m128i zero	= _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32( 1 << ( WeightBits - 1 ) );
+    int x = 0;
+
+    // 4 pixels at a time, two source lines at a time
+
+    for ( ; x + 4 <= width; x += 4 )
+    {
+	__m128i sum0 = zero; // one pixel each
+	__m128i sum1 = zero;
+	__m128i sum2 = zero;
+	__m128i sum3 = zero;
+
+	for ( int k = 0; k < count; k += 2 )
+	{
+	    const uint8_t * line = src + (size_t) k * srcBpl + 4 * x;
+	    __m128i a  = _mm_loadu_si128( (const __m128i *) line );
+	    __m128i b  = zero;
+	    __m128i wt;
+
+	    if ( k + 1 < count )
+	    {
+		b  = _mm_loadu_si128( (const __m128i *) ( line + srcBpl ) );
+		wt = _mm_set1_epi32( weightPair( weights[ k ], weights[ k + 1 ] ) );
+	    }
+	    else
+	    {
+		wt = _mm_set1_epi32( weightPair( weights[ k ], 0 ) );
+	    }
+
+	    __m128i aLo = _mm_unpacklo_epi8( a, zero );
+	    __m128i bLo = _mm_unpacklo_epi8( b, zero );
+	    __m128i aHi = _mm_unpackhi_epi8( a, zero );
+	    __m128i bHi = _mm_unpackhi_epi8( b, zero );
+
+	    sum0 = _mm_add_epi32( sum0, _mm_madd_epi16( _mm_unpacklo_epi16( aLo, bLo ), wt ) );
+	    sum1 = _mm_add_epi32( sum1, _mm_madd_epi16( _mm_unpackhi_epi16( aLo, bLo ), wt ) );
+	    sum2 = _mm_add_epi32( sum2, _mm_madd_epi16( _mm_unpacklo_epi16( aHi, bHi ), wt ) );
+	    sum3 = _mm_add_epi32( sum3, _mm_madd_epi16( _mm_unpackhi_epi16( aHi, bHi ), wt ) );
+	}
+
+	sum0 = _mm_srai_epi32( _mm_add_epi32( sum0, round ), WeightBits );
+	sum1 = _mm_srai_epi32( _mm_add_epi32( sum1, round ), WeightBits );
+	sum2 = _mm_srai_epi32( _mm_add_epi32( sum2, round ), WeightBits );
+	sum3 = _mm_srai_epi32( _mm_add_epi32( sum3, round ), WeightBits );
+
+	__m128i result = _mm_packus_epi16( _mm_packs_epi32( sum0, sum1 ),
+					   _mm_packs_epi32( sum2, sum3 ) );
+
+	_mm_storeu_si128( (__m128i *) ( dst + 4 * x ), result );
+    }
+
+    if ( x < width )
+	verticalScalar( src + 4 * x, srcBpl, count, weights, dst + 4 * x, width - x );
+}
+
+
+//
+// AVX2 versions
+//
+// Most AVX2 instructions work on two independent 128 bit lanes, so the
+// pixels are in a different order in the middle of these; see the comments.
+//
+
+
+TARGET_AVX2
+void ScaleKernels::halveAVX2( const uint8_t * src, int srcBpl,
+			      uint8_t * dst, int dstBpl,
+			      int dstWidth, int dstHeight )
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i two  = _mm256_set1_epi16( 2 );
+
+    for ( int y = 0; y < dstHeight; ++y )
+    {
+	const uint8_t * line0 = src + (size_t) 2 * y * srcBpl;
+	const uint8_t * line1 = line0 + srcBpl;
+	uint8_t *	out   = dst + (size_t) y * dstBpl;
+	int x = 0;
+
+	// 16 source pixels from each line -> 8 destination pixels
+
+	for ( ; x + 8 <= dstWidth; x += 8 )
+	{
+	    __m256i a0 = _mm256_loadu_si256( (const __m256i *) ( line0 + 8 * x	    ) );
+	    __m256i a1 = _mm256_loadu_si256( (const __m256i *) ( line0 + 8 * x + 32 ) );
+	    __m256i b0 = _mm256_loadu_si256( (const __m256i *) ( line1 + 8 * x	    ) );
+	    __m256i b1 = _mm256_loadu_si256( (const __m256i *) ( line1 + 8 * x + 32 ) );
+
+	    // Source pixels p0..p15: [p0 p1 | p4 p5], [p2 p3 | p6 p7] etc.
+
+	    __m256i lo0 = _mm256_add_epi16( _mm256_unpacklo_epi8( a0, zero ), _mm256_unpacklo_epi8( b0, zero ) );
+	    __m256i hi0 = _mm256_add_epi16( _mm256_unpackhi_epi8( a0, zero ), _mm256_unpackhi_epi8( b0, zero ) );
+	    __m256i lo1 = _mm256_add_epi16( _mm256_unpacklo_epi8( a1, zero ), _mm256_unpacklo_epi8( b1, zero ) );
+	    __m256i hi1 = _mm256_add_epi16( _mm256_unpackhi_epi8( a1, zero ), _mm256_unpackhi_epi8( b1, zero ) );
+
+	    // Destination pixels P0..P7: [P0 | P2], [P1 | P3], [P4 | P6], [P5 | P7]
+
+	    lo0 = _mm256_add_epi16( lo0, _mm256_srli_si256( lo0, 8 ) );
+	    hi0 = _mm256_add_epi16( hi0, _mm256_srli_si256( hi0, 8 ) );
+	    lo1 = _mm256_add_epi16( lo1, _mm256_srli_si256( lo1, 8 ) );
+	    hi1 = _mm256_add_epi16( hi1, _mm256_srli_si256( hi1, 8 ) );
+
+	    // [P0 P1 | P2 P3], [P4 P5 | P6 P7]
+
+	    __m256i r0 = _mm256_unpacklo_epi64( lo0, hi0 );
+	    __m256i r1 = _mm256_unpacklo_epi64( lo1, hi1 );
+
+	    r0 = _mm256_srli_epi16( _mm256_add_epi16( r0, two ), 2 );
+	    r1 = _mm256_srli_epi16( _mm256_add_epi16( r1, two ), 2 );
+
+	    // [P0 P1 P4 P5 | P2 P3 P6 P7] -> P0..P7
+
+	    __m256i result = _mm256_packus_epi16( r0, r1 );
+	    result = _mm256_permute4x64_epi64( result, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+
+	    _mm256_storeu_si256( (__m256i *) ( out + 4 * x ), result );
+	}
+
+	if ( x < dstWidth )
+	{
+	    halveSSE2( line0 + 8 * x, srcBpl, out + 4 * x, dstBpl,
+		       dstWidth - x, 1 );
+	}
+    }
+}
+
+
+TARGET_AVX2
+void ScaleKernels::verticalAVX2( const uint8_t * src, int srcBpl,
+				 int count, const int16_t * weights,
+				 uint8_t * dst, int width )
+{
+    const __m256i zero	= _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32( 1 << ( WeightBits - 1 ) );
+    int x = 0;
+
+    // 8 pixels at a time, two source lines at a time
+
+    for ( ; x + 8 <= width; x += 8 )
+    {
+	__m256i sum0 = zero; // [p0 | p4]
+	__m256i sum1 = zero; // [p1 | p5]
+	__m256i sum2 = zero; // [p2 | p6]
+	__m256i sum3 = zero; // [p3 | p7]
+
+	for ( int k = 0; k < count; k += 2 )
+	{
+	    const uint8_t * line = src + (size_t) k * srcBpl + 4 * x;
+	    __m256i a  = _mm256_loadu_si256( (const __m256i *) line );
+	    __m256i b  = zero;
+	    __m256i wt;
+
+	    if ( k + 1 < count )
+	    {
+		b  = _mm256_loadu_si256( (const __m256i *) ( line + srcBpl ) );
+		wt = _mm256_set1_epi32( weightPair( weights[ k ], weights[ k + 1 ] ) );
+	    }
+	    else
+	    {
+		wt = _mm256_set1_epi32( weightPair( weights[ k ], 0 ) );
+	    }
+
+	    __m256i aLo = _mm256_unpacklo_epi8( a, zero );
+	    __m256i bLo = _mm256_unpacklo_epi8( b, zero );
+	    __m256i aHi = _mm256_unpackhi_epi8( a, zero );
+	    __m256i bHi = _mm256_unpackhi_epi8( b, zero );
+
+	    sum0 = _mm256_add_epi32( sum0, _mm256_madd_epi16( _mm256_unpacklo_epi16( aLo, bLo ), wt ) );
+	    sum1 = _mm256_add_epi32( sum1, _mm256_madd_epi16( _mm256_unpackhi_epi16( aLo, bLo ), wt ) );
+	    sum2 = _mm256_add_epi32( sum2, _mm256_madd_epi16( _mm256_unpacklo_epi16( aHi, bHi ), wt ) );
+	    sum3 = _mm256_add_epi32( sum3, _mm256_madd_epi16( _mm256_unpackhi_epi16( aHi, bHi ), wt ) );
+	}
+
+	sum0 = _mm256_srai_epi32( _mm256_add_epi32( sum0, round ), WeightBits );
+	sum1 = _mm256_srai_epi32( _mm256_add_epi32( sum1, round ), WeightBits );
+	sum2 = _mm256_srai_epi32( _mm256_add_epi32( sum2, round ), WeightBits );
+	sum3 = _mm256_srai_epi32( _mm256_add_epi32( sum3, round ), WeightBits );
+
+	// [p0 p1 | p4 p5], [p2 p3 | p6 p7] -> [p0 p1 p2 p3 | p4 p5 p6 p7]
+
+	__m256i result = _mm256_packus_epi16( _mm256_packs_epi32( sum0, sum1 ),
+					      _mm256_packs_epi32( sum2, sum3 ) );
+
+	_mm256_storeu_si256( (__m256i *) ( dst + 4 * x ), result );
+    }
+
+    if ( x < width )
+	verticalSSE2( src + 4 * x, srcBpl, count, weights, dst + 4 * x, width - x );
+}
+
+
+#else // ! SCALE_KERNELS_X86
+
+void ScaleKernels::halveSSE2( const uint8_t * src, int srcBpl,
+			      uint8_t * dst, int dstBpl,
+			      int dstWidth, int dstHeight )
+{
+    halveScalar( src, srcBpl, dst, dstBpl, dstWidth, dstHeight );
+}
+
+
+void ScaleKernels::halveAVX2( const uint8_t * src, int srcBpl,
+			      uint8_t * dst, int dstBpl,
+			      int dstWidth, int dstHeight )
+{
+    halveScalar( src, srcBpl, dst, dstBpl, dstWidth, dstHeight );
+}
+
+
+void ScaleKernels::horizontalSSE2( const uint8_t * src, uint8_t * dst,
+				   int dstWidth, const Filter & filter )
+{
+    horizontalScalar( src, dst, dstWidth, filter );
+}
+
+
+void ScaleKernels::verticalSSE2( const uint8_t * src, int srcBpl,
+				 int count, const int16_t * weights,
+				 uint8_t * dst, int width )
+{
+    verticalScalar( src, srcBpl, count, weights, dst, width );
+}
+
+
+void ScaleKernels::verticalAVX2( const uint8_t * src, int srcBpl,
+				 int count, const int16_t * weights,
+				 uint8_t * dst, int width )
+{
+    verticalScalar( src, srcBpl, count, weights, dst, width );
+}
+
+#endif // ! SCALE_KERNELS_X86
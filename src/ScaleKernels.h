@@ -0,0 +1,161 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef ScaleKernels_h
+#define ScaleKernels_h
+
+#include <stdint.h>
+#include <vector>
+
+
+/**
+ * Low-level image scaling kernels for 32 bit per pixel images
+ * (QImage::Format_RGB32 and QImage::Format_ARGB32_Premultiplied) with
+ * scalar, SSE2 and AVX2 implementations. The instruction set is chosen at
+ * runtime; see detectInstructionSet().
+ *
+ * This deliberately does not use any Qt classes; see ImageScaler for the
+ * QImage interface.
+ */
+class ScaleKernels
+{
+public:
+
+    enum InstructionSet
+    {
+	Scalar = 0,
+	SSE2,
+	AVX2
+    };
+
+    /**
+     * Return the best instruction set the CPU supports.
+     */
+    static InstructionSet detectInstructionSet();
+
+    /**
+     * Return the name of an instruction set.
+     */
+    static const char * name( InstructionSet instructionSet );
+
+    /**
+     * Scale an image down to exactly half its size with a 2x2 box filter.
+     * 'dstWidth' and 'dstHeight' are the size of the result, i.e. half the
+     * size of 'src' rounded down; an odd last column or row of 'src' is
+     * ignored. 'srcBpl' and 'dstBpl' are the bytes per line.
+     */
+    static void halve( InstructionSet	   instructionSet,
+		       const uint8_t *	   src,
+		       int		   srcBpl,
+		       uint8_t *	   dst,
+		       int		   dstBpl,
+		       int		   dstWidth,
+		       int		   dstHeight );
+
+    /**
+     * Scale an image to any size with a separable triangle (tent) filter:
+     * First horizontally into a temporary image, then vertically. When
+     * scaling down, the filter is widened by the scale factor so every
+     * source pixel contributes to the result.
+     */
+    static void resample( InstructionSet   instructionSet,
+			  const uint8_t *  src,
+			  int		   srcWidth,
+			  int		   srcHeight,
+			  int		   srcBpl,
+			  uint8_t *	   dst,
+			  int		   dstWidth,
+			  int		   dstHeight,
+			  int		   dstBpl );
+
+    struct Filter;
+
+    /**
+     * Like resample(), but only compute the 'rowCount' destination rows
+     * starting with 'firstRow' with the filters 'hFilter' and 'vFilter'
+     * (see filter()). 'dst' is the start of the complete destination image.
+     *
+     * This reads only the source rows these destination rows need, so
+     * disjoint row ranges can be computed in parallel; the source rows
+     * where their filters overlap are read by both.
+     */
+    static void resampleRows( InstructionSet	   instructionSet,
+			      const uint8_t *	   src,
+			      int		   srcBpl,
+			      uint8_t *		   dst,
+			      int		   dstWidth,
+			      int		   dstBpl,
+			      const Filter &	   hFilter,
+			      const Filter &	   vFilter,
+			      int		   firstRow,
+			      int		   rowCount );
+
+    /**
+     * Filter weights for one direction of resample(): For each destination
+     * pixel, the first source pixel, the number of source pixels, and where
+     * its weights start in 'weights'. Weights are fixed point numbers with
+     * WeightBits fraction bits that add up to 1.0 for each destination
+     * pixel.
+     */
+    struct Filter
+    {
+	std::vector<int>     start;
+	std::vector<int>     count;
+	std::vector<int>     offset;
+	std::vector<int16_t> weights;
+    };
+
+    /**
+     * Return the filter for scaling 'srcSize' pixels to 'dstSize' pixels.
+     */
+    static Filter filter( int srcSize, int dstSize );
+
+    static const int WeightBits = 14;
+
+protected:
+
+    static void halveScalar( const uint8_t * src, int srcBpl,
+			     uint8_t * dst, int dstBpl,
+			     int dstWidth, int dstHeight );
+
+    static void halveSSE2  ( const uint8_t * src, int srcBpl,
+			     uint8_t * dst, int dstBpl,
+			     int dstWidth, int dstHeight );
+
+    static void halveAVX2  ( const uint8_t * src, int srcBpl,
+			     uint8_t * dst, int dstBpl,
+			     int dstWidth, int dstHeight );
+
+    /**
+     * Filter one row horizontally.
+     */
+    static void horizontalScalar( const uint8_t * src, uint8_t * dst,
+				  int dstWidth, const Filter & filter );
+
+    static void horizontalSSE2	( const uint8_t * src, uint8_t * dst,
+				  int dstWidth, const Filter & filter );
+
+    /**
+     * Compute one destination row from 'count' source rows that are
+     * 'srcBpl' bytes apart, starting at 'src', with 'weights'.
+     */
+    static void verticalScalar( const uint8_t * src, int srcBpl,
+				int count, const int16_t * weights,
+				uint8_t * dst, int width );
+
+    static void verticalSSE2  ( const uint8_t * src, int srcBpl,
+				int count, const int16_t * weights,
+				uint8_t * dst, int width );
+
+    static void verticalAVX2  ( const uint8_t * src, int srcBpl,
+				int count, const int16_t * weights,
+				uint8_t * dst, int width );
+};
+
+
+#endif // ScaleKernels_h
@@ -0,0 +1,398 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QImageReader>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QMap>
+
+#include "TileCache.h"
+#include "ImagePyramid.h"
+#include "ImageScaler.h"
+#include "MappedFile.h"
+#include "PrefetchCache.h"
+#include "Logger.h"
+
+
+TileCache::TileCache( QObject * parent, qint64 maxSize )
+    : QObject( parent )
+    , _zoomFactor( 1.0 )
+    , _shutdown( false )
+    , _worker( this )
+{
+    _tiles.setMaxCost( maxSize / 1024 );
+    _worker.start();
+}
+
+
+TileCache::~TileCache()
+{
+    {
+	QMutexLocker locker( &_mutex );
+	_shutdown = true;
+	_token.cancel();
+	_jobCondition.wakeAll();
+    }
+
+    _worker.wait();
+}
+
+
+void TileCache::setImage( const QString &		 fullPath,
+			  const QSize &			 origSize,
+			  qreal				 zoomFactor,
+			  QSharedPointer<ImagePyramid>	 pyramid )
+{
+    // A file that was rewritten has the same path, but not the same tiles
+
+    QString version = fileVersion( fullPath );
+    QMutexLocker locker( &_mutex );
+
+    if ( fullPath   == _fullPath    &&
+	 version    == _fileVersion &&
+	 origSize   == _origSize    &&
+	 zoomFactor == _zoomFactor  &&
+	 pyramid    == _pyramid )
+    {
+	return;
+    }
+
+    _token.cancel();
+    _token	= CancelToken();
+    _fullPath	 = fullPath;
+    _fileVersion = version;
+    _origSize	 = origSize;
+    _zoomFactor = zoomFactor;
+    _pyramid	= pyramid;
+    _pending.clear();
+}
+
+
+void TileCache::clear()
+{
+    QMutexLocker locker( &_mutex );
+
+    _token.cancel();
+    _token	= CancelToken();
+    _fullPath.clear();
+    _fileVersion.clear();
+    _origSize	= QSize();
+    _zoomFactor = 1.0;
+    _pyramid.clear();
+    _pending.clear();
+}
+
+
+QSize TileCache::size() const
+{
+    QMutexLocker locker( &_mutex );
+
+    if ( _fullPath.isEmpty() )
+	return QSize( 0, 0 );
+
+    return zoomedSize( _origSize, _zoomFactor );
+}
+
+
+qreal TileCache::zoomFactor() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _zoomFactor;
+}
+
+
+QImage TileCache::tile( const QPoint & tilePos )
+{
+    QMutexLocker locker( &_mutex );
+
+    QImage * tile = _tiles.object( tileKey( _fullPath, _fileVersion, _zoomFactor, tilePos ) );
+
+    return tile ? *tile : QImage();
+}
+
+
+void TileCache::request( const QRect & rect )
+{
+    QMutexLocker locker( &_mutex );
+
+    _pending.clear();
+
+    if ( _fullPath.isEmpty() )
+	return;
+
+    QSize imageSize = zoomedSize( _origSize, _zoomFactor );
+    QRect wanted    = rect & QRect( QPoint( 0, 0 ), imageSize );
+
+    if ( wanted.isEmpty() )
+	return;
+
+    QMultiMap<int, QPoint> byDistance;
+
+    for ( int y = wanted.top() / TileSize; y <= wanted.bottom() / TileSize; ++y )
+    {
+	for ( int x = wanted.left() / TileSize; x <= wanted.right() / TileSize; ++x )
+	{
+	    QPoint tilePos( x, y );
+
+	    if ( ! _tiles.contains( tileKey( _fullPath, _fileVersion, _zoomFactor, tilePos ) ) )
+	    {
+		QPoint diff = tileRect( tilePos, imageSize ).center() - wanted.center();
+		byDistance.insert( diff.manhattanLength(), tilePos );
+	    }
+	}
+    }
+
+    _pending = byDistance.values();
+
+    if ( ! _pending.isEmpty() )
+	_jobCondition.wakeAll();
+}
+
+
+QRect TileCache::tileRect( const QPoint & tilePos ) const
+{
+    QMutexLocker locker( &_mutex );
+
+    return tileRect( tilePos, zoomedSize( _origSize, _zoomFactor ) );
+}
+
+
+qint64 TileCache::maxSize() const
+{
+    QMutexLocker locker( &_mutex );
+
+    return _tiles.maxCost() * 1024LL;
+}
+
+
+void TileCache::setMaxSize( qint64 maxSize )
+{
+    QMutexLocker locker( &_mutex );
+
+    _tiles.setMaxCost( maxSize / 1024 );
+}
+
+
+QString TileCache::tileKey( const QString & fullPath,
+			    const QString & fileVersion,
+			    qreal	    zoomFactor,
+			    const QPoint &  tilePos )
+{
+    return QString( "%1|%2|%3|%4,%5" )
+	.arg( fullPath )
+	.arg( fileVersion )
+	.arg( zoomFactor, 0, 'g', 6 )
+	.arg( tilePos.x() )
+	.arg( tilePos.y() );
+}
+
+
+QString TileCache::fileVersion( const QString & fullPath )
+{
+    QFileInfo fileInfo( fullPath );
+
+    return QString( "%1@%2" )
+	.arg( fileInfo.size() )
+	.arg( fileInfo.lastModified().toMSecsSinceEpoch() );
+}
+
+
+QSize TileCache::zoomedSize( const QSize & origSize, qreal zoomFactor )
+{
+    return QSize( qRound( origSize.width()  * zoomFactor ),
+		  qRound( origSize.height() * zoomFactor ) );
+}
+
+
+QRect TileCache::tileRect( const QPoint & tilePos, const QSize & imageSize )
+{
+    QRect rect( tilePos.x() * TileSize, tilePos.y() * TileSize,
+		TileSize, TileSize );
+
+    return rect & QRect( QPoint( 0, 0 ), imageSize );
+}
+
+
+QRect TileCache::sourceRect( const QRect & rect,
+			     qreal	   zoomFactor,
+			     const QRect & bounds )
+{
+    QRectF source( rect.x()	 / zoomFactor,
+		   rect.y()	 / zoomFactor,
+		   rect.width()	 / zoomFactor,
+		   rect.height() / zoomFactor );
+
+    return source.toAlignedRect().adjusted( -1, -1, 1, 1 ) & bounds;
+}
+
+
+QImage TileCache::renderTile( const QRect &  rect,
+			      qreal	     zoomFactor,
+			      const QImage & source,
+			      const QRect &  sourceRegion )
+{
+    if ( qFuzzyCompare( zoomFactor, 1.0 ) )
+	return source.copy( rect.translated( -sourceRegion.topLeft() ) );
+
+    // Scale only the part of the source that is needed for this tile, then
+    // cut out the tile: The scaled part starts a little before the tile
+    // because of the extra pixels for the filter.
+
+    QRect  srcRect = sourceRect( rect, zoomFactor, sourceRegion );
+    QImage part	   = source.copy( srcRect.translated( -sourceRegion.topLeft() ) );
+
+    QPoint origin( qRound( srcRect.x() * zoomFactor ),
+		   qRound( srcRect.y() * zoomFactor ) );
+
+    QSize scaledSize( qRound( srcRect.width()  * zoomFactor ),
+		      qRound( srcRect.height() * zoomFactor ) );
+
+    QImage scaled = ImageScaler::scaled( part, scaledSize );
+
+    return scaled.copy( rect.translated( -origin ) );
+}
+
+
+QImage TileCache::decodeRegion( const QString &	    fullPath,
+				const QRect &	    region,
+				const CancelToken & token )
+{
+    MappedFile file( fullPath, token );
+
+    if ( ! file.open() )
+	return QImage();
+
+    // Image handlers that can't decode a region (ClipRect) themselves read
+    // the complete image; QImageReader then cuts out the region.
+
+    QImageReader reader( file.device() );
+    reader.setClipRect( region );
+    QImage image = reader.read();
+
+    if ( token.isCancelled() || file.isDamaged() )
+	return QImage();
+
+    return image;
+}
+
+
+
+TileCacheWorkerThread::TileCacheWorkerThread( TileCache * tileCache )
+    : _tileCache( tileCache )
+{
+
+}
+
+
+void TileCacheWorkerThread::run()
+{
+    while ( true )
+    {
+	QList<QPoint>		     jobs;
+	QString			     fullPath;
+	QString			     fileVersion;
+	QSize			     origSize;
+	qreal			     zoomFactor;
+	QSharedPointer<ImagePyramid> pyramid;
+	CancelToken		     token;
+
+	{
+	    QMutexLocker locker( &_tileCache->_mutex );
+
+	    while ( ! _tileCache->_shutdown && _tileCache->_pending.isEmpty() )
+		_tileCache->_jobCondition.wait( &_tileCache->_mutex );
+
+	    if ( _tileCache->_shutdown )
+		return;
+
+	    fullPath	= _tileCache->_fullPath;
+	    fileVersion = _tileCache->_fileVersion;
+	    origSize	= _tileCache->_origSize;
+	    zoomFactor	= _tileCache->_zoomFactor;
+	    pyramid	= _tileCache->_pyramid;
+	    token	= _tileCache->_token;
+
+	    // Tiles may have been requested again while they were rendered
+
+	    foreach ( const QPoint & tilePos, _tileCache->_pending )
+	    {
+		if ( ! _tileCache->_tiles.contains( TileCache::tileKey( fullPath, fileVersion, zoomFactor, tilePos ) ) )
+		    jobs << tilePos;
+	    }
+
+	    _tileCache->_pending.clear();
+	}
+
+	if ( jobs.isEmpty() )
+	    continue;
+
+	QElapsedTimer timer;
+	timer.start();
+
+	QSize  imageSize    = TileCache::zoomedSize( origSize, zoomFactor );
+	QRect  sourceRegion = QRect( QPoint( 0, 0 ), origSize );
+	QImage source;
+
+	if ( pyramid )
+	    source = pyramid->fullSizeImage( false ); // don't wait
+
+	if ( source.isNull() )
+	{
+	    // The full size image is not loaded (yet): Decode only the region
+	    // of the image file that all these tiles need.
+
+	    sourceRegion = QRect();
+
+	    foreach ( const QPoint & tilePos, jobs )
+	    {
+		QRect rect = TileCache::tileRect( tilePos, imageSize );
+		sourceRegion |= TileCache::sourceRect( rect, zoomFactor,
+						       QRect( QPoint( 0, 0 ), origSize ) );
+	    }
+
+	    source = TileCache::decodeRegion( fullPath, sourceRegion, token );
+
+	    if ( source.isNull() )
+	    {
+		if ( ! token.isCancelled() )
+		{
+		    logWarning() << "Could not decode region " << sourceRegion
+				 << " of " << fullPath << endl;
+		}
+
+		continue;
+	    }
+	}
+
+	int count = 0;
+
+	foreach ( const QPoint & tilePos, jobs )
+	{
+	    if ( token.isCancelled() )
+		break;
+
+	    QRect  rect = TileCache::tileRect( tilePos, imageSize );
+	    QImage tile = TileCache::renderTile( rect, zoomFactor, source, sourceRegion );
+
+	    {
+		QMutexLocker locker( &_tileCache->_mutex );
+		_tileCache->_tiles.insert( TileCache::tileKey( fullPath, fileVersion, zoomFactor, tilePos ),
+					   new QImage( tile ),
+					   qMax( 1, tile.byteCount() / 1024 ) );
+	    }
+
+	    ++count;
+	    emit _tileCache->tileReady( rect );
+	}
+
+	logDebug() << "Rendered " << count << " tiles in "
+		   << PrefetchCache::formatTime( timer.elapsed() ) << endl;
+    }
+}
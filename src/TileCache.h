@@ -0,0 +1,238 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef TileCache_h
+#define TileCache_h
+
+#include <QObject>
+#include <QString>
+#include <QImage>
+#include <QSize>
+#include <QRect>
+#include <QList>
+#include <QCache>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QSharedPointer>
+
+#include "CancellableFile.h"
+
+class TileCache;
+class ImagePyramid;
+
+
+/**
+ * Helper class: Thread that renders the requested tiles of a TileCache.
+ */
+class TileCacheWorkerThread: public QThread
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    TileCacheWorkerThread( TileCache * tileCache );
+
+protected:
+    /**
+     * Reimplemented from QThread:
+     * This is the worker function.
+     */
+    virtual void run() Q_DECL_OVERRIDE;
+
+private:
+    TileCache * _tileCache;
+};
+
+
+/**
+ * Tile cache for displaying an image with a high zoom factor: Instead of one
+ * pixmap for the complete zoomed image (which at zoom factor 10 would be
+ * 100 times the size of the original image), the zoomed image is divided
+ * into tiles of TileSize x TileSize pixels that are rendered in a
+ * background thread only for the visible part (plus a margin), and only the
+ * most recently used tiles are kept. So the memory needed scales with the
+ * size of the viewport, not with the zoom factor.
+ *
+ * Tiles are cut from the full size image of the photo's ImagePyramid if it
+ * is already loaded; otherwise, only the region of the image file that is
+ * needed for the requested tiles is decoded (QImageReader::setClipRect()).
+ *
+ * All coordinates are in the zoomed image unless noted otherwise.
+ */
+class TileCache: public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Constructor.
+     */
+    TileCache( QObject * parent = 0, qint64 maxSize = DefaultMaxSize );
+
+    /**
+     * Destructor.
+     */
+    virtual ~TileCache();
+
+    /**
+     * Set the image to render tiles for: The image file 'fullPath' with its
+     * original size 'origSize', zoomed by 'zoomFactor'. 'pyramid' (which may
+     * be null) is used for the full size image if it is loaded; the tile
+     * cache keeps it alive as long as this image is set.
+     *
+     * This drops all pending tile requests, but not any tiles already in the
+     * cache: They are still valid if the same image is set again. Tiles are
+     * cached with the size and modification time of the file, so tiles of
+     * a file that was rewritten meanwhile are not used any more.
+     */
+    void setImage( const QString &		   fullPath,
+		   const QSize &		   origSize,
+		   qreal			   zoomFactor,
+		   QSharedPointer<ImagePyramid>	   pyramid );
+
+    /**
+     * Forget the current image and drop all pending tile requests.
+     */
+    void clear();
+
+    /**
+     * Return the size of the zoomed image or an empty size if there is no
+     * image.
+     */
+    QSize size() const;
+
+    /**
+     * Return the zoom factor of the current image.
+     */
+    qreal zoomFactor() const;
+
+    /**
+     * Return the tile at tile position 'tilePos' (in units of tiles, not
+     * pixels) or a null image if it is not rendered yet. This never waits.
+     */
+    QImage tile( const QPoint & tilePos );
+
+    /**
+     * Request all tiles that intersect 'rect' that are not in the cache yet,
+     * the ones closest to the center of 'rect' first. This replaces all
+     * previous requests that are not being rendered already.
+     */
+    void request( const QRect & rect );
+
+    /**
+     * Return the rectangle of tile 'tilePos' clipped to the zoomed image.
+     */
+    QRect tileRect( const QPoint & tilePos ) const;
+
+    /**
+     * Return the maximum number of bytes for all cached tiles.
+     */
+    qint64 maxSize() const;
+
+    /**
+     * Set the maximum number of bytes for all cached tiles. If there are
+     * more now, the least recently used ones are dropped.
+     */
+    void setMaxSize( qint64 maxSize );
+
+    /**
+     * Width and height of one tile in pixels
+     */
+    static const int TileSize = 256;
+
+    /**
+     * Default for maxSize(): 64 MB, i.e. 256 tiles, more than enough for a
+     * 4k screen
+     */
+    static const qint64 DefaultMaxSize = 64LL * 1024 * 1024;
+
+    friend class TileCacheWorkerThread;
+
+signals:
+    /**
+     * Emitted from the worker thread when the tile that covers 'rect' was
+     * rendered.
+     */
+    void tileReady( const QRect & rect );
+
+protected:
+    /**
+     * Return the cache key for tile 'tilePos' of image 'fullPath' in version
+     * 'fileVersion' (see fileVersion()) zoomed by 'zoomFactor'.
+     */
+    static QString tileKey( const QString & fullPath,
+			    const QString & fileVersion,
+			    qreal	    zoomFactor,
+			    const QPoint &  tilePos );
+
+    /**
+     * Return a string that changes whenever the file 'fullPath' is written:
+     * Its size and modification time.
+     */
+    static QString fileVersion( const QString & fullPath );
+
+    /**
+     * Return the size of an image with original size 'origSize' zoomed by
+     * 'zoomFactor'.
+     */
+    static QSize zoomedSize( const QSize & origSize, qreal zoomFactor );
+
+    /**
+     * Return the rectangle of tile 'tilePos' clipped to 'imageSize'.
+     */
+    static QRect tileRect( const QPoint & tilePos, const QSize & imageSize );
+
+    /**
+     * Return the rectangle in the original image that is needed for
+     * rendering 'rect' with zoom factor 'zoomFactor': Rounded outwards,
+     * with one pixel more on each side for the smooth scaling filter and
+     * clipped to 'bounds'.
+     */
+    static QRect sourceRect( const QRect & rect,
+			     qreal	   zoomFactor,
+			     const QRect & bounds );
+
+    /**
+     * Render the tile that covers 'rect' with zoom factor 'zoomFactor' from
+     * 'source' which contains the region 'sourceRegion' of the original
+     * image.
+     */
+    static QImage renderTile( const QRect &  rect,
+			      qreal	     zoomFactor,
+			      const QImage & source,
+			      const QRect &  sourceRegion );
+
+    /**
+     * Decode only the region 'region' of the image file 'fullPath'.
+     * Return a null image if that fails or if 'token' is cancelled.
+     */
+    static QImage decodeRegion( const QString &	    fullPath,
+				const QRect &	    region,
+				const CancelToken & token );
+
+private:
+    mutable QMutex		 _mutex;	 // protects everything below
+    QWaitCondition		 _jobCondition;	 // requests or shutdown
+    QCache<QString, QImage>	 _tiles;	 // cost is in kB
+    QList<QPoint>		 _pending;
+    QString			 _fullPath;
+    QString			 _fileVersion;	 // see fileVersion()
+    QSize			 _origSize;
+    qreal			 _zoomFactor;
+    QSharedPointer<ImagePyramid> _pyramid;
+    CancelToken			 _token;	 // for the current image
+    bool			 _shutdown;
+
+    TileCacheWorkerThread	 _worker;
+};
+
+
+#endif // TileCache_h
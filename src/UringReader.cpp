@@ -0,0 +1,377 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#include <QFile>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined( __linux__ ) && defined( __has_include )
+#  if __has_include( <linux/io_uring.h> )
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    if defined( __NR_io_uring_setup ) && defined( __NR_io_uring_enter )
+#      define HAVE_IO_URING 1
+#    endif
+#  endif
+#endif
+
+#include "UringReader.h"
+#include "Logger.h"
+
+
+struct UringReader::Job
+{
+    QString	 fileName;
+    int		 fd;
+    QByteArray	 data;
+    qint64	 offset;   // how much of 'data' is read already
+    bool	 failed;
+    struct iovec iov;	   // must live until the kernel is done with it
+};
+
+
+UringReader::UringReader( int queueDepth )
+    : _queueDepth( qMax( 1, queueDepth ) )
+    , _ringFd( -1 )
+    , _toSubmit( 0 )
+    , _sqRing( 0 )
+    , _sqRingSize( 0 )
+    , _cqRing( 0 )
+    , _cqRingSize( 0 )
+    , _sqes( 0 )
+    , _sqesSize( 0 )
+    , _sqHead( 0 )
+    , _sqTail( 0 )
+    , _sqMask( 0 )
+    , _sqArray( 0 )
+    , _cqHead( 0 )
+    , _cqTail( 0 )
+    , _cqMask( 0 )
+    , _cqes( 0 )
+{
+    setup();
+}
+
+
+UringReader::~UringReader()
+{
+    // The kernel might still write into the buffers of reads in flight, so
+    // they can only be freed when they are complete.
+
+    while ( ! _jobs.isEmpty() && enter( true ) )
+	;
+
+    if ( ! _jobs.isEmpty() )
+    {
+	logWarning() << "Abandoning " << _jobs.size()
+		     << " io_uring reads still in flight" << endl;
+    }
+
+    foreach ( Job * job, _done )
+    {
+	::close( job->fd );
+	delete job;
+    }
+
+    _done.clear();
+    cleanup();
+}
+
+
+bool UringReader::isAvailable()
+{
+    static const bool available = UringReader( 1 ).isValid();
+
+    return available;
+}
+
+
+void UringReader::setup()
+{
+#ifdef HAVE_IO_URING
+
+    struct io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+
+    _ringFd = (int) syscall( __NR_io_uring_setup, (unsigned) _queueDepth, &params );
+
+    if ( _ringFd < 0 )
+    {
+	logDebug() << "io_uring not available: "
+		   << QString::fromLocal8Bit( strerror( errno ) ) << endl;
+	_ringFd = -1;
+	return;
+    }
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    _cqRingSize = params.cq_off.cqes  + params.cq_entries * sizeof( struct io_uring_cqe );
+    _sqesSize	= params.sq_entries * sizeof( struct io_uring_sqe );
+
+    bool singleMmap = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+
+    if ( singleMmap )
+	_sqRingSize = _cqRingSize = qMax( _sqRingSize, _cqRingSize );
+
+    _sqRing = mmap( 0, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    _ringFd, IORING_OFF_SQ_RING );
+
+    if ( singleMmap )
+	_cqRing = _sqRing;
+    else
+    {
+	_cqRing = mmap( 0, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			_ringFd, IORING_OFF_CQ_RING );
+    }
+
+    _sqes = mmap( 0, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  _ringFd, IORING_OFF_SQES );
+
+    if ( _sqRing == MAP_FAILED ) _sqRing = 0;
+    if ( _cqRing == MAP_FAILED ) _cqRing = 0;
+    if ( _sqes	 == MAP_FAILED ) _sqes	 = 0;
+
+    if ( ! _sqRing || ! _cqRing || ! _sqes )
+    {
+	logWarning() << "Can't map the io_uring queues" << endl;
+	cleanup();
+	return;
+    }
+
+    char * sq = (char *) _sqRing;
+    _sqHead   = (unsigned *) ( sq + params.sq_off.head	   );
+    _sqTail   = (unsigned *) ( sq + params.sq_off.tail	   );
+    _sqMask   = (unsigned *) ( sq + params.sq_off.ring_mask );
+    _sqArray  = (unsigned *) ( sq + params.sq_off.array	   );
+
+    char * cq = (char *) _cqRing;
+    _cqHead   = (unsigned *) ( cq + params.cq_off.head	   );
+    _cqTail   = (unsigned *) ( cq + params.cq_off.tail	   );
+    _cqMask   = (unsigned *) ( cq + params.cq_off.ring_mask );
+    _cqes     = cq + params.cq_off.cqes;
+
+#endif
+}
+
+
+void UringReader::cleanup()
+{
+#ifdef HAVE_IO_URING
+
+    if ( _sqes )
+	munmap( _sqes, _sqesSize );
+
+    if ( _cqRing && _cqRing != _sqRing )
+	munmap( _cqRing, _cqRingSize );
+
+    if ( _sqRing )
+	munmap( _sqRing, _sqRingSize );
+
+#endif
+
+    if ( _ringFd >= 0 )
+	::close( _ringFd );
+
+    _sqes   = 0;
+    _cqRing = 0;
+    _sqRing = 0;
+    _ringFd = -1;
+}
+
+
+bool UringReader::submit( const QString & fileName )
+{
+    if ( ! isValid() || pending() >= _queueDepth )
+	return false;
+
+    int fd = ::open( QFile::encodeName( fileName ).constData(), O_RDONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+	return false;
+
+    struct stat fileInfo;
+
+    if ( fstat( fd, &fileInfo ) != 0 || fileInfo.st_size > INT_MAX )
+    {
+	::close( fd );
+	return false;
+    }
+
+    Job * job	   = new Job;
+    job->fileName  = fileName;
+    job->fd	   = fd;
+    job->data	   = QByteArray( (int) fileInfo.st_size, Qt::Uninitialized );
+    job->offset	   = 0;
+    job->failed	   = false;
+
+    if ( job->data.isEmpty() )
+    {
+	_done << job;
+	return true;
+    }
+
+    _jobs << job;
+    queue( job );
+
+    return true;
+}
+
+
+void UringReader::queue( Job * job )
+{
+#ifdef HAVE_IO_URING
+
+    // Only this thread writes the tail of the submission queue; the kernel
+    // only reads it.
+
+    unsigned tail  = *_sqTail;
+    unsigned index = tail & *_sqMask;
+
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) _sqes + index;
+    memset( sqe, 0, sizeof( *sqe ) );
+
+    job->iov.iov_base = job->data.data() + job->offset;
+    job->iov.iov_len  = job->data.size() - job->offset;
+
+    // IORING_OP_READV rather than IORING_OP_READ: It works with all kernels
+    // that have io_uring at all (5.1 and later).
+
+    sqe->opcode	   = IORING_OP_READV;
+    sqe->fd	   = job->fd;
+    sqe->off	   = job->offset;
+    sqe->addr	   = (quint64) (quintptr) &job->iov;
+    sqe->len	   = 1;
+    sqe->user_data = (quint64) (quintptr) job;
+
+    _sqArray[ index ] = index;
+    __atomic_store_n( _sqTail, tail + 1, __ATOMIC_RELEASE );
+    ++_toSubmit;
+
+#else
+    Q_UNUSED( job );
+#endif
+}
+
+
+bool UringReader::enter( bool wait )
+{
+#ifdef HAVE_IO_URING
+
+    int ret = (int) syscall( __NR_io_uring_enter,
+			     _ringFd,
+			     _toSubmit,
+			     wait ? 1 : 0,		  // min_complete
+			     wait ? IORING_ENTER_GETEVENTS : 0,
+			     (void *) 0, (size_t) 0 );	  // no signal mask
+
+    if ( ret < 0 )
+    {
+	if ( errno == EINTR || errno == EAGAIN )
+	    return true;
+
+	logWarning() << "io_uring_enter() failed: "
+		     << QString::fromLocal8Bit( strerror( errno ) ) << endl;
+	return false;
+    }
+
+    _toSubmit -= ret; // the number of submitted requests
+    reap();
+
+    return true;
+
+#else
+    Q_UNUSED( wait );
+    return false;
+#endif
+}
+
+
+void UringReader::reap()
+{
+#ifdef HAVE_IO_URING
+
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n( _cqTail, __ATOMIC_ACQUIRE );
+
+    while ( head != tail )
+    {
+	struct io_uring_cqe * cqe = (struct io_uring_cqe *) _cqes + ( head & *_cqMask );
+	Job * job = (Job *) (quintptr) cqe->user_data;
+	int   res = cqe->res;
+	++head;
+
+	bool complete = true;
+
+	if ( res == -EINTR || res == -EAGAIN )
+	{
+	    queue( job );
+	    complete = false;
+	}
+	else if ( res < 0 )
+	{
+	    logWarning() << "Error reading " << job->fileName << ": "
+			 << QString::fromLocal8Bit( strerror( -res ) ) << endl;
+	    job->failed = true;
+	}
+	else if ( res == 0 )
+	{
+	    // The file got shorter since it was opened
+
+	    job->data.truncate( job->offset );
+	}
+	else
+	{
+	    job->offset += res;
+
+	    if ( job->offset < job->data.size() ) // short read: continue
+	    {
+		queue( job );
+		complete = false;
+	    }
+	}
+
+	if ( complete )
+	{
+	    _jobs.removeOne( job );
+	    _done << job;
+	}
+    }
+
+    __atomic_store_n( _cqHead, head, __ATOMIC_RELEASE );
+
+#endif
+}
+
+
+bool UringReader::waitForCompletion( QString * fileName, QByteArray * bytes )
+{
+    while ( _done.isEmpty() )
+    {
+	if ( _jobs.isEmpty() || ! enter( true ) )
+	    return false;
+    }
+
+    Job * job = _done.takeFirst();
+    ::close( job->fd );
+
+    if ( fileName )
+	*fileName = job->fileName;
+
+    if ( bytes )
+	*bytes = job->failed ? QByteArray() : job->data;
+
+    delete job;
+
+    return true;
+}
@@ -0,0 +1,154 @@
+/*
+ * QPhotoView core classes
+ *
+ * License: GPL V2. See file COPYING for details.
+ *
+ * Author:  Stefan Hundhammer <Stefan.Hundhammer@gmx.de>
+ */
+
+#ifndef UringReader_h
+#define UringReader_h
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+
+
+/**
+ * Reader for complete files with Linux io_uring: Many reads are in flight
+ * at the same time, all from one thread, so fast storage like NVMe gets
+ * enough requests to be saturated without one blocking thread per request.
+ *
+ * Files are queued with submit() and returned in the order they are
+ * complete with waitForCompletion(). Each file is read into one QByteArray
+ * of its full size; short reads are continued automatically.
+ *
+ * This talks to the kernel directly (io_uring_setup() and io_uring_enter()),
+ * without liburing. If io_uring is not available (older kernels, not Linux,
+ * disabled with the kernel.io_uring_disabled sysctl or by a seccomp filter
+ * in a container), isValid() returns 'false' and the caller has to read the
+ * files some other way.
+ *
+ * An object of this class may only be used by one thread at a time.
+ */
+class UringReader
+{
+public:
+    /**
+     * Constructor: Set up a ring for 'queueDepth' files in flight at the
+     * same time.
+     */
+    UringReader( int queueDepth = DefaultQueueDepth );
+
+    /**
+     * Destructor. This waits until the kernel is done with all reads that
+     * are still in flight and discards them.
+     */
+    virtual ~UringReader();
+
+    /**
+     * Return 'true' if the ring could be set up.
+     */
+    bool isValid() const { return _ringFd >= 0; }
+
+    /**
+     * Return 'true' if io_uring can be used in this process. This is only
+     * checked once.
+     */
+    static bool isAvailable();
+
+    /**
+     * Return the maximum number of files in flight.
+     */
+    int queueDepth() const { return _queueDepth; }
+
+    /**
+     * Return the number of files that are submitted, but not returned by
+     * waitForCompletion() yet.
+     */
+    int pending() const { return _jobs.size() + _done.size(); }
+
+    /**
+     * Open the specified file and queue reading all of it. The read is
+     * started with the next waitForCompletion().
+     *
+     * Return 'false' if the file can't be opened, if the ring is not valid
+     * or if queueDepth() files are already pending.
+     */
+    bool submit( const QString & fileName );
+
+    /**
+     * Wait until one of the submitted files is completely read and return
+     * its name in 'fileName' and its content in 'bytes'. 'bytes' is a null
+     * byte array if reading failed.
+     *
+     * Return 'false' if no files are pending.
+     */
+    bool waitForCompletion( QString * fileName, QByteArray * bytes );
+
+    /**
+     * Default for queueDepth()
+     */
+    static const int DefaultQueueDepth = 32;
+
+protected:
+
+    struct Job;
+
+    /**
+     * Put a read request for the rest of 'job' into the submission queue.
+     */
+    void queue( Job * job );
+
+    /**
+     * Submit all queued requests and wait for at least one completion
+     * (unless 'wait' is false), then handle all completions there are.
+     * Return 'false' if io_uring_enter() failed.
+     */
+    bool enter( bool wait );
+
+    /**
+     * Handle all entries in the completion queue.
+     */
+    void reap();
+
+    /**
+     * Set up the ring and map its queues into memory.
+     */
+    void setup();
+
+    /**
+     * Unmap the queues and close the ring.
+     */
+    void cleanup();
+
+private:
+    Q_DISABLE_COPY( UringReader );
+
+    int		  _queueDepth;
+    int		  _ringFd;
+    unsigned	  _toSubmit;	// queued, but not submitted to the kernel yet
+    QList<Job *>  _jobs;	// pending, in submission order
+    QList<Job *>  _done;	// complete, not returned yet
+
+    // The rings shared with the kernel
+
+    void *	  _sqRing;
+    size_t	  _sqRingSize;
+    void *	  _cqRing;
+    size_t	  _cqRingSize;
+    void *	  _sqes;
+    size_t	  _sqesSize;
+
+    unsigned *	  _sqHead;
+    unsigned *	  _sqTail;
+    unsigned *	  _sqMask;
+    unsigned *	  _sqArray;
+    unsigned *	  _cqHead;
+    unsigned *	  _cqTail;
+    unsigned *	  _cqMask;
+    void *	  _cqes;
+};
+
+
+#endif // UringReader_h
@@ -40,7 +40,19 @@ SOURCES =			\
     PhotoDir.cpp		\
     Photo.cpp			\
     PhotoMetaData.cpp		\
+    ExifReader.cpp		\
     PrefetchCache.cpp		\
+    PrefetchJobQueue.cpp	\
+    ReadAheadCache.cpp		\
+    UringReader.cpp		\
+    CancellableFile.cpp		\
+    MappedFile.cpp		\
+    DiskCache.cpp		\
+    ScaleKernels.cpp		\
+    ImageScaler.cpp		\
+    ImagePyramid.cpp		\
+    TileCache.cpp		\
+    MemoryMonitor.cpp		\
     Canvas.cpp			\
     Panner.cpp			\
     Fraction.cpp		\
@@ -58,7 +70,19 @@ HEADERS =			\
     PhotoDir.h			\
     Photo.h			\
     PhotoMetaData.h		\
+    ExifReader.h		\
     PrefetchCache.h		\
+    PrefetchJobQueue.h		\
+    ReadAheadCache.h		\
+    UringReader.h		\
+    CancellableFile.h		\
+    MappedFile.h		\
+    DiskCache.h			\
+    ScaleKernels.h		\
+    ImageScaler.h		\
+    ImagePyramid.h		\
+    TileCache.h			\
+    MemoryMonitor.h		\
     Canvas.h			\
     Panner.h			\
     Fraction.h			\